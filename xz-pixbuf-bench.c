@@ -0,0 +1,138 @@
+/* xz-pixbuf-bench - incremental load benchmark for the .image.xz Image Loader
+ *
+ * Author(s): Leo Izen (thebombzen) <leo.izen@gmail.com>
+ *
+ * Copyright (C) 2020 Leo Izen (thebombzen)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Loads a file through the module's incremental path, fed in pieces of every power of four from 64 bytes to 4 MiB,
+ * and prints the best time of each piece size, see gdk_pixbuf__load_xz_image_increment
+ * The last row times the one-shot load from the file, as gdk_pixbuf_new_from_file does it
+ *
+ * Usage: xz-pixbuf-bench FILE [RUNS]
+ */
+
+#define GDK_PIXBUF_ENABLE_BACKEND
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#define BENCH_MIN_PIECE 64
+#define BENCH_MAX_PIECE (4 << 20)
+
+void fill_vtable(GdkPixbufModule *module);
+
+static void bench_prepared(GdkPixbuf *pixbuf, GdkPixbufAnimation *animation, gpointer user_data){
+}
+
+/* One incremental load of data in pieces of piece bytes, returning its time in milliseconds, or a negative number on failure */
+static double bench_load(GdkPixbufModule *module, const guchar *data, gsize size, gsize piece, GError **error){
+    gint64 start = g_get_monotonic_time();
+
+    gpointer context = module->begin_load(NULL, bench_prepared, NULL, NULL, error);
+    if (!context)
+        return -1;
+    for (gsize offset = 0; offset < size; offset += piece){
+        if (!module->load_increment(context, data + offset, MIN(piece, size - offset), error)){
+            module->stop_load(context, NULL);
+            return -1;
+        }
+    }
+    if (!module->stop_load(context, error))
+        return -1;
+    return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+/* One load of the whole file through the one-shot path, returning its time in milliseconds, or a negative number on failure */
+static double bench_load_file(GdkPixbufModule *module, const char *path, GError **error){
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return -1;
+
+    gint64 start = g_get_monotonic_time();
+    GdkPixbuf *pixbuf = module->load(file, error);
+    gint64 end = g_get_monotonic_time();
+    fclose(file);
+    if (!pixbuf)
+        return -1;
+    g_object_unref(pixbuf);
+    return (end - start) / 1000.0;
+}
+
+int main(int argc, char **argv){
+    GdkPixbufModule module = { 0 };
+    GError *error = NULL;
+    gchar *data;
+    gsize size;
+
+    if (argc < 2 || argc > 3){
+        fprintf(stderr, "Usage: %s FILE [RUNS]\n", argv[0]);
+        return 2;
+    }
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+    if (runs < 1)
+        runs = 1;
+    if (!g_file_get_contents(argv[1], &data, &size, &error)){
+        fprintf(stderr, "%s: %s\n", argv[0], error->message);
+        return 1;
+    }
+    fill_vtable(&module);
+
+    printf("%10s %10s %12s %10s\n", "piece", "writes", "best ms", "MB/s");
+    for (gsize piece = BENCH_MIN_PIECE; piece <= BENCH_MAX_PIECE; piece *= 4){
+        double best = -1;
+        for (int run = 0; run < runs; run++){
+            double elapsed = bench_load(&module, (const guchar *) data, size, piece, &error);
+            if (elapsed < 0){
+                fprintf(stderr, "%s: %s\n", argv[0], error ? error->message : "load failed");
+                g_free(data);
+                return 1;
+            }
+            if (best < 0 || elapsed < best)
+                best = elapsed;
+        }
+        printf("%10" G_GSIZE_FORMAT " %10" G_GSIZE_FORMAT " %12.2f %10.1f\n",
+            piece, (size + piece - 1) / piece, best, best > 0 ? size / best / 1000.0 : 0.0);
+    }
+
+    double best = -1;
+    for (int run = 0; run < runs; run++){
+        double elapsed = bench_load_file(&module, argv[1], &error);
+        if (elapsed < 0){
+            fprintf(stderr, "%s: %s\n", argv[0], error ? error->message : "load failed");
+            g_free(data);
+            return 1;
+        }
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+    printf("%10s %10s %12.2f %10.1f\n", "one-shot", "-", best, best > 0 ? size / best / 1000.0 : 0.0);
+
+    g_free(data);
+    return 0;
+}
@@ -0,0 +1,434 @@
+/* xz-pixbuf-broker - shared decompression for the .image.xz Image Loader
+ *
+ * Author(s): Leo Izen (thebombzen) <leo.izen@gmail.com>
+ *
+ * Copyright (C) 2020 Leo Izen (thebombzen)
+ *
+ * Permission is hereby granted, free of charge, to any person 
+ * obtaining a copy of this software and associated documentation 
+ * files (the "Software"), to deal in the Software without 
+ * restriction, including without limitation the rights to use, 
+ * copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following 
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be 
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES 
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR 
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Decompresses each .xz image once for all local processes that ask for it
+ * The decompressed file is kept in a sealed memfd, which clients map read-only
+ * Only processes of the user running the broker may connect, as the cache would tell one user what another loaded
+ *
+ * Usage: xz-pixbuf-broker [-c cache-bytes] [-m max-image-bytes] [-l memlimit] [-n max-clients] SOCKET
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <glib.h>
+#include <lzma.h>
+
+#include "xz-pixbuf-broker.h"
+
+#define XZ_BROKER_OUTPUT_BUFFER_SIZE (1 << 20)
+
+/* One decompressed image, or one that is still being decompressed */
+typedef struct {
+    char *key;
+    int fd;
+    uint64_t size;
+    XZBrokerStatus status;
+    gboolean done;
+    unsigned int waiters;
+    GList *lru_link;
+} XZBrokerEntry;
+
+static GMutex broker_mutex;
+static GCond broker_cond;
+static GHashTable *broker_table;
+static GQueue broker_lru = G_QUEUE_INIT;
+static uint64_t broker_total;
+static uint64_t broker_cache_bytes = 256 << 20;
+static uint64_t broker_max_image_bytes = 1 << 30;
+static uint64_t broker_memlimit = 256 << 20;
+
+/* Connections being served, each by its own thread, and how many may be at once */
+static GCond broker_client_cond;
+static unsigned int broker_clients;
+static unsigned int broker_max_clients = 64;
+
+static void xz_broker_entry_free(XZBrokerEntry *entry){
+    if (entry->fd >= 0)
+        close(entry->fd);
+    g_free(entry->key);
+    free(entry);
+}
+
+/* Drop least recently used images until the cache fits again, called with the lock held */
+static void xz_broker_evict(void){
+    while (broker_total > broker_cache_bytes){
+        XZBrokerEntry *entry = (XZBrokerEntry *) g_queue_pop_tail(&broker_lru);
+        if (!entry)
+            break;
+        broker_total -= entry->size;
+        entry->lru_link = NULL;
+        g_hash_table_remove(broker_table, entry->key);
+        if (entry->waiters == 0)
+            xz_broker_entry_free(entry);
+    }
+}
+
+static gboolean xz_broker_write_all(int fd, const uint8_t *buf, size_t size){
+    while (size > 0){
+        ssize_t ret = write(fd, buf, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return FALSE;
+        buf += ret;
+        size -= ret;
+    }
+    return TRUE;
+}
+
+/* Decompress input into a new sealed memfd */
+static XZBrokerStatus xz_broker_decode(const uint8_t *input, size_t input_size, int *out_fd, uint64_t *out_size){
+    lzma_stream lzstream = LZMA_STREAM_INIT;
+    XZBrokerStatus status = XZ_BROKER_DECODE_FAILED;
+    uint8_t *buffer = NULL;
+    lzma_ret lzret;
+
+    int fd = memfd_create("xz-pixbuf-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return XZ_BROKER_DECODE_FAILED;
+    buffer = (uint8_t *) malloc(XZ_BROKER_OUTPUT_BUFFER_SIZE);
+    if (!buffer || lzma_stream_decoder(&lzstream, broker_memlimit, LZMA_CONCATENATED) != LZMA_OK)
+        goto failure;
+
+    lzstream.next_in = input;
+    lzstream.avail_in = input_size;
+    do {
+        lzstream.next_out = buffer;
+        lzstream.avail_out = XZ_BROKER_OUTPUT_BUFFER_SIZE;
+        lzret = lzma_code(&lzstream, LZMA_FINISH);
+        /* A file that needs more memory than -l allows is refused like one that decompresses to too much */
+        if (lzret == LZMA_MEMLIMIT_ERROR)
+            status = XZ_BROKER_TOO_LARGE;
+        if (lzret != LZMA_OK && lzret != LZMA_STREAM_END)
+            goto failure;
+        if (lzstream.total_out > broker_max_image_bytes){
+            status = XZ_BROKER_TOO_LARGE;
+            goto failure;
+        }
+        if (!xz_broker_write_all(fd, buffer, lzstream.next_out - buffer))
+            goto failure;
+    } while (lzret != LZMA_STREAM_END);
+
+    if (fcntl(fd, F_ADD_SEALS, XZ_BROKER_REQUIRED_SEALS | F_SEAL_SEAL) != 0)
+        goto failure;
+
+    *out_fd = fd;
+    *out_size = lzstream.total_out;
+    lzma_end(&lzstream);
+    free(buffer);
+    return XZ_BROKER_OK;
+
+failure:
+    lzma_end(&lzstream);
+    free(buffer);
+    close(fd);
+    return status;
+}
+
+/*
+ * Find or make the decompressed image for input, keyed on its SHA-256
+ * Requests for an image that is already being decompressed wait for it
+ * On success, *out_fd is a new fd the caller has to close
+ */
+static XZBrokerStatus xz_broker_lookup(const uint8_t *input, size_t input_size, int *out_fd, uint64_t *out_size){
+    char *key = g_compute_checksum_for_data(G_CHECKSUM_SHA256, input, input_size);
+    XZBrokerStatus status;
+    int fd = -1;
+    uint64_t size = 0;
+
+    g_mutex_lock(&broker_mutex);
+    XZBrokerEntry *entry = (XZBrokerEntry *) g_hash_table_lookup(broker_table, key);
+    if (entry){
+        g_free(key);
+        entry->waiters++;
+        while (!entry->done)
+            g_cond_wait(&broker_cond, &broker_mutex);
+        entry->waiters--;
+        status = entry->status;
+        if (status == XZ_BROKER_OK){
+            *out_fd = fcntl(entry->fd, F_DUPFD_CLOEXEC, 0);
+            *out_size = entry->size;
+            if (*out_fd < 0)
+                status = XZ_BROKER_DECODE_FAILED;
+        }
+        /* Entries that are not in the cache are freed by whoever looks at them last */
+        if (!entry->lru_link && entry->waiters == 0)
+            xz_broker_entry_free(entry);
+        else if (entry->lru_link){
+            g_queue_unlink(&broker_lru, entry->lru_link);
+            g_queue_push_head_link(&broker_lru, entry->lru_link);
+        }
+        g_mutex_unlock(&broker_mutex);
+        return status;
+    }
+
+    entry = (XZBrokerEntry *) calloc(1, sizeof(XZBrokerEntry));
+    if (!entry){
+        g_mutex_unlock(&broker_mutex);
+        g_free(key);
+        return XZ_BROKER_DECODE_FAILED;
+    }
+    entry->key = key;
+    entry->fd = -1;
+    g_hash_table_insert(broker_table, entry->key, entry);
+    g_mutex_unlock(&broker_mutex);
+
+    status = xz_broker_decode(input, input_size, &fd, &size);
+
+    g_mutex_lock(&broker_mutex);
+    entry->done = TRUE;
+    entry->status = status;
+    entry->fd = fd;
+    entry->size = size;
+    if (status == XZ_BROKER_OK){
+        *out_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        *out_size = size;
+        if (*out_fd < 0)
+            status = XZ_BROKER_DECODE_FAILED;
+    }
+    g_hash_table_remove(broker_table, entry->key);
+    if (entry->status == XZ_BROKER_OK && size <= broker_cache_bytes){
+        g_hash_table_insert(broker_table, entry->key, entry);
+        g_queue_push_head(&broker_lru, entry);
+        entry->lru_link = g_queue_peek_head_link(&broker_lru);
+        broker_total += size;
+        xz_broker_evict();
+    }
+    g_cond_broadcast(&broker_cond);
+    if (!entry->lru_link && entry->waiters == 0)
+        xz_broker_entry_free(entry);
+    g_mutex_unlock(&broker_mutex);
+    return status;
+}
+
+/* Receive one request with its fd, returns 0 on orderly shutdown and -1 on a malformed request */
+static int xz_broker_receive(int sock, XZBrokerRequest *request, int *input_fd){
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { request, sizeof(*request) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    *input_fd = -1;
+    if (received <= 0)
+        return 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        memcpy(input_fd, CMSG_DATA(cmsg), sizeof(int));
+    if ((size_t) received != sizeof(*request) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || *input_fd < 0)
+        return -1;
+    return 1;
+}
+
+static void xz_broker_reply(int sock, XZBrokerStatus status, int payload_fd, uint64_t size){
+    XZBrokerReply reply = { status, 0, size };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { &reply, sizeof(reply) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (status == XZ_BROKER_OK){
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &payload_fd, sizeof(int));
+    }
+    sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+static void xz_broker_handle_request(int sock, const XZBrokerRequest *request, int input_fd){
+    struct stat st;
+    int payload_fd = -1;
+    uint64_t size = 0;
+
+    /* The client must not be able to change the input under us */
+    int seals = fcntl(input_fd, F_GET_SEALS);
+    if (request->version != XZ_BROKER_VERSION || seals < 0 || (seals & XZ_BROKER_REQUIRED_SEALS) != XZ_BROKER_REQUIRED_SEALS ||
+            fstat(input_fd, &st) != 0 || st.st_size == 0){
+        xz_broker_reply(sock, XZ_BROKER_BAD_REQUEST, -1, 0);
+        return;
+    }
+
+    void *input = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+    if (input == MAP_FAILED){
+        xz_broker_reply(sock, XZ_BROKER_BAD_REQUEST, -1, 0);
+        return;
+    }
+    XZBrokerStatus status = xz_broker_lookup((const uint8_t *) input, st.st_size, &payload_fd, &size);
+    munmap(input, st.st_size);
+
+    xz_broker_reply(sock, status, payload_fd, size);
+    if (payload_fd >= 0)
+        close(payload_fd);
+}
+
+static gpointer xz_broker_client_thread(gpointer data){
+    int sock = GPOINTER_TO_INT(data);
+    XZBrokerRequest request;
+    int input_fd;
+    int ret;
+
+    while ((ret = xz_broker_receive(sock, &request, &input_fd)) != 0){
+        if (ret < 0)
+            xz_broker_reply(sock, XZ_BROKER_BAD_REQUEST, -1, 0);
+        else
+            xz_broker_handle_request(sock, &request, input_fd);
+        if (input_fd >= 0)
+            close(input_fd);
+        if (ret < 0)
+            break;
+    }
+    close(sock);
+
+    g_mutex_lock(&broker_mutex);
+    broker_clients--;
+    g_cond_signal(&broker_client_cond);
+    g_mutex_unlock(&broker_mutex);
+    return NULL;
+}
+
+/* Whether the peer runs as the same user as the broker */
+static gboolean xz_broker_trusted_peer(int sock){
+    struct ucred cred;
+    socklen_t cred_size = sizeof(cred);
+
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_size) == 0 && cred_size == sizeof(cred) &&
+        cred.uid == geteuid();
+}
+
+static int xz_broker_listen(const char *path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "xz-pixbuf-broker: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0){
+        perror("xz-pixbuf-broker: socket");
+        return -1;
+    }
+    unlink(path);
+    /* The socket is created with mode 0600, so other users can't even connect */
+    mode_t old_umask = umask(0177);
+    int ret = bind(sock, (struct sockaddr *) &addr, sizeof(addr));
+    umask(old_umask);
+    if (ret != 0 || listen(sock, 64) != 0){
+        perror("xz-pixbuf-broker: bind");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int main(int argc, char **argv){
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:m:l:n:")) != -1){
+        if (opt == 'c')
+            broker_cache_bytes = g_ascii_strtoull(optarg, NULL, 10);
+        else if (opt == 'm')
+            broker_max_image_bytes = g_ascii_strtoull(optarg, NULL, 10);
+        else if (opt == 'l')
+            broker_memlimit = g_ascii_strtoull(optarg, NULL, 10);
+        else if (opt == 'n')
+            broker_max_clients = (unsigned int) CLAMP(g_ascii_strtoull(optarg, NULL, 10), 1, 4096);
+        else
+            break;
+    }
+    if (opt != -1 || optind != argc - 1 || broker_memlimit == 0){
+        fprintf(stderr, "Usage: %s [-c cache-bytes] [-m max-image-bytes] [-l memlimit] [-n max-clients] SOCKET\n", argv[0]);
+        return 2;
+    }
+
+    broker_table = g_hash_table_new(g_str_hash, g_str_equal);
+    int listen_sock = xz_broker_listen(argv[optind]);
+    if (listen_sock < 0)
+        return 1;
+
+    while (TRUE){
+        /* Further connections wait in the listen backlog until a client thread is free */
+        g_mutex_lock(&broker_mutex);
+        while (broker_clients >= broker_max_clients)
+            g_cond_wait(&broker_client_cond, &broker_mutex);
+        g_mutex_unlock(&broker_mutex);
+
+        int sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0){
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("xz-pixbuf-broker: accept");
+            continue;
+        }
+        if (!xz_broker_trusted_peer(sock)){
+            close(sock);
+            continue;
+        }
+        g_mutex_lock(&broker_mutex);
+        broker_clients++;
+        g_mutex_unlock(&broker_mutex);
+        GThread *thread = g_thread_try_new("xz-pixbuf-broker", xz_broker_client_thread, GINT_TO_POINTER(sock), NULL);
+        if (thread){
+            g_thread_unref(thread);
+        } else {
+            close(sock);
+            g_mutex_lock(&broker_mutex);
+            broker_clients--;
+            g_mutex_unlock(&broker_mutex);
+        }
+    }
+}
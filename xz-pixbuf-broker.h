@@ -0,0 +1,68 @@
+/* GdkPixbuf library - .image.xz Image Loader
+ *
+ * Author(s): Leo Izen (thebombzen) <leo.izen@gmail.com>
+ *
+ * Copyright (C) 2020 Leo Izen (thebombzen)
+ *
+ * Permission is hereby granted, free of charge, to any person 
+ * obtaining a copy of this software and associated documentation 
+ * files (the "Software"), to deal in the Software without 
+ * restriction, including without limitation the rights to use, 
+ * copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following 
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be 
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES 
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR 
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Wire protocol between the loader and xz-pixbuf-broker
+ *
+ * The loader connects to the broker's SOCK_SEQPACKET Unix socket and sends one
+ * XZBrokerRequest, with a sealed memfd holding the compressed file attached as
+ * SCM_RIGHTS. The broker answers with one XZBrokerReply and, on success, a sealed
+ * memfd holding the decompressed inner file. Both sides refuse fds that are not
+ * sealed against writing and shrinking.
+ */
+
+#ifndef XZ_PIXBUF_BROKER_H
+#define XZ_PIXBUF_BROKER_H
+
+#include <stdint.h>
+
+#define XZ_BROKER_VERSION 1
+
+/* The seals each side insists on before trusting a mapping of the other's memfd */
+#define XZ_BROKER_REQUIRED_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+typedef struct {
+    uint32_t version;
+    uint32_t reserved;
+} XZBrokerRequest;
+
+typedef enum {
+    XZ_BROKER_OK,
+    XZ_BROKER_BAD_REQUEST,
+    XZ_BROKER_DECODE_FAILED,
+    XZ_BROKER_TOO_LARGE
+} XZBrokerStatus;
+
+typedef struct {
+    uint32_t status;
+    uint32_t reserved;
+    uint64_t size;
+} XZBrokerReply;
+
+#endif /* XZ_PIXBUF_BROKER_H */
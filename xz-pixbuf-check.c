@@ -0,0 +1,517 @@
+/* xz-pixbuf-check - round-trip tests for the .image.xz Image Loader
+ *
+ * Author(s): Leo Izen (thebombzen) <leo.izen@gmail.com>
+ *
+ * Copyright (C) 2020 Leo Izen (thebombzen)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Saves images with each of the module's save options and loads them back through gdk-pixbuf,
+ * whole with gdk_pixbuf_new_from_file and in pieces with a GdkPixbufLoader, then checks regions, sidecars and the caches
+ * make check points GDK_PIXBUF_MODULE_FILE at a loaders.cache holding the module just built, and runs this once
+ * without caches and once with each cache tier, whose environment variables are set here before the first load
+ * The module's own functions and counters are looked up with dlsym, in the same copy of the module gdk-pixbuf uses
+ *
+ * Usage: xz-pixbuf-check MODULE [none|memory|disk|pixel]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+
+#include <glib/gstdio.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <lzma.h>
+
+#include "xz-pixbuf-loader.h"
+
+#define CHECK_WIDTH 512
+#define CHECK_HEIGHT 384
+#define CHECK_PIECE 4096
+
+typedef size_t (*XZGetStatsFunc)(XZPixbufLoaderStats *stats, size_t stats_size);
+typedef int (*XZGetFileInfoFunc)(const char *filename, XZPixbufFileInfo *info, size_t info_size);
+typedef int (*XZWriteIndexFunc)(const char *filename);
+typedef GdkPixbuf *(*XZLoadRegionFunc)(const char *filename, int x, int y, int width, int height, double scale, GError **error);
+
+typedef enum {
+    CHECK_CACHE_NONE,
+    CHECK_CACHE_MEMORY,
+    CHECK_CACHE_DISK,
+    CHECK_CACHE_PIXEL
+} CheckCache;
+
+/* One way of saving, with its options as key, value pairs */
+typedef struct {
+    const char *name;
+    const char *options[8];
+} CheckSave;
+
+static const CheckSave check_saves[] = {
+    { "default", { "xz-inner-format", "png", NULL } },
+    { "store", { "xz-inner-format", "png", "xz-store", "yes", NULL } },
+    { "block-rows", { "xz-inner-format", "bmp", "xz-block-rows", "16", NULL } },
+    { "reset-interval", { "xz-inner-format", "bmp", "xz-reset-interval", "64KiB", NULL } },
+    { "header-block", { "xz-inner-format", "png", "xz-header-block", "yes", NULL } },
+    { "pyramid", { "xz-inner-format", "png", "xz-pyramid", "3", NULL } },
+};
+
+static XZGetStatsFunc get_stats;
+static XZGetFileInfoFunc get_file_info;
+static XZWriteIndexFunc write_index;
+static XZLoadRegionFunc load_region;
+static int failures;
+
+static void check(gboolean passed, const char *test, const char *detail){
+    if (passed){
+        printf("PASS %s\n", test);
+    } else {
+        printf("FAIL %s%s%s\n", test, detail ? ": " : "", detail ? detail : "");
+        failures++;
+    }
+}
+
+static XZPixbufLoaderStats check_stats(void){
+    XZPixbufLoaderStats stats = { 0 };
+    get_stats(&stats, sizeof(stats));
+    return stats;
+}
+
+/* An opaque RGB image whose pixels depend on seed, with enough detail that the xz options have something to work on */
+static GdkPixbuf *check_image(int width, int height, unsigned int seed){
+    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+    guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+
+    for (int y = 0; y < height; y++){
+        for (int x = 0; x < width * 3; x++)
+            pixels[y * rowstride + x] = (guchar) ((x * seed + y * 3) ^ (x * y >> 6) ^ (g_random_int() & 7));
+    }
+    return pixbuf;
+}
+
+static gboolean check_same_pixels(GdkPixbuf *a, GdkPixbuf *b){
+    if (!a || !b || gdk_pixbuf_get_width(a) != gdk_pixbuf_get_width(b) || gdk_pixbuf_get_height(a) != gdk_pixbuf_get_height(b) ||
+            gdk_pixbuf_get_n_channels(a) != gdk_pixbuf_get_n_channels(b))
+        return FALSE;
+
+    const guchar *pixels_a = gdk_pixbuf_read_pixels(a), *pixels_b = gdk_pixbuf_read_pixels(b);
+    size_t row_size = (size_t) gdk_pixbuf_get_width(a) * gdk_pixbuf_get_n_channels(a);
+    for (int y = 0; y < gdk_pixbuf_get_height(a); y++){
+        if (memcmp(pixels_a + (size_t) y * gdk_pixbuf_get_rowstride(a), pixels_b + (size_t) y * gdk_pixbuf_get_rowstride(b), row_size))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Split the options into the NULL terminated key and value arrays gdk-pixbuf takes */
+static void check_save_options(const CheckSave *save, char **keys, char **values){
+    int i;
+    for (i = 0; save->options[2 * i]; i++){
+        keys[i] = (char *) save->options[2 * i];
+        values[i] = (char *) save->options[2 * i + 1];
+    }
+    keys[i] = values[i] = NULL;
+}
+
+static gboolean check_save(GdkPixbuf *pixbuf, const char *path, const CheckSave *save, GError **error){
+    char *keys[G_N_ELEMENTS(save->options)], *values[G_N_ELEMENTS(save->options)];
+
+    check_save_options(save, keys, values);
+    return gdk_pixbuf_savev(pixbuf, path, "xz", keys, values, error);
+}
+
+static void check_size_prepared(GdkPixbufLoader *loader, int width, int height, gpointer data){
+    int scale = GPOINTER_TO_INT(data);
+    if (scale > 1)
+        gdk_pixbuf_loader_set_size(loader, width / scale, height / scale);
+}
+
+/* Load path in pieces, the way network clients do, asking for 1/scale of the image's size */
+static GdkPixbuf *check_load_incremental(const char *path, int scale, GError **error){
+    GdkPixbuf *pixbuf = NULL;
+    gchar *data;
+    gsize size;
+
+    if (!g_file_get_contents(path, &data, &size, error))
+        return NULL;
+    GdkPixbufLoader *loader = gdk_pixbuf_loader_new_with_type("xz", error);
+    if (!loader){
+        g_free(data);
+        return NULL;
+    }
+    g_signal_connect(loader, "size-prepared", G_CALLBACK(check_size_prepared), GINT_TO_POINTER(scale));
+
+    gboolean written = TRUE;
+    for (gsize offset = 0; written && offset < size; offset += CHECK_PIECE)
+        written = gdk_pixbuf_loader_write(loader, (const guchar *) data + offset, MIN(CHECK_PIECE, size - offset), error);
+    if (gdk_pixbuf_loader_close(loader, written ? error : NULL) && written)
+        pixbuf = g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+    g_object_unref(loader);
+    g_free(data);
+    return pixbuf;
+}
+
+/* Save with one set of options, then load the file back whole and in pieces, and compare with what was saved */
+static void check_round_trip(const char *dir, GdkPixbuf *image, const CheckSave *save){
+    char *path = g_strdup_printf("%s/%s.xz", dir, save->name);
+    char *test = g_strdup_printf("save %s", save->name);
+    GError *error = NULL;
+
+    gboolean saved = check_save(image, path, save, &error);
+    check(saved, test, error ? error->message : NULL);
+    g_clear_error(&error);
+    g_free(test);
+    if (!saved){
+        g_free(path);
+        return;
+    }
+
+    /* save_to_callback writes the same bytes as save, with one encoder thread */
+    char *keys[G_N_ELEMENTS(save->options)], *values[G_N_ELEMENTS(save->options)];
+    check_save_options(save, keys, values);
+    gchar *buffer = NULL, *contents = NULL;
+    gsize buffer_size = 0, contents_size = 0;
+    test = g_strdup_printf("save_to_callback %s", save->name);
+    check(gdk_pixbuf_save_to_bufferv(image, &buffer, &buffer_size, "xz", keys, values, &error) &&
+        g_file_get_contents(path, &contents, &contents_size, NULL) &&
+        buffer_size == contents_size && !memcmp(buffer, contents, buffer_size), test, error ? error->message : NULL);
+    g_clear_error(&error);
+    g_free(buffer);
+    g_free(contents);
+    g_free(test);
+
+    XZPixbufLoaderStats before = check_stats();
+    GdkPixbuf *loaded = gdk_pixbuf_new_from_file(path, &error);
+    XZPixbufLoaderStats after = check_stats();
+    test = g_strdup_printf("load %s", save->name);
+    check(check_same_pixels(image, loaded), test, error ? error->message : "pixels differ");
+    g_clear_error(&error);
+    g_free(test);
+    if (loaded)
+        g_object_unref(loaded);
+
+    /* Without a cache hit in the way, these files take the paths they were saved for */
+    if (!strcmp(save->name, "block-rows"))
+        check(after.parallel_decodes == before.parallel_decodes + 1, "load block-rows decodes its blocks in parallel", NULL);
+    if (!strcmp(save->name, "reset-interval"))
+        check(after.segment_decodes == before.segment_decodes + 1, "load reset-interval decodes its segments in parallel", NULL);
+
+    loaded = check_load_incremental(path, 1, &error);
+    test = g_strdup_printf("incremental load %s", save->name);
+    check(check_same_pixels(image, loaded), test, error ? error->message : "pixels differ");
+    g_clear_error(&error);
+    g_free(test);
+    if (loaded)
+        g_object_unref(loaded);
+
+    /* Asking for a quarter of the size gets the smallest level that covers it */
+    if (!strcmp(save->name, "pyramid")){
+        before = check_stats();
+        loaded = check_load_incremental(path, 4, &error);
+        after = check_stats();
+        check(loaded && gdk_pixbuf_get_width(loaded) == CHECK_WIDTH / 4 && gdk_pixbuf_get_height(loaded) == CHECK_HEIGHT / 4 &&
+            after.pyramid_decodes == before.pyramid_decodes + 1, "incremental load pyramid at a quarter size",
+            error ? error->message : NULL);
+        g_clear_error(&error);
+        if (loaded)
+            g_object_unref(loaded);
+    }
+
+    g_free(path);
+}
+
+static void check_file_info(const char *dir){
+    char *path = g_strdup_printf("%s/block-rows.xz", dir);
+    XZPixbufFileInfo info;
+
+    check(get_file_info(path, &info, sizeof(info)) && !strcmp(info.format, "bmp") &&
+        info.width == CHECK_WIDTH && info.height == CHECK_HEIGHT, "file info", NULL);
+    g_free(path);
+}
+
+static void check_regions(const char *dir, GdkPixbuf *image){
+    char *path = g_strdup_printf("%s/block-rows.xz", dir);
+    GError *error = NULL;
+
+    XZPixbufLoaderStats before = check_stats();
+    GdkPixbuf *region = load_region(path, 40, 100, 200, 50, 1, &error);
+    GdkPixbuf *expected = gdk_pixbuf_new_subpixbuf(image, 40, 100, 200, 50);
+    XZPixbufLoaderStats after = check_stats();
+    check(check_same_pixels(expected, region) && after.region_decodes == before.region_decodes + 1, "load_region",
+        error ? error->message : "pixels differ");
+    g_clear_error(&error);
+    g_object_unref(expected);
+    if (region)
+        g_object_unref(region);
+
+    region = load_region(path, 0, 300, 128, 84, 0.5, &error);
+    check(region && gdk_pixbuf_get_width(region) == 64 && gdk_pixbuf_get_height(region) == 42, "load_region scaled",
+        error ? error->message : NULL);
+    g_clear_error(&error);
+    if (region)
+        g_object_unref(region);
+
+    /* A file in a single block is decompressed only as far as the region */
+    g_free(path);
+    path = g_strdup_printf("%s/reset-interval.xz", dir);
+    region = load_region(path, 500, 0, 12, 10, 1, &error);
+    expected = gdk_pixbuf_new_subpixbuf(image, 500, 0, 12, 10);
+    check(check_same_pixels(expected, region), "load_region single block", error ? error->message : "pixels differ");
+    g_clear_error(&error);
+    g_object_unref(expected);
+    if (region)
+        g_object_unref(region);
+    g_free(path);
+}
+
+/* Replace the width and height recorded in a sidecar, and its CRC32 to match */
+static gboolean check_forge_sidecar(const char *sidecar, uint32_t width, uint32_t height){
+    gchar *data;
+    gsize size;
+
+    if (!g_file_get_contents(sidecar, &data, &size, NULL) || size < 84){
+        g_free(data);
+        return FALSE;
+    }
+    for (int i = 0; i < 4; i++){
+        data[64 + i] = (char) (width >> (8 * i));
+        data[68 + i] = (char) (height >> (8 * i));
+    }
+    uint32_t crc = lzma_crc32((const uint8_t *) data, size - 4, 0);
+    for (int i = 0; i < 4; i++)
+        data[size - 4 + i] = (char) (crc >> (8 * i));
+    gboolean written = g_file_set_contents(sidecar, data, size, NULL);
+    g_free(data);
+    return written;
+}
+
+/*
+ * A sidecar is used while its file is unchanged, and ignored once the file's contents differ, even at the same size and mtime
+ * The sidecar is forged to claim an image over the configured limits, so whether it was used shows in whether the load is refused
+ */
+static void check_sidecar(const char *dir){
+    static const CheckSave stored = { "sidecar", { "xz-inner-format", "bmp", "xz-store", "yes", "xz-block-rows", "16", NULL } };
+    char *path = g_strdup_printf("%s/sidecar.xz", dir);
+    char *other_path = g_strdup_printf("%s/sidecar-other.xz", dir);
+    char *sidecar = g_strdup_printf("%s.xzidx", path);
+    GdkPixbuf *image = check_image(CHECK_WIDTH, CHECK_HEIGHT, 3);
+    GdkPixbuf *other = check_image(CHECK_WIDTH, CHECK_HEIGHT, 5);
+    GError *error = NULL;
+    gchar *other_data = NULL;
+    gsize other_size = 0;
+    GStatBuf st;
+
+    if (!check_save(image, path, &stored, &error) || !check_save(other, other_path, &stored, &error) ||
+            !g_file_get_contents(other_path, &other_data, &other_size, &error) || g_stat(path, &st) || st.st_size != (goffset) other_size){
+        check(FALSE, "sidecar setup", error ? error->message : "stored files differ in size");
+        goto cleanup;
+    }
+
+    check(write_index(path) && g_file_test(sidecar, G_FILE_TEST_IS_REGULAR), "write_index", NULL);
+    GdkPixbuf *loaded = gdk_pixbuf_new_from_file(path, &error);
+    check(check_same_pixels(image, loaded), "load with sidecar", error ? error->message : "pixels differ");
+    g_clear_error(&error);
+    if (loaded)
+        g_object_unref(loaded);
+
+    check(check_forge_sidecar(sidecar, 100000, 100000), "forge sidecar", NULL);
+    loaded = gdk_pixbuf_new_from_file(path, &error);
+    check(!loaded, "sidecar header is checked against the limits", NULL);
+    g_clear_error(&error);
+    if (loaded)
+        g_object_unref(loaded);
+
+    /* Overwrite the file in place and put its mtime back, so only the CRC64 tells */
+    FILE *file = fopen(path, "r+b");
+    gboolean replaced = file && fwrite(other_data, 1, other_size, file) == other_size;
+    if (file)
+        replaced &= fclose(file) == 0;
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    replaced = replaced && utimensat(AT_FDCWD, path, times, 0) == 0;
+    check(replaced, "replace sidecar file", NULL);
+    loaded = gdk_pixbuf_new_from_file(path, &error);
+    check(check_same_pixels(other, loaded), "stale sidecar is ignored", error ? error->message : "pixels differ");
+    g_clear_error(&error);
+    if (loaded)
+        g_object_unref(loaded);
+
+cleanup:
+    g_clear_error(&error);
+    g_free(other_data);
+    g_object_unref(image);
+    g_object_unref(other);
+    g_free(sidecar);
+    g_free(other_path);
+    g_free(path);
+}
+
+static uint64_t check_cache_hits(CheckCache cache){
+    XZPixbufLoaderStats stats = check_stats();
+    if (cache == CHECK_CACHE_MEMORY)
+        return stats.memory_cache_hits;
+    if (cache == CHECK_CACHE_DISK)
+        return stats.disk_cache_hits;
+    return stats.pixel_cache_hits;
+}
+
+/* The second load of a file comes from the cache, and gives the same pixels */
+static void check_cache(const char *dir, CheckCache cache){
+    static const CheckSave save = { "cache", { "xz-inner-format", "png", NULL } };
+    char *path = g_strdup_printf("%s/cache.xz", dir);
+    GError *error = NULL;
+
+    /* The memory cache is keyed on the compressed bytes, so this must not match any earlier file */
+    GdkPixbuf *image = check_image(CHECK_WIDTH, CHECK_HEIGHT, 7);
+
+    if (!check_save(image, path, &save, &error)){
+        check(FALSE, "cache setup", error->message);
+        g_error_free(error);
+        g_object_unref(image);
+        g_free(path);
+        return;
+    }
+    uint64_t hits = check_cache_hits(cache);
+    GdkPixbuf *first = gdk_pixbuf_new_from_file(path, &error);
+    check(check_same_pixels(image, first) && check_cache_hits(cache) == hits, "cache miss", error ? error->message : NULL);
+    g_clear_error(&error);
+
+    /* Callers own what they get, changing it must not change later loads */
+    if (first)
+        memset(gdk_pixbuf_get_pixels(first), 0, gdk_pixbuf_get_rowstride(first));
+    GdkPixbuf *second = gdk_pixbuf_new_from_file(path, &error);
+    check(check_same_pixels(image, second) && check_cache_hits(cache) == hits + 1, "cache hit", error ? error->message : NULL);
+    g_clear_error(&error);
+
+    if (first)
+        g_object_unref(first);
+    if (second)
+        g_object_unref(second);
+    g_object_unref(image);
+    g_free(path);
+}
+
+/* Remove the test directory, with the cache directories made inside it */
+static void check_remove_tree(const char *path){
+    GDir *dir = g_dir_open(path, 0, NULL);
+    const char *name;
+
+    while (dir && (name = g_dir_read_name(dir))){
+        char *child = g_build_filename(path, name, NULL);
+        if (g_file_test(child, G_FILE_TEST_IS_DIR) && !g_file_test(child, G_FILE_TEST_IS_SYMLINK))
+            check_remove_tree(child);
+        else
+            g_unlink(child);
+        g_free(child);
+    }
+    if (dir)
+        g_dir_close(dir);
+    g_rmdir(path);
+}
+
+int main(int argc, char **argv){
+    static const char *const cache_names[] = { "none", "memory", "disk", "pixel" };
+    unsigned int cache = CHECK_CACHE_NONE;
+    GError *error = NULL;
+
+    if (argc < 2 || argc > 3){
+        fprintf(stderr, "Usage: %s MODULE [none|memory|disk|pixel]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 2){
+        while (cache < G_N_ELEMENTS(cache_names) && strcmp(argv[2], cache_names[cache]))
+            cache++;
+        if (cache == G_N_ELEMENTS(cache_names)){
+            fprintf(stderr, "%s: unknown cache %s\n", argv[0], argv[2]);
+            return 2;
+        }
+    }
+
+    char *dir = g_dir_make_tmp("xz-pixbuf-check-XXXXXX", &error);
+    if (!dir){
+        fprintf(stderr, "%s: %s\n", argv[0], error->message);
+        return 1;
+    }
+
+    /* The loader reads its configuration once, at its first load */
+    char *cache_dir = g_build_filename(dir, "cache", NULL);
+    g_setenv("XZ_PIXBUF_DECODE_THREADS", "2", TRUE);
+    g_setenv("XZ_PIXBUF_MAX_MEGAPIXELS", "16", TRUE);
+    g_setenv("XZ_PIXBUF_DISK_CACHE_DIR", cache_dir, TRUE);
+    if (cache == CHECK_CACHE_MEMORY)
+        g_setenv("XZ_PIXBUF_CACHE_BYTES", "67108864", TRUE);
+    else if (cache == CHECK_CACHE_DISK)
+        g_setenv("XZ_PIXBUF_DISK_CACHE_BYTES", "67108864", TRUE);
+    else if (cache == CHECK_CACHE_PIXEL)
+        g_setenv("XZ_PIXBUF_PIXEL_CACHE_BYTES", "67108864", TRUE);
+    g_free(cache_dir);
+
+    /* dlopen hands back the copy gdk-pixbuf loads too, so the counters are the ones its loads update */
+    void *module = dlopen(argv[1], RTLD_NOW | RTLD_LOCAL);
+    get_stats = module ? (XZGetStatsFunc) dlsym(module, "xz_pixbuf_loader_get_stats") : NULL;
+    get_file_info = module ? (XZGetFileInfoFunc) dlsym(module, "xz_pixbuf_loader_get_file_info") : NULL;
+    write_index = module ? (XZWriteIndexFunc) dlsym(module, "xz_pixbuf_loader_write_index") : NULL;
+    load_region = module ? (XZLoadRegionFunc) dlsym(module, "xz_pixbuf_loader_load_region") : NULL;
+    if (!get_stats || !get_file_info || !write_index || !load_region){
+        fprintf(stderr, "%s: %s\n", argv[0], dlerror());
+        return 1;
+    }
+
+    gboolean found = FALSE;
+    GSList *formats = gdk_pixbuf_get_formats();
+    for (GSList *format = formats; format; format = format->next){
+        char *name = gdk_pixbuf_format_get_name(format->data);
+        found |= !strcmp(name, "xz") && gdk_pixbuf_format_is_writable(format->data);
+        g_free(name);
+    }
+    g_slist_free(formats);
+    if (!found){
+        fprintf(stderr, "%s: gdk-pixbuf has no writable xz format, is GDK_PIXBUF_MODULE_FILE set?\n", argv[0]);
+        return 1;
+    }
+
+    printf("# caches: %s\n", cache_names[cache]);
+    GdkPixbuf *image = check_image(CHECK_WIDTH, CHECK_HEIGHT, 1);
+    for (size_t i = 0; i < G_N_ELEMENTS(check_saves); i++)
+        check_round_trip(dir, image, &check_saves[i]);
+    check_file_info(dir);
+    check_regions(dir, image);
+    /* The caches are keyed on the file's size and mtime, or on its contents, which is what the sidecar check plays with */
+    if (cache == CHECK_CACHE_NONE)
+        check_sidecar(dir);
+    else
+        check_cache(dir, cache);
+    g_object_unref(image);
+
+    if (!failures)
+        check_remove_tree(dir);
+    else
+        printf("# %d failed, files left in %s\n", failures, dir);
+    g_free(dir);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,77 @@
+/* xz-pixbuf-index - sidecar index generator for the .image.xz Image Loader
+ *
+ * Author(s): Leo Izen (thebombzen) <leo.izen@gmail.com>
+ *
+ * Copyright (C) 2020 Leo Izen (thebombzen)
+ *
+ * Permission is hereby granted, free of charge, to any person 
+ * obtaining a copy of this software and associated documentation 
+ * files (the "Software"), to deal in the Software without 
+ * restriction, including without limitation the rights to use, 
+ * copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following 
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be 
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES 
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR 
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Writes a .xzidx sidecar next to each file given, see xz_pixbuf_loader_write_index
+ * The function is looked up in the installed loader module, or in the one given with -m
+ *
+ * Usage: xz-pixbuf-index [-m MODULE] FILE...
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "xz-pixbuf-loader.h"
+
+#ifndef XZ_PIXBUF_MODULE_PATH
+#define XZ_PIXBUF_MODULE_PATH "/usr/lib/gdk-pixbuf-2.0/2.10.0/loaders/libpixbufloader-xz.so"
+#endif
+
+typedef int (*XZWriteIndexFunc)(const char *filename);
+
+int main(int argc, char **argv){
+    const char *module_path = XZ_PIXBUF_MODULE_PATH;
+    int first = 1;
+    int status = 0;
+
+    if (argc > 2 && !strcmp(argv[1], "-m")){
+        module_path = argv[2];
+        first = 3;
+    }
+    if (argc <= first){
+        fprintf(stderr, "Usage: %s [-m MODULE] FILE...\n", argv[0]);
+        return 2;
+    }
+
+    void *module = dlopen(module_path, RTLD_NOW | RTLD_LOCAL);
+    XZWriteIndexFunc write_index = module ? (XZWriteIndexFunc) dlsym(module, "xz_pixbuf_loader_write_index") : NULL;
+    if (!write_index){
+        fprintf(stderr, "%s: %s\n", argv[0], dlerror());
+        return 1;
+    }
+    for (int i = first; i < argc; i++){
+        if (!write_index(argv[i])){
+            fprintf(stderr, "%s: could not index %s\n", argv[0], argv[i]);
+            status = 1;
+        }
+    }
+    dlclose(module);
+    return status;
+}
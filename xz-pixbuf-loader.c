@@ -27,10 +27,22 @@
  *
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/xattr.h>
 
 #include <gio/gio.h>
 #include <lzma.h>
@@ -39,272 +51,5139 @@
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #undef  GDK_PIXBUF_ENABLE_BACKEND
 
-/* Loader Context */
+#include "xz-pixbuf-loader.h"
+#include "xz-pixbuf-broker.h"
+
+/*
+ * Static tracepoints, compiled in with "make SDT=1"
+ * USDT probes are a single nop until something attaches to them
+ */
+#ifdef XZ_PIXBUF_ENABLE_SDT
+#include <sys/sdt.h>
+#define XZ_PIXBUF_PROBE1(name, a) DTRACE_PROBE1(xz_pixbuf_loader, name, a)
+#define XZ_PIXBUF_PROBE2(name, a, b) DTRACE_PROBE2(xz_pixbuf_loader, name, a, b)
+#else
+#define XZ_PIXBUF_PROBE1(name, a) do { (void) sizeof(a); } while (0)
+#define XZ_PIXBUF_PROBE2(name, a, b) do { (void) sizeof(a); (void) sizeof(b); } while (0)
+#endif
+
+/*
+ * Sysprof marks, compiled in with "make SYSPROF=1"
+ * Times are g_get_monotonic_time microseconds, sysprof wants nanoseconds
+ */
+#ifdef XZ_PIXBUF_ENABLE_SYSPROF
+#include <sysprof-capture.h>
+#define XZ_PIXBUF_MARK(start_usec, name, message) \
+    sysprof_collector_mark((start_usec) * 1000, (g_get_monotonic_time() - (start_usec)) * 1000, "xz-pixbuf-loader", name, message)
+#else
+#define XZ_PIXBUF_MARK(start_usec, name, message) do { (void) sizeof(start_usec); } while (0)
+#endif
+
+/* Which path a decoder was set up for, as passed to the decoder_init probe */
+#define XZ_PIXBUF_PATH_ONESHOT 0
+#define XZ_PIXBUF_PATH_INCREMENTAL 1
+
+/* Our own log domain, so slow load reports can be filtered on */
+#define XZ_PIXBUF_LOG_DOMAIN "xz-pixbuf-loader"
+
+/*
+ * Incremental loads coalesce small writes into a staging buffer of this size
+ * before running lzma_code, and only hand full output buffers to the memory stream
+ */
+#define XZ_STAGING_BUFFER_SIZE (1 << 16)
+#define XZ_OUTPUT_BUFFER_SIZE (1 << 18)
+
+/* Only this many decoded bytes are kept around while looking for the inner image header */
+#define XZ_HEADER_SNIFF_LIMIT (1 << 18)
+
+/* liblzma refuses a multithreaded encoder with more threads than this */
+#define XZ_ENCODE_THREADS_MAX 16384
+
+/* A day between metrics writes is plenty, and keeps the sleep in microseconds from overflowing */
+#define XZ_METRICS_INTERVAL_MAX 86400
+
+/*
+ * Runtime configuration, read once from the environment
+ * A limit of zero means unlimited
+ */
 typedef struct {
+    uint64_t max_pixels;
+    uint64_t max_image_bytes;
+    char *metrics_path;
+    uint64_t metrics_interval;
+    gboolean metrics_summary;
+    uint64_t slow_load_usec;
+    uint64_t cache_bytes;
+    uint64_t disk_cache_bytes;
+    char *disk_cache_dir;
+    uint64_t pixel_cache_bytes;
+    gboolean xattr_hints;
+    char *broker_socket;
+    uint64_t decode_threads;
+    gboolean use_sidecar;
+    uint64_t encode_threads;
+    gboolean chunk_passthrough;
+} XZLoaderConfig;
 
-    GdkPixbufModuleSizeFunc size_func;
-    GdkPixbufModuleUpdatedFunc updated_func;
-    GdkPixbufModulePreparedFunc prepare_func;
+/* Header of the image inside the xz stream, as far as we can tell without decoding it */
+typedef struct {
+    const char *format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+} XZInnerHeader;
 
-    lzma_stream *lzstream;
-    uint8_t *unxz_buffer;
-    size_t xz_buffer_size;
+/*
+ * Where the pixel rows are in inner formats that store them uncompressed
+ * Rows are row_bytes apart starting at pixel_offset, last row first when bottom_up
+ * Pixels are samples values of up to maxval each, big endian when two bytes wide, samples is 0 for layouts we can't read
+ */
+typedef struct {
+    const char *format;
+    uint64_t pixel_offset;
+    uint64_t row_bytes;
+    uint32_t width;
+    uint32_t rows;
+    gboolean bottom_up;
+    uint32_t samples;
+    uint32_t maxval;
+} XZRawLayout;
 
-    gpointer extra_context;
-    GdkPixbuf *pixbuf;
-    GError **error;
-    GInputStream *memory_istream;
+/* The most decoded data searched for the start of the rows */
+#define XZ_MAX_RAW_HEADER (1 << 16)
 
-} XZImageDecodeContext;
+typedef enum {
+    XZ_HEADER_NEED_MORE,
+    XZ_HEADER_FOUND,
+    XZ_HEADER_UNKNOWN
+} XZHeaderState;
 
-/* Load xz-compressed image directly in one go */
-static GdkPixbuf *gdk_pixbuf__load_xz_image(FILE *file, GError **error) {
+/* Collects the first decoded bytes until the inner image header can be parsed */
+typedef struct {
+    XZHeaderState state;
+    XZInnerHeader header;
+    uint8_t *data;
+    size_t size;
+} XZHeaderSniffer;
 
-    char *error_message = NULL;
+/* A number from the environment, where anything but a plain decimal number keeps the default */
+static uint64_t _gdk_pixbuf__env_uint64(const char *name, uint64_t fallback){
+    const char *value = g_getenv(name);
+    char *end;
+    if (!value || !*value)
+        return fallback;
 
-    const size_t buffer_size = 1 << 20;
-    uint8_t *xz_buffer = NULL;
-    uint8_t *unxz_buffer = NULL;
-    GInputStream *memory_istream = NULL;
-    GdkPixbuf *pixbuf = NULL;
-    
-    lzma_stream *lzstream = NULL;
-    lzma_ret lzret;
-    lzma_action lzaction;
+    errno = 0;
+    uint64_t number = g_ascii_strtoull(value, &end, 10);
+    if (!g_ascii_isdigit(*value) || *end || errno){
+        g_log(XZ_PIXBUF_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "Ignoring %s=%s, which is not a number in range", name, value);
+        return fallback;
+    }
+    return number;
+}
 
-    lzstream = malloc(sizeof(lzma_stream));
-    if (!lzstream){
-        error_message = "Failed to allocate lzma_stream";
-        goto failure;
+/* A path from the environment, with "%p" replaced by the process id so processes can share a setting */
+static char *_gdk_pixbuf__env_path(const char *name){
+    const char *value = g_getenv(name);
+    if (!value || !*value)
+        return NULL;
+
+    char **parts = g_strsplit(value, "%p", -1);
+    char pid[16];
+    g_snprintf(pid, sizeof(pid), "%d", (int) getpid());
+    char *path = g_strjoinv(pid, parts);
+    g_strfreev(parts);
+    return path;
+}
+
+/* An encoder thread count, where 0 means one per processor, clamped to what liblzma accepts */
+static uint64_t _gdk_pixbuf__encode_threads(uint64_t threads){
+    /* lzma_cputhreads returns 0 when it can't tell */
+    if (threads == 0)
+        threads = lzma_cputhreads();
+    return CLAMP(threads, 1, XZ_ENCODE_THREADS_MAX);
+}
+
+static const XZLoaderConfig *_gdk_pixbuf__xz_config(void){
+    static XZLoaderConfig config;
+    static gsize initialized = 0;
+
+    if (g_once_init_enter(&initialized)){
+        config.max_pixels = _gdk_pixbuf__env_uint64("XZ_PIXBUF_MAX_MEGAPIXELS", 0) * 1000000;
+        config.max_image_bytes = _gdk_pixbuf__env_uint64("XZ_PIXBUF_MAX_IMAGE_BYTES", 0);
+        config.metrics_path = _gdk_pixbuf__env_path("XZ_PIXBUF_METRICS_FILE");
+        uint64_t metrics_interval = _gdk_pixbuf__env_uint64("XZ_PIXBUF_METRICS_INTERVAL", 15);
+        config.metrics_interval = CLAMP(metrics_interval, 1, XZ_METRICS_INTERVAL_MAX);
+        config.metrics_summary = _gdk_pixbuf__env_uint64("XZ_PIXBUF_METRICS_SUMMARY", 0) != 0;
+        config.slow_load_usec = _gdk_pixbuf__env_uint64("XZ_PIXBUF_SLOW_LOAD_MS", 0) * 1000;
+        config.cache_bytes = _gdk_pixbuf__env_uint64("XZ_PIXBUF_CACHE_BYTES", 0);
+        config.disk_cache_bytes = _gdk_pixbuf__env_uint64("XZ_PIXBUF_DISK_CACHE_BYTES", 0);
+        config.disk_cache_dir = _gdk_pixbuf__env_path("XZ_PIXBUF_DISK_CACHE_DIR");
+        if (!config.disk_cache_dir)
+            config.disk_cache_dir = g_build_filename(g_get_user_cache_dir(), "xz-pixbuf-loader", NULL);
+        config.pixel_cache_bytes = _gdk_pixbuf__env_uint64("XZ_PIXBUF_PIXEL_CACHE_BYTES", 0);
+        config.xattr_hints = _gdk_pixbuf__env_uint64("XZ_PIXBUF_XATTR_HINTS", 0) != 0;
+        config.broker_socket = _gdk_pixbuf__env_path("XZ_PIXBUF_BROKER_SOCKET");
+        config.decode_threads = _gdk_pixbuf__env_uint64("XZ_PIXBUF_DECODE_THREADS", 1);
+        if (config.decode_threads == 0)
+            config.decode_threads = g_get_num_processors();
+        config.use_sidecar = _gdk_pixbuf__env_uint64("XZ_PIXBUF_SIDECAR", 1) != 0;
+        config.encode_threads = _gdk_pixbuf__encode_threads(_gdk_pixbuf__env_uint64("XZ_PIXBUF_ENCODE_THREADS", 1));
+        config.chunk_passthrough = _gdk_pixbuf__env_uint64("XZ_PIXBUF_CHUNK_PASSTHROUGH", 0) != 0;
+        g_once_init_leave(&initialized, 1);
     }
-    *lzstream = (lzma_stream) LZMA_STREAM_INIT;
 
-    lzret = lzma_stream_decoder(lzstream, UINT64_MAX, LZMA_CONCATENATED);
-    if (lzret != LZMA_OK) {
-        error_message = "Could not create lzma_stream_decoder";
-        goto failure;
+    return &config;
+}
+
+static uint32_t _gdk_pixbuf__read_be32(const uint8_t *p){
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint32_t _gdk_pixbuf__read_le32(const uint8_t *p){
+    return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[1] << 8) | p[0];
+}
+
+static uint16_t _gdk_pixbuf__read_be16(const uint8_t *p){
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static uint16_t _gdk_pixbuf__read_le16(const uint8_t *p){
+    return (uint16_t) ((p[1] << 8) | p[0]);
+}
+
+static uint64_t _gdk_pixbuf__read_le64(const uint8_t *p){
+    return ((uint64_t) _gdk_pixbuf__read_le32(p + 4) << 32) | _gdk_pixbuf__read_le32(p);
+}
+
+static void _gdk_pixbuf__write_le32(uint8_t *p, uint32_t value){
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static void _gdk_pixbuf__write_le64(uint8_t *p, uint64_t value){
+    _gdk_pixbuf__write_le32(p, (uint32_t) value);
+    _gdk_pixbuf__write_le32(p + 4, (uint32_t) (value >> 32));
+}
+
+/* Reads the next whitespace separated number of a PNM header, skipping comments */
+static XZHeaderState _gdk_pixbuf__pnm_number(const uint8_t *buf, size_t size, size_t *pos, uint32_t *value){
+    while (*pos < size){
+        if (buf[*pos] == '#'){
+            while (*pos < size && buf[*pos] != '\n')
+                (*pos)++;
+        } else if (buf[*pos] == ' ' || buf[*pos] == '\t' || buf[*pos] == '\r' || buf[*pos] == '\n'){
+            (*pos)++;
+        } else {
+            break;
+        }
     }
 
-    xz_buffer = (uint8_t *) malloc(buffer_size);
-    unxz_buffer = (uint8_t *) malloc(buffer_size);
-    if (!xz_buffer || !unxz_buffer){
-        error_message = "Could not allocate xz data buffers";
-        goto failure;
+    uint64_t number = 0;
+    size_t start = *pos;
+    while (*pos < size && buf[*pos] >= '0' && buf[*pos] <= '9'){
+        number = number * 10 + (buf[*pos] - '0');
+        if (number > UINT32_MAX)
+            return XZ_HEADER_UNKNOWN;
+        (*pos)++;
     }
 
-    lzaction = LZMA_RUN;
-    lzstream->next_in = NULL;
-    lzstream->avail_in = 0;
-    lzstream->next_out = unxz_buffer;
-    lzstream->avail_out = buffer_size;
+    /* A number is only complete once we see what follows it */
+    if (*pos == size)
+        return XZ_HEADER_NEED_MORE;
+    if (*pos == start)
+        return XZ_HEADER_UNKNOWN;
 
-    memory_istream = g_memory_input_stream_new();
+    *value = (uint32_t) number;
+    return XZ_HEADER_FOUND;
+}
+
+/* PAM headers are "KEY value" lines terminated by ENDHDR, and the raw layout is filled in when asked for */
+static XZHeaderState _gdk_pixbuf__parse_pam_header(const uint8_t *buf, size_t size, XZInnerHeader *header, XZRawLayout *layout){
+    size_t pos = 3;
+    uint32_t depth = 0;
+    uint32_t maxval = 0;
 
+    header->width = header->height = 0;
+    /* Every line, keys and values included, is looked at only up to its newline, which must lie within size */
     while (TRUE){
+        if (pos >= size)
+            return XZ_HEADER_NEED_MORE;
+        const uint8_t *line = buf + pos;
+        const uint8_t *end = memchr(line, '\n', size - pos);
+        if (!end)
+            return XZ_HEADER_NEED_MORE;
+        size_t length = end - line;
+        pos += length + 1;
 
-        if (lzstream->avail_in == 0 && !feof(file)){
-            size_t bytes_read = fread(xz_buffer, 1, buffer_size, file);
-            if (bytes_read < buffer_size){
-                if (ferror(file)){
-                    error_message = "Error reading file with fread";
-                    goto failure;
-                }
-            }
-            lzstream->next_in = xz_buffer;
-            lzstream->avail_in = bytes_read;
-            if (feof(file)){
-                lzaction = LZMA_FINISH;
-            }
-        }
+        if (length >= 6 && !memcmp(line, "ENDHDR", 6))
+            break;
 
-        lzret = lzma_code(lzstream, lzaction);
-        
-        if (lzstream->avail_out == 0 || lzret == LZMA_STREAM_END){
-            size_t mem_buffer_size = buffer_size - lzstream->avail_out;
-            void *mem_buffer = malloc(mem_buffer_size);
-            if (!mem_buffer){
-                error_message = "Error allocating memory";
-                goto failure;
-            }
-            memcpy(mem_buffer, unxz_buffer, mem_buffer_size);
-            g_memory_input_stream_add_data(G_MEMORY_INPUT_STREAM(memory_istream), mem_buffer, mem_buffer_size, free);
-            lzstream->next_out = unxz_buffer;
-            lzstream->avail_out = buffer_size;
+        uint32_t *target = NULL;
+        size_t key_length = 0;
+        if (length > 6 && !memcmp(line, "WIDTH ", 6)){
+            target = &header->width;
+            key_length = 6;
+        } else if (length > 7 && !memcmp(line, "HEIGHT ", 7)){
+            target = &header->height;
+            key_length = 7;
+        } else if (length > 6 && !memcmp(line, "DEPTH ", 6)){
+            target = &depth;
+            key_length = 6;
+        } else if (length > 7 && !memcmp(line, "MAXVAL ", 7)){
+            target = &maxval;
+            key_length = 7;
         }
-
-        if(lzret != LZMA_OK){
-            if (lzret == LZMA_STREAM_END)
-                break;
-            error_message = "Some LZMA error occurred";
-            goto failure;
+        if (target){
+            size_t number_pos = key_length;
+            if (_gdk_pixbuf__pnm_number(line, length + 1, &number_pos, target) != XZ_HEADER_FOUND)
+                return XZ_HEADER_UNKNOWN;
         }
+    }
 
-    } // while(TRUE)
-
-    pixbuf = gdk_pixbuf_new_from_stream(memory_istream, NULL, error);
-    if (!pixbuf){
-        error_message = "Could not create pixbuf from memory stream";
-        goto failure;
+    if (!header->width || !header->height || !depth || depth > 4)
+        return XZ_HEADER_UNKNOWN;
+    header->format = "pam";
+    header->channels = (depth == 2 || depth == 4) ? 4 : 3;
+    if (layout){
+        if (!maxval || maxval > 65535)
+            return XZ_HEADER_UNKNOWN;
+        layout->format = header->format;
+        layout->pixel_offset = pos;
+        layout->row_bytes = (uint64_t) header->width * depth * (maxval > 255 ? 2 : 1);
+        layout->width = header->width;
+        layout->rows = header->height;
+        layout->bottom_up = FALSE;
+        layout->samples = depth;
+        layout->maxval = maxval;
     }
+    return XZ_HEADER_FOUND;
+}
 
-    g_input_stream_close(memory_istream, NULL, error);
-    lzma_end(lzstream);
-    free(lzstream);
-    free(xz_buffer);
-    free(unxz_buffer);
+/* JPEG dimensions live in the first SOFn segment, possibly after large APPn segments */
+static XZHeaderState _gdk_pixbuf__parse_jpeg_header(const uint8_t *buf, size_t size, XZInnerHeader *header){
+    size_t pos = 2;
 
-    return pixbuf;
+    while (TRUE){
+        if (pos + 4 > size)
+            return XZ_HEADER_NEED_MORE;
+        if (buf[pos] != 0xFF)
+            return XZ_HEADER_UNKNOWN;
+        uint8_t marker = buf[pos + 1];
+        if (marker == 0xFF){
+            pos++;
+            continue;
+        }
+        if (marker == 0xD8 || (marker >= 0xD0 && marker <= 0xD7)){
+            pos += 2;
+            continue;
+        }
+        uint16_t length = _gdk_pixbuf__read_be16(buf + pos + 2);
+        if (length < 2)
+            return XZ_HEADER_UNKNOWN;
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC){
+            if (pos + 10 > size)
+                return XZ_HEADER_NEED_MORE;
+            header->format = "jpeg";
+            header->height = _gdk_pixbuf__read_be16(buf + pos + 5);
+            header->width = _gdk_pixbuf__read_be16(buf + pos + 7);
+            header->channels = 3;
+            return XZ_HEADER_FOUND;
+        }
+        if (marker == 0xD9 || marker == 0xDA)
+            return XZ_HEADER_UNKNOWN;
+        pos += 2 + length;
+    }
+}
 
-failure:
-    g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, error_message);
-    if (xz_buffer)
-        free(xz_buffer);
-    if (unxz_buffer)
-        free(unxz_buffer);
-    if (lzstream)
-        free(lzstream);
-    if (memory_istream)
-        g_input_stream_close(memory_istream, NULL, error);
-    return NULL;
+/*
+ * Work out the inner image format and dimensions from the start of the decoded data
+ * Channels are those of the pixbuf gdk-pixbuf will create, not of the file itself
+ */
+static XZHeaderState _gdk_pixbuf__parse_inner_header(const uint8_t *buf, size_t size, XZInnerHeader *header){
 
-}
+    if (size < 2)
+        return XZ_HEADER_NEED_MORE;
 
-/* Start the asynchronous loading process */
-static gpointer gdk_pixbuf__begin_load_xz_image(GdkPixbufModuleSizeFunc size_func, GdkPixbufModulePreparedFunc prepare_func,
-        GdkPixbufModuleUpdatedFunc updated_func, gpointer extra_context, GError **error) {
+    if (!memcmp(buf, "\x89PNG", MIN(size, 4))){
+        if (size < 26)
+            return XZ_HEADER_NEED_MORE;
+        if (memcmp(buf + 12, "IHDR", 4))
+            return XZ_HEADER_UNKNOWN;
+        header->format = "png";
+        header->width = _gdk_pixbuf__read_be32(buf + 16);
+        header->height = _gdk_pixbuf__read_be32(buf + 20);
+        header->channels = (buf[25] & 4) ? 4 : 3;
+        return XZ_HEADER_FOUND;
+    }
 
-    char *error_message = NULL;
+    if (buf[0] == 0xFF && buf[1] == 0xD8)
+        return _gdk_pixbuf__parse_jpeg_header(buf, size, header);
 
-    XZImageDecodeContext *context = (XZImageDecodeContext *) calloc(1, sizeof(XZImageDecodeContext));
-    if (!context){
-        error_message = "Error allocating decode context";
-        goto failure;
+    if (!memcmp(buf, "GIF8", MIN(size, 4))){
+        if (size < 10)
+            return XZ_HEADER_NEED_MORE;
+        header->format = "gif";
+        header->width = _gdk_pixbuf__read_le16(buf + 6);
+        header->height = _gdk_pixbuf__read_le16(buf + 8);
+        header->channels = 4;
+        return XZ_HEADER_FOUND;
     }
 
-    context->lzstream = (lzma_stream *) malloc(sizeof(lzma_stream));
-    if (!context->lzstream){
-        error_message = "Error allocating lzma stream in context";
-        goto failure;
+    if (buf[0] == 'B' && buf[1] == 'M'){
+        if (size < 30)
+            return XZ_HEADER_NEED_MORE;
+        header->format = "bmp";
+        if (_gdk_pixbuf__read_le32(buf + 14) == 12){
+            header->width = _gdk_pixbuf__read_le16(buf + 18);
+            header->height = _gdk_pixbuf__read_le16(buf + 20);
+            header->channels = 3;
+        } else {
+            int32_t height = (int32_t) _gdk_pixbuf__read_le32(buf + 22);
+            header->width = _gdk_pixbuf__read_le32(buf + 18);
+            header->height = height < 0 ? (uint32_t) -(int64_t) height : (uint32_t) height;
+            header->channels = _gdk_pixbuf__read_le16(buf + 28) == 32 ? 4 : 3;
+        }
+        return XZ_HEADER_FOUND;
     }
-    *(context->lzstream) = (lzma_stream) LZMA_STREAM_INIT;
 
-    lzma_ret lzret = lzma_stream_decoder(context->lzstream, UINT64_MAX, LZMA_CONCATENATED);
-    if (lzret != LZMA_OK) {
-        error_message = "Could not create lzma_stream_decoder";
-        goto failure;
+    if (!memcmp(buf, "RIFF", MIN(size, 4))){
+        if (size < 32)
+            return XZ_HEADER_NEED_MORE;
+        if (memcmp(buf + 8, "WEBP", 4))
+            return XZ_HEADER_UNKNOWN;
+        header->format = "webp";
+        if (!memcmp(buf + 12, "VP8 ", 4)){
+            header->width = _gdk_pixbuf__read_le16(buf + 26) & 0x3FFF;
+            header->height = _gdk_pixbuf__read_le16(buf + 28) & 0x3FFF;
+            header->channels = 3;
+        } else if (!memcmp(buf + 12, "VP8L", 4)){
+            uint32_t bits = _gdk_pixbuf__read_le32(buf + 21);
+            header->width = (bits & 0x3FFF) + 1;
+            header->height = ((bits >> 14) & 0x3FFF) + 1;
+            header->channels = 4;
+        } else if (!memcmp(buf + 12, "VP8X", 4)){
+            header->width = (_gdk_pixbuf__read_le32(buf + 24) & 0xFFFFFF) + 1;
+            header->height = (_gdk_pixbuf__read_le32(buf + 27) & 0xFFFFFF) + 1;
+            header->channels = 4;
+        } else {
+            return XZ_HEADER_UNKNOWN;
+        }
+        return XZ_HEADER_FOUND;
     }
 
-    context->xz_buffer_size = 1 << 16;
-    context->unxz_buffer = (uint8_t *) malloc(context->xz_buffer_size);
-    if (!context->unxz_buffer) {
-        error_message = "Could not create xz buffers";
-        goto failure;
+    if (buf[0] == 'P' && buf[1] == '7')
+        return _gdk_pixbuf__parse_pam_header(buf, size, header, NULL);
+
+    if (buf[0] == 'P' && buf[1] >= '1' && buf[1] <= '6'){
+        size_t pos = 2;
+        XZHeaderState state = _gdk_pixbuf__pnm_number(buf, size, &pos, &header->width);
+        if (state == XZ_HEADER_FOUND)
+            state = _gdk_pixbuf__pnm_number(buf, size, &pos, &header->height);
+        if (state != XZ_HEADER_FOUND)
+            return state;
+        header->format = "pnm";
+        header->channels = 3;
+        return XZ_HEADER_FOUND;
     }
 
-    context->lzstream->next_in = NULL;
-    context->lzstream->avail_in = 0;
-    context->lzstream->next_out = context->unxz_buffer;
-    context->lzstream->avail_out = context->xz_buffer_size;
-    
-    context->memory_istream = g_memory_input_stream_new();
-    context->size_func = size_func;
-    context->prepare_func = prepare_func;
-    context->updated_func  = updated_func;
-    context->extra_context = extra_context;
-    context->error = error;
+    if (!memcmp(buf, "farbfeld", MIN(size, 8))){
+        if (size < 16)
+            return XZ_HEADER_NEED_MORE;
+        header->format = "farbfeld";
+        header->width = _gdk_pixbuf__read_be32(buf + 8);
+        header->height = _gdk_pixbuf__read_be32(buf + 12);
+        header->channels = 4;
+        return XZ_HEADER_FOUND;
+    }
 
-    return context;
+    return XZ_HEADER_UNKNOWN;
+}
 
-failure:
-    g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, error_message);
-    if (context){
-        if (context->lzstream)
-            free(context->lzstream);
-        if (context->unxz_buffer)
-            free(context->unxz_buffer);
-        if (context->memory_istream)
-            g_input_stream_close(context->memory_istream, NULL, error);
-        free(context);
+/* The raw layout of binary PNM and PAM, uncompressed BMP and farbfeld images, from the start of the decoded data */
+static XZHeaderState _gdk_pixbuf__parse_raw_layout(const uint8_t *buf, size_t size, XZRawLayout *layout){
+    XZInnerHeader header = { NULL };
+    XZHeaderState state;
+
+    if (size >= 2 && buf[0] == 'P' && buf[1] == '7')
+        return _gdk_pixbuf__parse_pam_header(buf, size, &header, layout);
+
+    state = _gdk_pixbuf__parse_inner_header(buf, size, &header);
+    if (state != XZ_HEADER_FOUND)
+        return state;
+
+    layout->format = header.format;
+    layout->width = header.width;
+    layout->rows = header.height;
+    layout->bottom_up = FALSE;
+    if (!strcmp(header.format, "pnm")){
+        uint32_t width, height, maxval;
+        size_t pos = 2;
+        if (buf[1] != '5' && buf[1] != '6')
+            return XZ_HEADER_UNKNOWN;
+        state = _gdk_pixbuf__pnm_number(buf, size, &pos, &width);
+        if (state == XZ_HEADER_FOUND)
+            state = _gdk_pixbuf__pnm_number(buf, size, &pos, &height);
+        if (state == XZ_HEADER_FOUND)
+            state = _gdk_pixbuf__pnm_number(buf, size, &pos, &maxval);
+        if (state != XZ_HEADER_FOUND)
+            return state;
+        if (!maxval || maxval > 65535)
+            return XZ_HEADER_UNKNOWN;
+        /* A single whitespace character separates the header from the pixels */
+        layout->pixel_offset = pos + 1;
+        layout->samples = buf[1] == '6' ? 3 : 1;
+        layout->maxval = maxval;
+        layout->row_bytes = (uint64_t) width * layout->samples * (maxval > 255 ? 2 : 1);
+    } else if (!strcmp(header.format, "bmp")){
+        if (size < 34)
+            return XZ_HEADER_NEED_MORE;
+        uint32_t compression = _gdk_pixbuf__read_le32(buf + 30);
+        uint16_t bits = _gdk_pixbuf__read_le16(buf + 28);
+        if (_gdk_pixbuf__read_le32(buf + 14) < 40 || (compression != 0 && compression != 3))
+            return XZ_HEADER_UNKNOWN;
+        layout->pixel_offset = _gdk_pixbuf__read_le32(buf + 10);
+        layout->row_bytes = ((uint64_t) header.width * bits + 31) / 32 * 4;
+        layout->bottom_up = (int32_t) _gdk_pixbuf__read_le32(buf + 22) > 0;
+        /* Palettes and bitfields are left to the bmp loader */
+        layout->samples = compression == 0 && (bits == 24 || bits == 32) ? bits / 8 : 0;
+        layout->maxval = 255;
+    } else if (!strcmp(header.format, "farbfeld")){
+        layout->pixel_offset = 16;
+        layout->row_bytes = (uint64_t) header.width * 8;
+        layout->samples = 4;
+        layout->maxval = 65535;
+    } else {
+        return XZ_HEADER_UNKNOWN;
     }
-    return NULL;
+
+    if (!layout->row_bytes || !layout->rows)
+        return XZ_HEADER_UNKNOWN;
+    return XZ_HEADER_FOUND;
 }
 
-/* Here we do the actual LZMA decoding */
-static gboolean _gdk_pixbuf__lzma_code(gpointer user_context, const guchar *buf, guint size, GError **error, lzma_action lzaction){
-    char *error_message = NULL;
+/* Feed freshly decoded bytes to the sniffer, until it knows the header or gives up */
+static void _gdk_pixbuf__sniff_header(XZHeaderSniffer *sniffer, const uint8_t *buf, size_t size){
 
-    XZImageDecodeContext *context = (XZImageDecodeContext *) user_context;
-    context->lzstream->next_in = (const uint8_t *) buf;
-    context->lzstream->avail_in = size;
+    if (sniffer->state != XZ_HEADER_NEED_MORE || size == 0)
+        return;
 
-    do {
-        lzma_ret lzret = lzma_code(context->lzstream, lzaction);
-        if (lzret == LZMA_OK || lzret == LZMA_STREAM_END){
-            size_t mem_buffer_size = context->xz_buffer_size - context->lzstream->avail_out;
-            void *mem_buffer = malloc(mem_buffer_size);
-            if (!mem_buffer){
-                error_message = "Error allocating buffer";
-                goto failure;
-            }
-            memcpy(mem_buffer, context->unxz_buffer, mem_buffer_size);
-            g_memory_input_stream_add_data(G_MEMORY_INPUT_STREAM(context->memory_istream), mem_buffer, mem_buffer_size, free);
-            context->lzstream->avail_out = context->xz_buffer_size;
-            context->lzstream->next_out = context->unxz_buffer;
-        } else {
-            error_message = "Error with lzma decode";
-            goto failure;
+    /* Most of the time the whole header is in the very first piece of output */
+    if (sniffer->size == 0)
+        sniffer->state = _gdk_pixbuf__parse_inner_header(buf, size, &sniffer->header);
+    if (sniffer->state == XZ_HEADER_NEED_MORE){
+        size_t copy_size = MIN(size, XZ_HEADER_SNIFF_LIMIT - sniffer->size);
+        if (!sniffer->data)
+            sniffer->data = (uint8_t *) malloc(XZ_HEADER_SNIFF_LIMIT);
+        if (!sniffer->data){
+            sniffer->state = XZ_HEADER_UNKNOWN;
+            return;
         }
-    } while (context->lzstream->avail_in != 0);
-
-    return TRUE;
+        memcpy(sniffer->data + sniffer->size, buf, copy_size);
+        sniffer->size += copy_size;
+        sniffer->state = _gdk_pixbuf__parse_inner_header(sniffer->data, sniffer->size, &sniffer->header);
+        if (sniffer->state == XZ_HEADER_NEED_MORE && sniffer->size == XZ_HEADER_SNIFF_LIMIT)
+            sniffer->state = XZ_HEADER_UNKNOWN;
+    }
 
-failure:
-    g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, error_message);
-    return FALSE;    
+    if (sniffer->state != XZ_HEADER_NEED_MORE && sniffer->data){
+        free(sniffer->data);
+        sniffer->data = NULL;
+    }
 }
 
-/* Finish decoding the image, and render it */
-static gboolean gdk_pixbuf__stop_load_xz_image(gpointer user_context, GError **error) {
+/* What the next bytes of a GIF or WebP file are, while looking for a second frame */
+typedef enum {
+    XZ_SCAN_SIGNATURE,
+    XZ_SCAN_WEBP_HEADER,
+    XZ_SCAN_GIF_BLOCK,
+    XZ_SCAN_GIF_LABEL,
+    XZ_SCAN_GIF_DESCRIPTOR,
+    XZ_SCAN_GIF_CODE_SIZE,
+    XZ_SCAN_GIF_SUB_BLOCK
+} XZScanStep;
 
-    XZImageDecodeContext *context = (XZImageDecodeContext *) user_context;
+/*
+ * Walks the decoded start of a file to tell an animation from a still image, without keeping the data
+ * FOUND once a GIF's first image is followed by anything but the trailer, or a WebP's VP8X chunk has the animation flag,
+ * UNKNOWN for anything else
+ */
+typedef struct {
+    XZHeaderState state;
+    const char *format;
+    XZScanStep step;
+    uint8_t field[21];
+    size_t have;
+    size_t need;
+    uint64_t skip;
+    guint frames;
+} XZAnimationScan;
 
-    /* We do a final run of lzma_code in order to tell liblzma to finish and flush */
-    gboolean ret = _gdk_pixbuf__lzma_code(user_context, NULL, 0, error, LZMA_FINISH);
-    lzma_end(context->lzstream);
+static void _gdk_pixbuf__scan_next(XZAnimationScan *scan, XZScanStep step, size_t need, uint64_t skip){
+    scan->step = step;
+    scan->have = 0;
+    scan->need = need;
+    scan->skip = skip;
+}
 
-    context->pixbuf = gdk_pixbuf_new_from_stream(context->memory_istream, NULL, error);
-    if (!context->pixbuf)
-        ret = FALSE;
-    g_input_stream_close(context->memory_istream, NULL, context->error);
+/* The size of a GIF colour table, from the flags byte in front of it */
+static uint64_t _gdk_pixbuf__gif_color_table(uint8_t flags){
+    return (flags & 0x80) ? 3 << ((flags & 7) + 1) : 0;
+}
 
-    if (context->pixbuf && context->prepare_func){
-        (* context->prepare_func)(context->pixbuf, NULL, context->extra_context);
-    }
-    if (context->pixbuf && context->updated_func) {
-        (* context->updated_func)(context->pixbuf, 0, 0, gdk_pixbuf_get_width(context->pixbuf), gdk_pixbuf_get_height(context->pixbuf), context->extra_context);
-    }
+/* Feed freshly decoded bytes to the scan, until it can tell whether the file is animated */
+static void _gdk_pixbuf__scan_animation(XZAnimationScan *scan, const uint8_t *buf, size_t size){
+    /* A zeroed scan starts with the signature */
+    if (scan->need == 0)
+        scan->need = 13;
 
-    g_object_unref(context->pixbuf);
-    free(context->lzstream);
-    free(context->unxz_buffer);
-    free(context);
-    return ret;
+    while (scan->state == XZ_HEADER_NEED_MORE && size > 0){
+        if (scan->skip){
+            size_t skipped = MIN(scan->skip, size);
+            scan->skip -= skipped;
+            buf += skipped;
+            size -= skipped;
+            continue;
+        }
+        size_t copied = MIN(scan->need - scan->have, size);
+        memcpy(scan->field + scan->have, buf, copied);
+        scan->have += copied;
+        buf += copied;
+        size -= copied;
+        if (scan->have < scan->need)
+            return;
+
+        const uint8_t *field = scan->field;
+        switch (scan->step){
+        case XZ_SCAN_SIGNATURE:
+            /* The GIF header and logical screen descriptor, or as far as a WebP's first chunk name */
+            if (!memcmp(field, "GIF8", 4)){
+                scan->format = "gif";
+                _gdk_pixbuf__scan_next(scan, XZ_SCAN_GIF_BLOCK, 1, _gdk_pixbuf__gif_color_table(field[10]));
+            } else if (!memcmp(field, "RIFF", 4)){
+                scan->format = "webp";
+                scan->step = XZ_SCAN_WEBP_HEADER;
+                scan->need = 21;
+            } else {
+                scan->state = XZ_HEADER_UNKNOWN;
+            }
+            break;
+        case XZ_SCAN_WEBP_HEADER:
+            scan->state = !memcmp(field + 8, "WEBP", 4) && !memcmp(field + 12, "VP8X", 4) && (field[20] & 0x02) ?
+                XZ_HEADER_FOUND : XZ_HEADER_UNKNOWN;
+            break;
+        case XZ_SCAN_GIF_BLOCK:
+            /*
+             * Decided at the end of the first image: only the trailer makes it a still image
+             * A trailing comment makes a still image look animated, which only costs it the animation path
+             */
+            if (scan->frames > 0)
+                scan->state = field[0] == 0x3B ? XZ_HEADER_UNKNOWN : XZ_HEADER_FOUND;
+            else if (field[0] == 0x21)
+                _gdk_pixbuf__scan_next(scan, XZ_SCAN_GIF_LABEL, 1, 0);
+            else if (field[0] == 0x2C){
+                scan->frames++;
+                _gdk_pixbuf__scan_next(scan, XZ_SCAN_GIF_DESCRIPTOR, 9, 0);
+            } else {
+                scan->state = XZ_HEADER_UNKNOWN;
+            }
+            break;
+        case XZ_SCAN_GIF_LABEL:
+            _gdk_pixbuf__scan_next(scan, XZ_SCAN_GIF_SUB_BLOCK, 1, 0);
+            break;
+        case XZ_SCAN_GIF_DESCRIPTOR:
+            _gdk_pixbuf__scan_next(scan, XZ_SCAN_GIF_CODE_SIZE, 1, _gdk_pixbuf__gif_color_table(field[8]));
+            break;
+        case XZ_SCAN_GIF_CODE_SIZE:
+            _gdk_pixbuf__scan_next(scan, XZ_SCAN_GIF_SUB_BLOCK, 1, 0);
+            break;
+        case XZ_SCAN_GIF_SUB_BLOCK:
+            _gdk_pixbuf__scan_next(scan, field[0] ? XZ_SCAN_GIF_SUB_BLOCK : XZ_SCAN_GIF_BLOCK, 1, field[0]);
+            break;
+        }
+    }
 }
 
+/* Output steps of the first block sniff, small so that little past the header is decompressed */
+#define XZ_FIRST_BLOCK_STEP (1 << 12)
+
 /*
- * Incrementally decode lzma
- * This wrapper is here so we don't have to duplicate this in stop_load
+ * Set up lzstream to decode the first block of data on its own
+ * block and filters receive the block header and its filter chain, and have to outlive the decoder,
+ * after which the caller frees the filter options
+ */
+static gboolean _gdk_pixbuf__first_block_decoder(const uint8_t *data, size_t size, lzma_stream *lzstream,
+        lzma_block *block, lzma_filter *filters){
+    lzma_stream_flags flags;
+
+    filters[0].id = LZMA_VLI_UNKNOWN;
+    if (size <= LZMA_STREAM_HEADER_SIZE || lzma_stream_header_decode(&flags, data) != LZMA_OK || data[LZMA_STREAM_HEADER_SIZE] == 0x00)
+        return FALSE;
+    *block = (lzma_block) { 0 };
+    block->version = 1;
+    block->check = flags.check;
+    block->filters = filters;
+    block->header_size = lzma_block_header_size_decode(data[LZMA_STREAM_HEADER_SIZE]);
+    if (LZMA_STREAM_HEADER_SIZE + block->header_size > size || lzma_block_header_decode(block, NULL, data + LZMA_STREAM_HEADER_SIZE) != LZMA_OK)
+        return FALSE;
+    if (lzma_block_decoder(lzstream, block) != LZMA_OK)
+        return FALSE;
+    lzstream->next_in = data + LZMA_STREAM_HEADER_SIZE + block->header_size;
+    lzstream->avail_in = size - LZMA_STREAM_HEADER_SIZE - block->header_size;
+    return TRUE;
+}
+
+static void _gdk_pixbuf__free_filter_options(lzma_filter *filters){
+    for (int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+        free(filters[i].options);
+}
+
+/*
+ * Sniff the inner header from the first block alone, decoding no further than it
+ * Files saved with xz-header-block keep that block to the inner header, and for the rest
+ * the header usually turns up early in the first block anyway
+ * Returns FALSE if the header wasn't found before the block or data ran out
+ */
+static gboolean _gdk_pixbuf__sniff_first_block(const uint8_t *data, size_t size, XZInnerHeader *header){
+    lzma_stream lzstream = LZMA_STREAM_INIT;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+    XZHeaderSniffer sniffer = { XZ_HEADER_NEED_MORE };
+    uint8_t out_buffer[XZ_FIRST_BLOCK_STEP];
+    lzma_ret lzret = LZMA_OK;
+
+    if (_gdk_pixbuf__first_block_decoder(data, size, &lzstream, &block, filters)){
+        while (sniffer.state == XZ_HEADER_NEED_MORE && lzret == LZMA_OK && (lzstream.avail_in > 0 || lzstream.avail_out == 0)){
+            lzstream.next_out = out_buffer;
+            lzstream.avail_out = sizeof(out_buffer);
+            lzret = lzma_code(&lzstream, LZMA_RUN);
+            _gdk_pixbuf__sniff_header(&sniffer, out_buffer, lzstream.next_out - out_buffer);
+        }
+    }
+
+    lzma_end(&lzstream);
+    _gdk_pixbuf__free_filter_options(filters);
+    free(sniffer.data);
+    if (sniffer.state == XZ_HEADER_FOUND)
+        *header = sniffer.header;
+    return sniffer.state == XZ_HEADER_FOUND;
+}
+
+/*
+ * Decompress the start of the first block of data, no further than limit bytes
+ * When layout is given, this goes in small steps and stops as soon as *state says whether a raw layout
+ * can be read from the output
+ * Returns the output, shorter than limit if the block ended first, or NULL on an lzma error
+ */
+static GBytes *_gdk_pixbuf__decode_first_block_head(const uint8_t *data, size_t size, uint64_t limit,
+        XZRawLayout *layout, XZHeaderState *state){
+    lzma_stream lzstream = LZMA_STREAM_INIT;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block;
+    GByteArray *head = g_byte_array_new();
+    lzma_ret lzret = LZMA_OK;
+
+    if (state)
+        *state = XZ_HEADER_NEED_MORE;
+    if (!_gdk_pixbuf__first_block_decoder(data, size, &lzstream, &block, filters))
+        lzret = LZMA_DATA_ERROR;
+    while (lzret == LZMA_OK && head->len < limit && (!state || *state == XZ_HEADER_NEED_MORE)){
+        size_t step = layout ? MIN(limit - head->len, XZ_FIRST_BLOCK_STEP) : limit - head->len;
+        size_t length = head->len;
+        g_byte_array_set_size(head, length + step);
+        lzstream.next_out = head->data + length;
+        lzstream.avail_out = step;
+        lzret = lzma_code(&lzstream, LZMA_RUN);
+        g_byte_array_set_size(head, lzstream.next_out - head->data);
+        if (state)
+            *state = _gdk_pixbuf__parse_raw_layout(head->data, head->len, layout);
+        /* Out of input without filling the output, so there is no more to come */
+        if (lzret == LZMA_OK && lzstream.avail_out > 0 && lzstream.avail_in == 0)
+            break;
+    }
+
+    lzma_end(&lzstream);
+    _gdk_pixbuf__free_filter_options(filters);
+    if (lzret != LZMA_OK && lzret != LZMA_STREAM_END){
+        g_byte_array_free(head, TRUE);
+        return NULL;
+    }
+    return g_byte_array_free_to_bytes(head);
+}
+
+/* Whether level is a smaller rendition of image in the same format, as the levels of a pyramid are */
+static gboolean _gdk_pixbuf__is_pyramid_level(const XZInnerHeader *level, const XZInnerHeader *image){
+    return !strcmp(level->format, image->format) && level->width < image->width && level->height < image->height;
+}
+
+/*
+ * Files saved with xz-pyramid have a stream holding only this marker between the image and its levels,
+ * so other inputs made of several streams are never mistaken for pyramids
+ */
+#define XZ_PYRAMID_MARKER "XZPIXBUF-PYRAMID"
+#define XZ_PYRAMID_MARKER_SIZE (sizeof(XZ_PYRAMID_MARKER) - 1)
+
+/* Whether the stream in data is the pyramid marker */
+static gboolean _gdk_pixbuf__is_pyramid_marker(const uint8_t *data, size_t size){
+    uint8_t out[XZ_PYRAMID_MARKER_SIZE + 1];
+    uint64_t memlimit = 1 << 20;
+    size_t in_pos = 0, out_pos = 0;
+
+    return lzma_stream_buffer_decode(&memlimit, 0, NULL, data, &in_pos, size, out, &out_pos, sizeof(out)) == LZMA_OK &&
+        out_pos == XZ_PYRAMID_MARKER_SIZE && !memcmp(out, XZ_PYRAMID_MARKER, XZ_PYRAMID_MARKER_SIZE);
+}
+
+/*
+ * Watches the output of each stream after the first for the pyramid marker, where the image ends
+ * The marker is matched as it is decoded, however the input around it was split up
+ */
+typedef struct {
+    size_t matched;
+    /* Where the watched stream starts in the output buffer, NULL once that part was handed on */
+    uint8_t *boundary;
+    gboolean watching;
+} XZLevelWatch;
+
+/* Called when the decoder reports the header of another stream, whose output will start at next_out */
+static void _gdk_pixbuf__watch_level(XZLevelWatch *watch, const lzma_stream *lzstream){
+    watch->matched = 0;
+    watch->boundary = lzstream->next_out;
+    /* The first stream is the image itself */
+    watch->watching = lzstream->total_out > 0;
+}
+
+/*
+ * Feed the watch the output decoded since out_start, before the decoder moves on to another stream
+ * Returns TRUE if the watched stream is the pyramid marker, so the image has ended,
+ * in which case the marker is taken back out of the buffer where it's still there
+ */
+static gboolean _gdk_pixbuf__pyramid_level_starts(XZLevelWatch *watch, uint8_t *out_start, lzma_stream *lzstream){
+    if (!watch->watching)
+        return FALSE;
+    uint8_t *start = watch->boundary && watch->boundary > out_start ? watch->boundary : out_start;
+    size_t size = MIN((size_t) (lzstream->next_out - start), XZ_PYRAMID_MARKER_SIZE - watch->matched);
+    if (memcmp(start, XZ_PYRAMID_MARKER + watch->matched, size)){
+        watch->watching = FALSE;
+        return FALSE;
+    }
+    watch->matched += size;
+    if (watch->matched < XZ_PYRAMID_MARKER_SIZE)
+        return FALSE;
+    watch->watching = FALSE;
+    if (watch->boundary){
+        lzstream->avail_out += lzstream->next_out - watch->boundary;
+        lzstream->next_out = watch->boundary;
+    }
+    return TRUE;
+}
+
+/* Check the inner image dimensions against the configured limits */
+static gboolean _gdk_pixbuf__inner_header_allowed(const XZInnerHeader *header){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    uint64_t pixels = (uint64_t) header->width * header->height;
+
+    if (config->max_pixels && pixels > config->max_pixels)
+        return FALSE;
+    if (config->max_image_bytes && pixels * header->channels > config->max_image_bytes)
+        return FALSE;
+    return TRUE;
+}
+
+/*
+ * Sniff freshly decoded output, and reject the image as soon as
+ * its header shows it is over the configured limits
+ */
+static gboolean _gdk_pixbuf__sniff_and_check(XZHeaderSniffer *sniffer, const uint8_t *buf, size_t size){
+    if (sniffer->state != XZ_HEADER_NEED_MORE)
+        return TRUE;
+    _gdk_pixbuf__sniff_header(sniffer, buf, size);
+    return sniffer->state != XZ_HEADER_FOUND || _gdk_pixbuf__inner_header_allowed(&sniffer->header);
+}
+
+/*
+ * Per-process counters, sharded so threads rarely share a cache line
+ * Each thread sticks to one shard and only does relaxed atomic adds on it
+ */
+#define XZ_STATS_SHARDS 16
+
+typedef enum {
+    XZ_STAT_LOADS,
+    XZ_STAT_FAILURES,
+    XZ_STAT_COMPRESSED_BYTES = XZ_STAT_FAILURES + XZ_PIXBUF_FAILURE_REASONS,
+    XZ_STAT_UNCOMPRESSED_BYTES,
+    XZ_STAT_LZMA_CODE_USEC,
+    XZ_STAT_INNER_DECODE_USEC,
+    XZ_STAT_BUFFER_GROWTHS,
+    XZ_STAT_PEAK_MEMUSAGE,
+    XZ_STAT_MEMORY_CACHE_HITS,
+    XZ_STAT_DISK_CACHE_HITS,
+    XZ_STAT_PIXEL_CACHE_HITS,
+    XZ_STAT_BROKER_HITS,
+    XZ_STAT_PARALLEL_DECODES,
+    XZ_STAT_REGION_DECODES,
+    XZ_STAT_PASSTHROUGH_BYTES,
+    XZ_STAT_SEGMENT_DECODES,
+    XZ_STAT_PYRAMID_DECODES,
+    XZ_STAT_ANIMATIONS,
+    XZ_STAT_COUNT
+} XZStat;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t counters[XZ_STAT_COUNT];
+} XZStatsShard;
+
+static XZStatsShard xz_stats_shards[XZ_STATS_SHARDS];
+
+/* What a single load cost, added to the counters once the load is over */
+typedef struct {
+    gboolean failed;
+    XZPixbufFailureReason failure_reason;
+    uint64_t compressed_bytes;
+    uint64_t uncompressed_bytes;
+    uint64_t lzma_code_usec;
+    uint64_t inner_decode_usec;
+    uint64_t buffer_growths;
+    uint64_t memusage;
+    lzma_check check;
+    uint64_t blocks;
+    uint32_t dict_size;
+    uint64_t passthrough_bytes;
+    size_t segment_threads;
+    const char *inner_format;
+    /* The vtable entry point that did the load, and when it started */
+    const char *path;
+    int64_t start_usec;
+} XZLoadStats;
+
+static XZStatsShard *_gdk_pixbuf__stats_shard(void){
+    static _Atomic unsigned int next_shard;
+    static _Thread_local XZStatsShard *shard;
+
+    if (!shard)
+        shard = &xz_stats_shards[atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % XZ_STATS_SHARDS];
+    return shard;
+}
+
+/*
+ * Latency histograms of successful loads, by inner format and size class
+ * Sharded like the counters above
+ */
+static const char *xz_histogram_formats[] = {
+    "png", "jpeg", "gif", "bmp", "webp", "pnm", "pam", "farbfeld", "other"
+};
+#define XZ_HISTOGRAM_FORMATS G_N_ELEMENTS(xz_histogram_formats)
+
+/* Size classes go by uncompressed size */
+static const char *xz_histogram_sizes[] = { "small", "medium", "large", "huge" };
+static const uint64_t xz_histogram_size_limits[] = { 1 << 16, 1 << 20, 1 << 24 };
+#define XZ_HISTOGRAM_SIZES G_N_ELEMENTS(xz_histogram_sizes)
+
+/* Upper bounds of the time buckets in microseconds, the last bucket is +Inf */
+static const uint64_t xz_histogram_usec_bounds[] = {
+    500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+#define XZ_HISTOGRAM_USEC_BUCKETS (G_N_ELEMENTS(xz_histogram_usec_bounds) + 1)
+
+/* Share of the load spent in lzma_code, in tenths */
+#define XZ_HISTOGRAM_RATIO_BUCKETS 10
+
+typedef struct {
+    _Atomic uint64_t decompress[XZ_HISTOGRAM_USEC_BUCKETS];
+    _Atomic uint64_t decompress_usec_sum;
+    _Atomic uint64_t inner_decode[XZ_HISTOGRAM_USEC_BUCKETS];
+    _Atomic uint64_t inner_decode_usec_sum;
+    _Atomic uint64_t decompress_ratio[XZ_HISTOGRAM_RATIO_BUCKETS];
+    _Atomic uint64_t decompress_ratio_sum_permille;
+    _Atomic uint64_t count;
+} XZHistogram;
+
+typedef struct {
+    _Alignas(64) XZHistogram histograms[XZ_HISTOGRAM_FORMATS][XZ_HISTOGRAM_SIZES];
+} XZHistogramShard;
+
+static XZHistogramShard xz_histogram_shards[XZ_STATS_SHARDS];
+
+static size_t _gdk_pixbuf__usec_bucket(uint64_t usec){
+    size_t bucket = 0;
+    while (bucket < G_N_ELEMENTS(xz_histogram_usec_bounds) && usec > xz_histogram_usec_bounds[bucket])
+        bucket++;
+    return bucket;
+}
+
+static void _gdk_pixbuf__observe_load(size_t shard, const XZLoadStats *stats){
+    size_t format = XZ_HISTOGRAM_FORMATS - 1;
+    size_t size = 0;
+
+    for (size_t i = 0; stats->inner_format && i < XZ_HISTOGRAM_FORMATS - 1; i++){
+        if (!strcmp(stats->inner_format, xz_histogram_formats[i]))
+            format = i;
+    }
+    while (size < G_N_ELEMENTS(xz_histogram_size_limits) && stats->uncompressed_bytes >= xz_histogram_size_limits[size])
+        size++;
+
+    XZHistogram *histogram = &xz_histogram_shards[shard].histograms[format][size];
+    uint64_t total_usec = stats->lzma_code_usec + stats->inner_decode_usec;
+    uint64_t ratio_permille = total_usec ? stats->lzma_code_usec * 1000 / total_usec : 0;
+
+    atomic_fetch_add_explicit(&histogram->decompress[_gdk_pixbuf__usec_bucket(stats->lzma_code_usec)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->decompress_usec_sum, stats->lzma_code_usec, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->inner_decode[_gdk_pixbuf__usec_bucket(stats->inner_decode_usec)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->inner_decode_usec_sum, stats->inner_decode_usec, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->decompress_ratio[MIN(ratio_permille / 100, XZ_HISTOGRAM_RATIO_BUCKETS - 1)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->decompress_ratio_sum_permille, ratio_permille, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+}
+
+static void _gdk_pixbuf__start_metrics_export(void);
+
+static const char *_gdk_pixbuf__check_name(lzma_check check){
+    switch (check){
+        case LZMA_CHECK_NONE:
+            return "none";
+        case LZMA_CHECK_CRC32:
+            return "crc32";
+        case LZMA_CHECK_CRC64:
+            return "crc64";
+        case LZMA_CHECK_SHA256:
+            return "sha256";
+        default:
+            return NULL;
+    }
+}
+
+/* One structured log line for loads over the configured threshold, with where the time went */
+static void _gdk_pixbuf__log_slow_load(const XZLoadStats *stats){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    if (!config->slow_load_usec)
+        return;
+
+    uint64_t total_usec = g_get_monotonic_time() - stats->start_usec;
+    if (total_usec < config->slow_load_usec)
+        return;
+
+    uint64_t other_usec = total_usec - MIN(total_usec, stats->lzma_code_usec + stats->inner_decode_usec);
+    const char *check = _gdk_pixbuf__check_name(stats->check);
+    char *message = g_strdup_printf("Slow xz image load: %.1f ms total, %.1f ms in lzma_code, %.1f ms in inner decode, %.1f ms elsewhere",
+        total_usec / 1e3, stats->lzma_code_usec / 1e3, stats->inner_decode_usec / 1e3, other_usec / 1e3);
+    char *values[9];
+    values[0] = g_strdup_printf("%" G_GUINT64_FORMAT, stats->compressed_bytes);
+    values[1] = g_strdup_printf("%" G_GUINT64_FORMAT, stats->uncompressed_bytes);
+    /* The block count is only known when the index could be read */
+    values[2] = stats->blocks ? g_strdup_printf("%" G_GUINT64_FORMAT, stats->blocks) : g_strdup("unknown");
+    values[3] = g_strdup_printf("%u", stats->dict_size);
+    values[4] = g_strdup_printf("%" G_GUINT64_FORMAT, total_usec);
+    values[5] = g_strdup_printf("%" G_GUINT64_FORMAT, stats->lzma_code_usec);
+    values[6] = g_strdup_printf("%" G_GUINT64_FORMAT, stats->inner_decode_usec);
+    values[7] = g_strdup_printf("%" G_GUINT64_FORMAT, other_usec);
+    values[8] = NULL;
+
+    const GLogField fields[] = {
+        { "MESSAGE", message, -1 },
+        { "PRIORITY", "4", -1 },
+        { "GLIB_DOMAIN", XZ_PIXBUF_LOG_DOMAIN, -1 },
+        { "XZ_PIXBUF_PATH", stats->path, -1 },
+        { "XZ_PIXBUF_FAILED", stats->failed ? "1" : "0", -1 },
+        { "XZ_PIXBUF_INPUT_SIZE", values[0], -1 },
+        { "XZ_PIXBUF_UNCOMPRESSED_SIZE", values[1], -1 },
+        { "XZ_PIXBUF_BLOCKS", values[2], -1 },
+        { "XZ_PIXBUF_DICT_SIZE", values[3], -1 },
+        { "XZ_PIXBUF_CHECK", check ? check : "unknown", -1 },
+        { "XZ_PIXBUF_INNER_FORMAT", stats->inner_format ? stats->inner_format : "unknown", -1 },
+        { "XZ_PIXBUF_TOTAL_USEC", values[4], -1 },
+        { "XZ_PIXBUF_LZMA_CODE_USEC", values[5], -1 },
+        { "XZ_PIXBUF_INNER_DECODE_USEC", values[6], -1 },
+        { "XZ_PIXBUF_OTHER_USEC", values[7], -1 },
+    };
+    g_log_structured_array(G_LOG_LEVEL_WARNING, fields, G_N_ELEMENTS(fields));
+
+    g_free(message);
+    for (int i = 0; values[i]; i++)
+        g_free(values[i]);
+}
+
+static void _gdk_pixbuf__commit_load_stats(const XZLoadStats *stats){
+    XZStatsShard *shard = _gdk_pixbuf__stats_shard();
+    _Atomic uint64_t *counters = shard->counters;
+
+    atomic_fetch_add_explicit(&counters[XZ_STAT_LOADS], 1, memory_order_relaxed);
+    if (stats->failed)
+        atomic_fetch_add_explicit(&counters[XZ_STAT_FAILURES + stats->failure_reason], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[XZ_STAT_COMPRESSED_BYTES], stats->compressed_bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[XZ_STAT_UNCOMPRESSED_BYTES], stats->uncompressed_bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[XZ_STAT_LZMA_CODE_USEC], stats->lzma_code_usec, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[XZ_STAT_INNER_DECODE_USEC], stats->inner_decode_usec, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[XZ_STAT_BUFFER_GROWTHS], stats->buffer_growths, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters[XZ_STAT_PASSTHROUGH_BYTES], stats->passthrough_bytes, memory_order_relaxed);
+
+    /* The peak is a maximum, not a sum */
+    uint64_t peak = atomic_load_explicit(&counters[XZ_STAT_PEAK_MEMUSAGE], memory_order_relaxed);
+    while (stats->memusage > peak &&
+            !atomic_compare_exchange_weak_explicit(&counters[XZ_STAT_PEAK_MEMUSAGE], &peak, stats->memusage,
+                memory_order_relaxed, memory_order_relaxed));
+
+    if (!stats->failed)
+        _gdk_pixbuf__observe_load(shard - xz_stats_shards, stats);
+    _gdk_pixbuf__log_slow_load(stats);
+    _gdk_pixbuf__start_metrics_export();
+}
+
+/* Gather the liblzma side of a load's cost right before the decoder is torn down */
+static void _gdk_pixbuf__record_lzma_stats(XZLoadStats *stats, lzma_stream *lzstream){
+    stats->compressed_bytes = lzstream->total_in;
+    stats->uncompressed_bytes = lzstream->total_out;
+    stats->memusage = lzma_memusage(lzstream);
+    stats->check = lzma_get_check(lzstream);
+}
+
+/* For events that are not part of a decode, like cache hits */
+static void _gdk_pixbuf__count_stat(XZStat stat){
+    atomic_fetch_add_explicit(&_gdk_pixbuf__stats_shard()->counters[stat], 1, memory_order_relaxed);
+}
+
+static void _gdk_pixbuf__fail_load_stats(XZLoadStats *stats, XZPixbufFailureReason reason){
+    if (!stats->failed){
+        stats->failed = TRUE;
+        stats->failure_reason = reason;
+    }
+}
+
+/*
+ * The start and the end of the compressed input
+ * That is enough to read the stream header and the xz indexes, without keeping the whole file
+ */
+#define XZ_INPUT_HEAD_SIZE (1 << 11)
+#define XZ_INPUT_TAIL_SIZE (1 << 16)
+
+typedef struct {
+    uint8_t head[XZ_INPUT_HEAD_SIZE];
+    size_t head_size;
+    /* Twice XZ_INPUT_TAIL_SIZE, so the tail only moves every so often */
+    uint8_t *tail;
+    size_t tail_size;
+    uint64_t total_size;
+} XZInputWindows;
+
+static gboolean _gdk_pixbuf__record_input(XZInputWindows *windows, const uint8_t *buf, size_t size){
+
+    if (windows->head_size < XZ_INPUT_HEAD_SIZE){
+        size_t head_copy = MIN(size, XZ_INPUT_HEAD_SIZE - windows->head_size);
+        memcpy(windows->head + windows->head_size, buf, head_copy);
+        windows->head_size += head_copy;
+    }
+    windows->total_size += size;
+
+    if (!windows->tail){
+        windows->tail = (uint8_t *) malloc(2 * XZ_INPUT_TAIL_SIZE);
+        if (!windows->tail)
+            return FALSE;
+    }
+
+    if (size >= XZ_INPUT_TAIL_SIZE){
+        memcpy(windows->tail, buf + size - XZ_INPUT_TAIL_SIZE, XZ_INPUT_TAIL_SIZE);
+        windows->tail_size = XZ_INPUT_TAIL_SIZE;
+        return TRUE;
+    }
+    if (windows->tail_size + size > 2 * XZ_INPUT_TAIL_SIZE){
+        size_t keep = XZ_INPUT_TAIL_SIZE - size;
+        memmove(windows->tail, windows->tail + windows->tail_size - keep, keep);
+        windows->tail_size = keep;
+    }
+    memcpy(windows->tail + windows->tail_size, buf, size);
+    windows->tail_size += size;
+    return TRUE;
+}
+
+/* Whatever we kept of the input from offset onwards, if anything */
+static const uint8_t *_gdk_pixbuf__input_at(const XZInputWindows *windows, uint64_t offset, size_t *available){
+    uint64_t tail_start = windows->total_size - windows->tail_size;
+
+    if (offset >= tail_start && offset < windows->total_size){
+        *available = windows->total_size - offset;
+        return windows->tail + (offset - tail_start);
+    }
+    if (offset < windows->head_size){
+        *available = windows->head_size - offset;
+        return windows->head + offset;
+    }
+    return NULL;
+}
+
+/*
+ * Decode the combined index of all the streams in the input
+ * Returns NULL if the indexes are not all within the kept windows
+ */
+static lzma_index *_gdk_pixbuf__decode_input_index(const XZInputWindows *windows){
+    lzma_stream lzstream = LZMA_STREAM_INIT;
+    lzma_index *index = NULL;
+    uint64_t position = 0;
+
+    if (lzma_file_info_decoder(&lzstream, &index, UINT64_MAX, windows->total_size) != LZMA_OK)
+        return NULL;
+
+    while (TRUE){
+        size_t available = 0;
+        const uint8_t *data = _gdk_pixbuf__input_at(windows, position, &available);
+        if (!data)
+            break;
+        lzstream.next_in = data;
+        lzstream.avail_in = available;
+
+        lzma_ret lzret = lzma_code(&lzstream, LZMA_RUN);
+        if (lzret == LZMA_SEEK_NEEDED){
+            position = lzstream.seek_pos;
+        } else if (lzret == LZMA_OK){
+            position += available;
+        } else {
+            break;
+        }
+    }
+
+    lzma_end(&lzstream);
+    return index;
+}
+
+/*
+ * Decode the combined index of all the streams in a seekable file
+ * Only the stream headers, footers and indexes are read
+ */
+static lzma_index *_gdk_pixbuf__decode_file_index(int fd, uint64_t file_size){
+    lzma_stream lzstream = LZMA_STREAM_INIT;
+    lzma_index *index = NULL;
+    uint8_t buffer[1 << 16];
+    uint64_t position = 0;
+
+    if (lzma_file_info_decoder(&lzstream, &index, UINT64_MAX, file_size) != LZMA_OK)
+        return NULL;
+
+    while (TRUE){
+        ssize_t bytes_read = pread(fd, buffer, sizeof(buffer), position);
+        if (bytes_read <= 0)
+            break;
+        lzstream.next_in = buffer;
+        lzstream.avail_in = bytes_read;
+
+        lzma_ret lzret = lzma_code(&lzstream, LZMA_RUN);
+        if (lzret == LZMA_SEEK_NEEDED){
+            position = lzstream.seek_pos;
+        } else if (lzret == LZMA_OK){
+            position += bytes_read;
+        } else {
+            break;
+        }
+    }
+
+    lzma_end(&lzstream);
+    return index;
+}
+
+static void _gdk_pixbuf__set_uint64_option(GdkPixbuf *pixbuf, const char *key, uint64_t value){
+    char text[24];
+    g_snprintf(text, sizeof(text), "%" G_GUINT64_FORMAT, value);
+    gdk_pixbuf_set_option(pixbuf, key, text);
+}
+
+/* Describe how the pixbuf was decoded, so callers can tell what reloading it would cost */
+static void _gdk_pixbuf__attach_load_options(GdkPixbuf *pixbuf, const XZLoadStats *stats){
+    const char *check = _gdk_pixbuf__check_name(stats->check);
+
+    _gdk_pixbuf__set_uint64_option(pixbuf, "xz::compressed-size", stats->compressed_bytes);
+    _gdk_pixbuf__set_uint64_option(pixbuf, "xz::uncompressed-size", stats->uncompressed_bytes);
+    if (check)
+        gdk_pixbuf_set_option(pixbuf, "xz::check", check);
+    if (stats->blocks)
+        _gdk_pixbuf__set_uint64_option(pixbuf, "xz::blocks", stats->blocks);
+    else
+        gdk_pixbuf_set_option(pixbuf, "xz::blocks", "unknown");
+    _gdk_pixbuf__set_uint64_option(pixbuf, "xz::memusage", stats->memusage);
+    _gdk_pixbuf__set_uint64_option(pixbuf, "xz::decompress-usec", stats->lzma_code_usec);
+    _gdk_pixbuf__set_uint64_option(pixbuf, "xz::decode-usec", stats->inner_decode_usec);
+    if (stats->inner_format)
+        gdk_pixbuf_set_option(pixbuf, "xz::inner-format", stats->inner_format);
+}
+
+/* The LZMA2 dictionary size, from the filter chain in the first block header */
+static uint32_t _gdk_pixbuf__first_block_dict_size(const XZInputWindows *windows){
+    lzma_stream_flags stream_flags;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = { 0 };
+    uint32_t dict_size = 0;
+
+    if (windows->head_size < LZMA_STREAM_HEADER_SIZE + 1 ||
+            lzma_stream_header_decode(&stream_flags, windows->head) != LZMA_OK)
+        return 0;
+
+    const uint8_t *header = windows->head + LZMA_STREAM_HEADER_SIZE;
+    block.version = 1;
+    block.check = stream_flags.check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(header[0]);
+    if (header[0] == 0x00 || LZMA_STREAM_HEADER_SIZE + block.header_size > windows->head_size ||
+            lzma_block_header_decode(&block, NULL, header) != LZMA_OK)
+        return 0;
+
+    for (int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++){
+        if (filters[i].id == LZMA_FILTER_LZMA2 || filters[i].id == LZMA_FILTER_LZMA1)
+            dict_size = ((lzma_options_lzma *) filters[i].options)->dict_size;
+        free(filters[i].options);
+    }
+    return dict_size;
+}
+
+/* Fill in what only the input windows and the sniffed header can tell about a finished load */
+static void _gdk_pixbuf__record_stream_stats(XZLoadStats *stats, const XZInputWindows *windows, const XZHeaderSniffer *sniffer){
+    stats->dict_size = _gdk_pixbuf__first_block_dict_size(windows);
+    lzma_index *index = _gdk_pixbuf__decode_input_index(windows);
+    if (index){
+        stats->blocks = lzma_index_block_count(index);
+        lzma_index_end(index, NULL);
+    }
+    if (sniffer->state == XZ_HEADER_FOUND)
+        stats->inner_format = sniffer->header.format;
+}
+
+/* Loader Context */
+typedef struct {
+
+    GdkPixbufModuleSizeFunc size_func;
+    GdkPixbufModuleUpdatedFunc updated_func;
+    GdkPixbufModulePreparedFunc prepare_func;
+
+    lzma_stream *lzstream;
+    uint8_t *unxz_buffer;
+    size_t xz_buffer_size;
+
+    uint8_t *staging_buffer;
+    size_t staging_size;
+    size_t staging_capacity;
+
+    XZHeaderSniffer sniffer;
+    XZLevelWatch level_watch;
+    gboolean size_announced;
+    int requested_width;
+    int requested_height;
+    gboolean failed;
+
+    /* Once a smaller size is asked for, the input is only collected, in case it is a pyramid */
+    GByteArray *deferred;
+    /* Set at the first level of a pyramid, after which nothing more is decoded */
+    gboolean image_ended;
+    /* Set when an animation was deferred, to be decoded as its frames are shown */
+    gboolean animated;
+    GdkPixbufAnimation *animation;
+    /* Until the output shows whether the load is to be deferred, the input is also kept here, in case it is */
+    XZAnimationScan animation_scan;
+    GByteArray *undecided;
+    XZLoadStats stats;
+    XZInputWindows input_windows;
+
+    gpointer extra_context;
+    GdkPixbuf *pixbuf;
+    GError **error;
+    GInputStream *memory_istream;
+
+} XZImageDecodeContext;
+
+/*
+ * Decode a whole xz-compressed image in one go
+ * The input is either read from file, or when file is NULL, already in memory
+ * When payload is given, it collects the decompressed inner file as GBytes chunks
+ * When scan is given, the output is fed to it too, and decoding stops without an error once it finds an animation
+ */
+static GdkPixbuf *_gdk_pixbuf__decode_xz_input(FILE *file, const uint8_t *input, size_t input_size, GPtrArray *payload,
+        XZAnimationScan *scan, GError **error) {
+
+    char *error_message = NULL;
+
+    const size_t buffer_size = 1 << 20;
+    uint8_t *xz_buffer = NULL;
+    uint8_t *unxz_buffer = NULL;
+    GInputStream *memory_istream = NULL;
+    GdkPixbuf *pixbuf = NULL;
+    XZHeaderSniffer sniffer = { XZ_HEADER_NEED_MORE };
+    XZLevelWatch level_watch = { 0 };
+    XZLoadStats stats = { .path = "load", .start_usec = g_get_monotonic_time() };
+    XZInputWindows input_windows = { 0 };
+    XZPixbufFailureReason failure_reason = XZ_PIXBUF_FAILURE_ALLOC;
+    int64_t start_time;
+    
+    lzma_stream *lzstream = NULL;
+    lzma_ret lzret;
+    lzma_action lzaction;
+
+    lzstream = malloc(sizeof(lzma_stream));
+    if (!lzstream){
+        error_message = "Failed to allocate lzma_stream";
+        goto failure;
+    }
+    *lzstream = (lzma_stream) LZMA_STREAM_INIT;
+
+    lzret = lzma_stream_decoder(lzstream, UINT64_MAX, LZMA_CONCATENATED | LZMA_TELL_ANY_CHECK);
+    if (lzret != LZMA_OK) {
+        error_message = "Could not create lzma_stream_decoder";
+        failure_reason = XZ_PIXBUF_FAILURE_LZMA;
+        goto failure;
+    }
+    XZ_PIXBUF_PROBE1(decoder_init, XZ_PIXBUF_PATH_ONESHOT);
+
+    xz_buffer = file ? (uint8_t *) malloc(buffer_size) : NULL;
+    unxz_buffer = (uint8_t *) malloc(buffer_size);
+    if ((file && !xz_buffer) || !unxz_buffer){
+        error_message = "Could not allocate xz data buffers";
+        goto failure;
+    }
+
+    lzaction = LZMA_RUN;
+    lzstream->next_in = NULL;
+    lzstream->avail_in = 0;
+    lzstream->next_out = unxz_buffer;
+    lzstream->avail_out = buffer_size;
+
+    /* Input that is already in memory is decoded straight from there */
+    if (!file){
+        if (!_gdk_pixbuf__record_input(&input_windows, input, input_size)){
+            error_message = "Error allocating memory";
+            goto failure;
+        }
+        lzstream->next_in = input;
+        lzstream->avail_in = input_size;
+        lzaction = LZMA_FINISH;
+    }
+
+    memory_istream = g_memory_input_stream_new();
+
+    while (TRUE){
+
+        if (lzstream->avail_in == 0 && file && !feof(file)){
+            size_t bytes_read = fread(xz_buffer, 1, buffer_size, file);
+            if (bytes_read < buffer_size){
+                if (ferror(file)){
+                    error_message = "Error reading file with fread";
+                    failure_reason = XZ_PIXBUF_FAILURE_IO;
+                    goto failure;
+                }
+            }
+            if (!_gdk_pixbuf__record_input(&input_windows, xz_buffer, bytes_read)){
+                error_message = "Error allocating memory";
+                goto failure;
+            }
+            lzstream->next_in = xz_buffer;
+            lzstream->avail_in = bytes_read;
+            if (feof(file)){
+                lzaction = LZMA_FINISH;
+            }
+        }
+
+        uint8_t *out_start = lzstream->next_out;
+        size_t in_before = lzstream->avail_in;
+        start_time = g_get_monotonic_time();
+        lzret = lzma_code(lzstream, lzaction);
+        stats.lzma_code_usec += g_get_monotonic_time() - start_time;
+        XZ_PIXBUF_PROBE2(lzma_code, in_before - lzstream->avail_in, lzstream->next_out - out_start);
+        XZ_PIXBUF_MARK(start_time, "lzma_code", "one-shot load");
+        /* The levels of a pyramid follow its image, and aren't needed for it */
+        if ((lzret == LZMA_OK || lzret == LZMA_GET_CHECK) && _gdk_pixbuf__pyramid_level_starts(&level_watch, out_start, lzstream)){
+            lzret = LZMA_STREAM_END;
+        } else if (lzret == LZMA_GET_CHECK){
+            _gdk_pixbuf__watch_level(&level_watch, lzstream);
+            lzret = LZMA_OK;
+        }
+
+        if (!_gdk_pixbuf__sniff_and_check(&sniffer, out_start, lzstream->next_out - out_start)){
+            error_message = "Image dimensions exceed the configured limits";
+            failure_reason = XZ_PIXBUF_FAILURE_LIMIT;
+            goto failure;
+        }
+
+        /* An animation is left to the caller, which decodes it as its frames are shown */
+        if (scan && scan->state == XZ_HEADER_NEED_MORE){
+            _gdk_pixbuf__scan_animation(scan, out_start, lzstream->next_out - out_start);
+            if (scan->state == XZ_HEADER_FOUND)
+                goto failure;
+        }
+        
+        /* A full buffer is given away as-is and replaced, only the last partial one is copied */
+        size_t mem_buffer_size = buffer_size - lzstream->avail_out;
+        if (mem_buffer_size > 0 && (lzstream->avail_out == 0 || lzret == LZMA_STREAM_END)){
+            uint8_t *mem_buffer = (uint8_t *) malloc(lzstream->avail_out == 0 ? buffer_size : mem_buffer_size);
+            if (!mem_buffer){
+                error_message = "Error allocating memory";
+                goto failure;
+            }
+            if (lzstream->avail_out == 0){
+                uint8_t *full_buffer = unxz_buffer;
+                unxz_buffer = mem_buffer;
+                mem_buffer = full_buffer;
+            } else {
+                memcpy(mem_buffer, unxz_buffer, mem_buffer_size);
+            }
+            if (payload){
+                GBytes *chunk = g_bytes_new_with_free_func(mem_buffer, mem_buffer_size, free, mem_buffer);
+                g_memory_input_stream_add_bytes(G_MEMORY_INPUT_STREAM(memory_istream), chunk);
+                g_ptr_array_add(payload, chunk);
+            } else {
+                g_memory_input_stream_add_data(G_MEMORY_INPUT_STREAM(memory_istream), mem_buffer, mem_buffer_size, free);
+            }
+            XZ_PIXBUF_PROBE1(chunk_append, mem_buffer_size);
+            stats.buffer_growths++;
+            lzstream->next_out = unxz_buffer;
+            lzstream->avail_out = buffer_size;
+            level_watch.boundary = NULL;
+        }
+
+        if(lzret != LZMA_OK){
+            if (lzret == LZMA_STREAM_END)
+                break;
+            error_message = "Some LZMA error occurred";
+            failure_reason = XZ_PIXBUF_FAILURE_LZMA;
+            goto failure;
+        }
+
+    } // while(TRUE)
+
+    XZ_PIXBUF_PROBE1(inner_decode_start, lzstream->total_out);
+    start_time = g_get_monotonic_time();
+    pixbuf = gdk_pixbuf_new_from_stream(memory_istream, NULL, error);
+    stats.inner_decode_usec = g_get_monotonic_time() - start_time;
+    XZ_PIXBUF_PROBE1(inner_decode_end, pixbuf != NULL);
+    XZ_PIXBUF_MARK(start_time, "inner decode", "one-shot load");
+    if (!pixbuf){
+        error_message = "Could not create pixbuf from memory stream";
+        failure_reason = XZ_PIXBUF_FAILURE_INNER_DECODE;
+        goto failure;
+    }
+
+    XZ_PIXBUF_PROBE2(pixbuf_created, gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf));
+    g_input_stream_close(memory_istream, NULL, error);
+    g_object_unref(memory_istream);
+    _gdk_pixbuf__record_lzma_stats(&stats, lzstream);
+    _gdk_pixbuf__record_stream_stats(&stats, &input_windows, &sniffer);
+    _gdk_pixbuf__attach_load_options(pixbuf, &stats);
+    _gdk_pixbuf__commit_load_stats(&stats);
+    lzma_end(lzstream);
+    free(lzstream);
+    free(xz_buffer);
+    free(unxz_buffer);
+    free(sniffer.data);
+    free(input_windows.tail);
+
+    return pixbuf;
+
+failure:
+    if (error_message)
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, error_message);
+    if (xz_buffer)
+        free(xz_buffer);
+    if (unxz_buffer)
+        free(unxz_buffer);
+    if (lzstream){
+        _gdk_pixbuf__record_lzma_stats(&stats, lzstream);
+        lzma_end(lzstream);
+        free(lzstream);
+    }
+    /* A found animation isn't a load of its own, it is accounted for once it is decoded */
+    if (error_message){
+        _gdk_pixbuf__fail_load_stats(&stats, failure_reason);
+        _gdk_pixbuf__commit_load_stats(&stats);
+    }
+    free(sniffer.data);
+    free(input_windows.tail);
+    if (memory_istream){
+        g_input_stream_close(memory_istream, NULL, NULL);
+        g_object_unref(memory_istream);
+    }
+    return NULL;
+
+}
+
+/*
+ * Read all of the remaining input into memory
+ * Regular files are mapped rather than copied
+ */
+static GBytes *_gdk_pixbuf__read_whole_input(FILE *file, GError **error){
+    struct stat st;
+    int fd = fileno(file);
+    long position = ftell(file);
+
+    if (position >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > position){
+        GMappedFile *mapped = g_mapped_file_new_from_fd(fd, FALSE, NULL);
+        if (mapped){
+            GBytes *whole = g_mapped_file_get_bytes(mapped);
+            GBytes *input = g_bytes_new_from_bytes(whole, position, g_bytes_get_size(whole) - position);
+            g_bytes_unref(whole);
+            g_mapped_file_unref(mapped);
+            return input;
+        }
+    }
+
+    GByteArray *array = g_byte_array_new();
+    uint8_t buffer[1 << 16];
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        g_byte_array_append(array, buffer, bytes_read);
+    if (ferror(file)){
+        g_byte_array_free(array, TRUE);
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Error reading file with fread");
+        return NULL;
+    }
+    return g_byte_array_free_to_bytes(array);
+}
+
+/*
+ * Persistent cache of decompressed inner files, shared between processes
+ * Entries are written to a temporary file and renamed into place, so readers only ever see whole files
+ * Least recently used entries go first, with the mtime of an entry bumped on every hit
+ */
+
+/* Key a regular file on where it lives and when it last changed, so hits don't have to hash it */
+static char *_gdk_pixbuf__disk_cache_file_key(FILE *file){
+    struct stat st;
+    long position = ftell(file);
+
+    if (position < 0 || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode))
+        return NULL;
+    return g_strdup_printf("file:%ju:%ju:%jd:%jd.%09ld:%ld", (uintmax_t) st.st_dev, (uintmax_t) st.st_ino,
+        (intmax_t) st.st_size, (intmax_t) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec, position);
+}
+
+static char *_gdk_pixbuf__disk_cache_name(GBytes *input, const char *key){
+    size_t input_size;
+    const uint8_t *input_data = g_bytes_get_data(input, &input_size);
+
+    /* Anything without a stable identity, like a pipe, is keyed on its content */
+    if (key)
+        return g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar *) key, strlen(key));
+    return g_compute_checksum_for_data(G_CHECKSUM_SHA256, input_data, input_size);
+}
+
+typedef struct {
+    char *path;
+    int64_t mtime;
+    uint64_t size;
+} XZDiskCacheEntry;
+
+static int _gdk_pixbuf__disk_cache_entry_compare(gconstpointer a, gconstpointer b){
+    const XZDiskCacheEntry *ea = *(XZDiskCacheEntry * const *) a;
+    const XZDiskCacheEntry *eb = *(XZDiskCacheEntry * const *) b;
+    return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+static void _gdk_pixbuf__disk_cache_entry_free(gpointer data){
+    XZDiskCacheEntry *entry = (XZDiskCacheEntry *) data;
+    g_free(entry->path);
+    free(entry);
+}
+
+/* Remove the oldest entries until the cache directory fits in its limit again */
+static void _gdk_pixbuf__disk_cache_evict(const char *cache_dir, uint64_t limit){
+    GDir *dir = g_dir_open(cache_dir, 0, NULL);
+    if (!dir)
+        return;
+
+    GPtrArray *entries = g_ptr_array_new_with_free_func(_gdk_pixbuf__disk_cache_entry_free);
+    uint64_t total = 0;
+    const char *name;
+    while ((name = g_dir_read_name(dir))){
+        struct stat st;
+        /* Temporary files of writes in progress start with a dot */
+        if (name[0] == '.')
+            continue;
+        char *path = g_build_filename(cache_dir, name, NULL);
+        XZDiskCacheEntry *entry = NULL;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            entry = (XZDiskCacheEntry *) malloc(sizeof(XZDiskCacheEntry));
+        if (!entry){
+            g_free(path);
+            continue;
+        }
+        entry->path = path;
+        entry->mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        entry->size = st.st_size;
+        total += entry->size;
+        g_ptr_array_add(entries, entry);
+    }
+    g_dir_close(dir);
+
+    g_ptr_array_sort(entries, _gdk_pixbuf__disk_cache_entry_compare);
+    for (guint i = 0; i < entries->len && total > limit; i++){
+        XZDiskCacheEntry *entry = (XZDiskCacheEntry *) g_ptr_array_index(entries, i);
+        /* Another process may have evicted it already */
+        unlink(entry->path);
+        total -= entry->size;
+    }
+    g_ptr_array_unref(entries);
+}
+
+/* Write an entry made of the given GBytes chunks, then trim the directory back to its limit */
+static void _gdk_pixbuf__disk_cache_store(const char *cache_dir, const char *name, GPtrArray *payload, uint64_t limit){
+    uint64_t payload_size = 0;
+
+    for (guint i = 0; i < payload->len; i++)
+        payload_size += g_bytes_get_size((GBytes *) g_ptr_array_index(payload, i));
+    if (payload_size > limit)
+        return;
+    if (g_mkdir_with_parents(cache_dir, 0700) != 0)
+        return;
+
+    char *path = g_build_filename(cache_dir, name, NULL);
+    char *temp_path = g_build_filename(cache_dir, ".tmp-XXXXXX", NULL);
+    int fd = g_mkstemp(temp_path);
+    if (fd < 0){
+        g_free(temp_path);
+        g_free(path);
+        return;
+    }
+
+    gboolean written = TRUE;
+    for (guint i = 0; i < payload->len && written; i++){
+        size_t chunk_size;
+        const uint8_t *chunk = g_bytes_get_data((GBytes *) g_ptr_array_index(payload, i), &chunk_size);
+        while (chunk_size > 0){
+            ssize_t ret = write(fd, chunk, chunk_size);
+            if (ret < 0){
+                written = FALSE;
+                break;
+            }
+            chunk += ret;
+            chunk_size -= ret;
+        }
+    }
+    if (close(fd) != 0)
+        written = FALSE;
+
+    if (!written || rename(temp_path, path) != 0)
+        unlink(temp_path);
+    else
+        _gdk_pixbuf__disk_cache_evict(cache_dir, limit);
+    g_free(temp_path);
+    g_free(path);
+}
+
+/*
+ * Hand an inner file, in pieces that are read in order, straight to the inner decoder
+ * hit_stat is counted when it decodes, unless it is XZ_STAT_COUNT
+ * Returns NULL without setting error when the entry is not a decodable image, logging why, as the caller then
+ * decodes the input in full
+ */
+static GdkPixbuf *_gdk_pixbuf__decode_pieces(GPtrArray *pieces, XZLoadStats *stats, XZStat hit_stat, GError **error){
+    XZHeaderSniffer sniffer = { XZ_HEADER_NEED_MORE };
+    GdkPixbuf *pixbuf = NULL;
+    GError *inner_error = NULL;
+    gboolean allowed = TRUE;
+
+    stats->uncompressed_bytes = 0;
+    for (guint i = 0; i < pieces->len; i++){
+        size_t piece_size;
+        const uint8_t *piece_data = g_bytes_get_data((GBytes *) g_ptr_array_index(pieces, i), &piece_size);
+        stats->uncompressed_bytes += piece_size;
+        allowed = allowed && _gdk_pixbuf__sniff_and_check(&sniffer, piece_data, piece_size);
+    }
+    if (!allowed){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Image dimensions exceed the configured limits");
+        _gdk_pixbuf__fail_load_stats(stats, XZ_PIXBUF_FAILURE_LIMIT);
+        _gdk_pixbuf__commit_load_stats(stats);
+        free(sniffer.data);
+        return NULL;
+    }
+
+    GInputStream *memory_istream = g_memory_input_stream_new();
+    for (guint i = 0; i < pieces->len; i++)
+        g_memory_input_stream_add_bytes(G_MEMORY_INPUT_STREAM(memory_istream), (GBytes *) g_ptr_array_index(pieces, i));
+    int64_t start_time = g_get_monotonic_time();
+    pixbuf = gdk_pixbuf_new_from_stream(memory_istream, NULL, &inner_error);
+    stats->inner_decode_usec = g_get_monotonic_time() - start_time;
+    XZ_PIXBUF_MARK(start_time, "inner decode", stats->path);
+    g_input_stream_close(memory_istream, NULL, NULL);
+    g_object_unref(memory_istream);
+
+    /* The caller falls back to a full decode, which does its own accounting */
+    if (pixbuf){
+        if (sniffer.state == XZ_HEADER_FOUND)
+            stats->inner_format = sniffer.header.format;
+        _gdk_pixbuf__attach_load_options(pixbuf, stats);
+        if (hit_stat != XZ_STAT_COUNT)
+            _gdk_pixbuf__count_stat(hit_stat);
+        _gdk_pixbuf__commit_load_stats(stats);
+    } else {
+        g_log(XZ_PIXBUF_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, "Could not decode the %s output, decoding the input in full: %s",
+            stats->path, inner_error ? inner_error->message : "unknown error");
+        g_clear_error(&inner_error);
+    }
+    free(sniffer.data);
+    return pixbuf;
+}
+
+/* The same for an inner file that is all in one piece */
+static GdkPixbuf *_gdk_pixbuf__decode_payload(GBytes *payload, XZLoadStats *stats, XZStat hit_stat, GError **error){
+    GPtrArray *pieces = g_ptr_array_new();
+    g_ptr_array_add(pieces, payload);
+    GdkPixbuf *pixbuf = _gdk_pixbuf__decode_pieces(pieces, stats, hit_stat, error);
+    g_ptr_array_free(pieces, TRUE);
+    return pixbuf;
+}
+
+/*
+ * Where each block of the input starts and what it decodes to, enough to decode blocks on their own
+ * Plans come from the xz index, or from a .xzidx sidecar, which saves seeking to the index at the end of the file
+ */
+typedef struct {
+    uint64_t compressed_offset;
+    uint64_t uncompressed_offset;
+    uint64_t total_size;
+    uint64_t uncompressed_size;
+    uint32_t check;
+} XZBlockEntry;
+
+typedef struct {
+    uint64_t uncompressed_size;
+    size_t block_count;
+    XZBlockEntry *blocks;
+    /* The inner header recorded in a sidecar, format is NULL when there is none */
+    XZInnerHeader header;
+} XZBlockPlan;
+
+/* A whole-file load, with its input already in memory */
+typedef struct {
+    GBytes *input;
+    /* Identity of the input file for the disk caches, NULL if it has none */
+    char *disk_key;
+    /* From a sidecar index, NULL if none was found */
+    XZBlockPlan *plan;
+} XZWholeInput;
+
+static void _gdk_pixbuf__free_block_plan(XZBlockPlan *plan){
+    if (!plan)
+        return;
+    free(plan->blocks);
+    free(plan);
+}
+
+static XZBlockPlan *_gdk_pixbuf__new_block_plan(size_t block_count){
+    XZBlockPlan *plan = (XZBlockPlan *) calloc(1, sizeof(XZBlockPlan));
+    if (!plan)
+        return NULL;
+    plan->block_count = block_count;
+    plan->blocks = (XZBlockEntry *) calloc(MAX(block_count, 1), sizeof(XZBlockEntry));
+    if (!plan->blocks){
+        free(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+static XZBlockPlan *_gdk_pixbuf__block_plan_from_index(const lzma_index *index){
+    lzma_index_iter iter;
+    XZBlockPlan *plan = _gdk_pixbuf__new_block_plan(lzma_index_block_count(index));
+    if (!plan)
+        return NULL;
+
+    plan->uncompressed_size = lzma_index_uncompressed_size(index);
+    lzma_index_iter_init(&iter, index);
+    for (size_t i = 0; i < plan->block_count && !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK); i++){
+        plan->blocks[i].compressed_offset = iter.block.compressed_file_offset;
+        plan->blocks[i].uncompressed_offset = iter.block.uncompressed_file_offset;
+        plan->blocks[i].total_size = iter.block.total_size;
+        plan->blocks[i].uncompressed_size = iter.block.uncompressed_size;
+        plan->blocks[i].check = iter.stream.flags->check;
+    }
+    return plan;
+}
+
+/* Drop the blocks of a pyramid's marker and levels from a plan of the whole input, leaving those of its image */
+static void _gdk_pixbuf__trim_pyramid_plan(XZBlockPlan *plan, const lzma_index *index, const uint8_t *data, size_t size){
+    lzma_index_iter iter;
+
+    if (lzma_index_stream_count(index) < 2)
+        return;
+    lzma_index_iter_init(&iter, index);
+    if (lzma_index_iter_next(&iter, LZMA_INDEX_ITER_STREAM))
+        return;
+    lzma_vli block_count = iter.stream.block_count;
+    lzma_vli uncompressed_size = iter.stream.uncompressed_size;
+    if (lzma_index_iter_next(&iter, LZMA_INDEX_ITER_STREAM) || iter.stream.compressed_offset > size ||
+            iter.stream.compressed_size > size - iter.stream.compressed_offset ||
+            !_gdk_pixbuf__is_pyramid_marker(data + iter.stream.compressed_offset, iter.stream.compressed_size))
+        return;
+    plan->block_count = block_count;
+    plan->uncompressed_size = uncompressed_size;
+}
+
+/* Decode the combined index of all the streams in an input that is all in memory */
+static lzma_index *_gdk_pixbuf__decode_memory_index(const uint8_t *data, size_t size){
+    lzma_stream lzstream = LZMA_STREAM_INIT;
+    lzma_index *index = NULL;
+    lzma_ret lzret;
+
+    if (lzma_file_info_decoder(&lzstream, &index, UINT64_MAX, size) != LZMA_OK)
+        return NULL;
+
+    lzstream.next_in = data;
+    lzstream.avail_in = size;
+    while ((lzret = lzma_code(&lzstream, LZMA_RUN)) == LZMA_SEEK_NEEDED && lzstream.seek_pos <= size){
+        lzstream.next_in = data + lzstream.seek_pos;
+        lzstream.avail_in = size - lzstream.seek_pos;
+    }
+
+    lzma_end(&lzstream);
+    if (lzret != LZMA_STREAM_END && index){
+        lzma_index_end(index, NULL);
+        index = NULL;
+    }
+    return index;
+}
+
+/* Blocks must lie within the input and tile the output without gaps, a stale sidecar fails this */
+static gboolean _gdk_pixbuf__block_plan_fits(const XZBlockPlan *plan, size_t input_size){
+    uint64_t expected_offset = 0;
+
+    for (size_t i = 0; i < plan->block_count; i++){
+        const XZBlockEntry *block = &plan->blocks[i];
+        if (block->compressed_offset >= input_size || block->total_size > input_size - block->compressed_offset ||
+                block->uncompressed_offset != expected_offset || block->uncompressed_size > UINT64_MAX - expected_offset)
+            return FALSE;
+        expected_offset += block->uncompressed_size;
+    }
+    return expected_offset == plan->uncompressed_size && expected_offset > 0 && expected_offset <= SIZE_MAX;
+}
+
+typedef struct {
+    const uint8_t *input;
+    const XZBlockPlan *plan;
+    uint8_t *output;
+    atomic_size_t next_block;
+    atomic_int failed;
+} XZParallelDecode;
+
+/*
+ * Nothing in a block refers back past its start, so the decoder needs no more dictionary than the block's size
+ * This keeps small blocks, such as those of many concatenated streams, from each allocating a full dictionary
+ */
+static void _gdk_pixbuf__fit_dictionary(lzma_filter *filters, uint64_t uncompressed_size){
+    for (int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++){
+        if (filters[i].id == LZMA_FILTER_LZMA2 || filters[i].id == LZMA_FILTER_LZMA1){
+            lzma_options_lzma *options = (lzma_options_lzma *) filters[i].options;
+            options->dict_size = (uint32_t) MIN(options->dict_size, MAX(uncompressed_size, LZMA_DICT_SIZE_MIN));
+        }
+    }
+}
+
+static gboolean _gdk_pixbuf__decode_block(const XZParallelDecode *job, const XZBlockEntry *entry){
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = { 0 };
+    const uint8_t *data = job->input + entry->compressed_offset;
+    size_t in_pos;
+    size_t out_pos = 0;
+
+    block.version = 1;
+    block.check = (lzma_check) entry->check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode(data[0]);
+    if (data[0] == 0x00 || block.header_size > entry->total_size || lzma_block_header_decode(&block, NULL, data) != LZMA_OK)
+        return FALSE;
+
+    in_pos = block.header_size;
+    _gdk_pixbuf__fit_dictionary(filters, entry->uncompressed_size);
+    lzma_ret lzret = lzma_block_buffer_decode(&block, NULL, data, &in_pos, entry->total_size,
+        job->output + entry->uncompressed_offset, &out_pos, entry->uncompressed_size);
+    for (int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+        free(filters[i].options);
+    return lzret == LZMA_OK && in_pos == entry->total_size && out_pos == entry->uncompressed_size;
+}
+
+static gpointer _gdk_pixbuf__parallel_decode_worker(gpointer data){
+    XZParallelDecode *job = (XZParallelDecode *) data;
+
+    while (!atomic_load_explicit(&job->failed, memory_order_relaxed)){
+        size_t i = atomic_fetch_add_explicit(&job->next_block, 1, memory_order_relaxed);
+        if (i >= job->plan->block_count)
+            break;
+        if (!_gdk_pixbuf__decode_block(job, &job->plan->blocks[i]))
+            atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/*
+ * Decompress every block straight into its place in one output buffer, on up to the configured number of threads
+ * Returns NULL if the plan doesn't match the input, so the caller can decode another way instead
+ */
+static GBytes *_gdk_pixbuf__decode_blocks_parallel(GBytes *input, const XZBlockPlan *plan, XZLoadStats *stats){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    size_t input_size;
+    XZParallelDecode job = { .input = g_bytes_get_data(input, &input_size), .plan = plan };
+
+    if (!_gdk_pixbuf__block_plan_fits(plan, input_size))
+        return NULL;
+    job.output = (uint8_t *) malloc(plan->uncompressed_size);
+    if (!job.output)
+        return NULL;
+    atomic_init(&job.next_block, 0);
+    atomic_init(&job.failed, 0);
+
+    size_t n_threads = MIN(config->decode_threads, plan->block_count);
+    GThread **threads = g_new0(GThread *, n_threads);
+    int64_t start_time = g_get_monotonic_time();
+    XZ_PIXBUF_PROBE2(parallel_decode_start, plan->block_count, n_threads);
+    /* This thread is one of the workers */
+    for (size_t i = 1; i < n_threads; i++)
+        threads[i] = g_thread_try_new("xz-pixbuf-decode", _gdk_pixbuf__parallel_decode_worker, &job, NULL);
+    _gdk_pixbuf__parallel_decode_worker(&job);
+    for (size_t i = 1; i < n_threads; i++){
+        if (threads[i])
+            g_thread_join(threads[i]);
+    }
+    g_free(threads);
+    stats->lzma_code_usec = g_get_monotonic_time() - start_time;
+    XZ_PIXBUF_MARK(start_time, "lzma_code", "parallel block decode");
+
+    if (atomic_load(&job.failed)){
+        free(job.output);
+        return NULL;
+    }
+    stats->blocks = plan->block_count;
+    stats->check = (lzma_check) plan->blocks[0].check;
+    return g_bytes_new_with_free_func(job.output, plan->uncompressed_size, free, job.output);
+}
+
+/*
+ * Segment decoding: blocks whose only filter is LZMA2 are split into segments at dictionary resets
+ * Segments of nothing but uncompressed chunks are handed on as slices of the mapped input,
+ * the others are decoded on their own by liblzma, in parallel, as nothing after a reset refers back past it
+ * Each block's check is verified over its pieces, and anything unexpected falls back to the normal decode
+ */
+typedef struct {
+    uint64_t in_offset;
+    uint64_t in_size;
+    uint64_t out_size;
+    gboolean stored;
+    size_t block;
+} XZLzma2Segment;
+
+/* The size of the LZMA2 chunk at data, what it decodes to, and whether it resets the dictionary */
+static gboolean _gdk_pixbuf__lzma2_chunk(const uint8_t *data, size_t size, size_t *in_size, size_t *out_size, gboolean *reset){
+    uint8_t control = data[0];
+
+    *reset = control == 0x01 || control >= 0xE0;
+    if (control == 0x01 || control == 0x02){
+        if (size < 3)
+            return FALSE;
+        *out_size = _gdk_pixbuf__read_be16(data + 1) + 1;
+        *in_size = 3 + *out_size;
+    } else if (control >= 0x80){
+        if (size < 5)
+            return FALSE;
+        *out_size = ((size_t) (control & 0x1F) << 16) + _gdk_pixbuf__read_be16(data + 1) + 1;
+        *in_size = 5 + (control >= 0xC0) + _gdk_pixbuf__read_be16(data + 3) + 1;
+    } else {
+        return FALSE;
+    }
+    return *in_size <= size;
+}
+
+/*
+ * Split the LZMA2 data of a block into segments that each start with a dictionary reset
+ * Returns NULL if the data is malformed, otherwise *data_size is how far its end marker reaches
+ */
+static GArray *_gdk_pixbuf__scan_lzma2_segments(const uint8_t *data, size_t size, uint64_t offset, size_t *data_size){
+    GArray *segments = g_array_new(FALSE, TRUE, sizeof(XZLzma2Segment));
+    size_t pos = 0;
+
+    while (pos < size && data[pos] != 0x00){
+        size_t in_size, out_size;
+        gboolean reset;
+        if (!_gdk_pixbuf__lzma2_chunk(data + pos, size - pos, &in_size, &out_size, &reset) || (!reset && segments->len == 0)){
+            g_array_free(segments, TRUE);
+            return NULL;
+        }
+        if (reset){
+            XZLzma2Segment segment = { .in_offset = offset + pos, .stored = TRUE };
+            g_array_append_val(segments, segment);
+        }
+        XZLzma2Segment *segment = &g_array_index(segments, XZLzma2Segment, segments->len - 1);
+        segment->in_size += in_size;
+        segment->out_size += out_size;
+        segment->stored = segment->stored && data[pos] < 0x80;
+        pos += in_size;
+    }
+    if (pos == size){
+        g_array_free(segments, TRUE);
+        return NULL;
+    }
+    *data_size = pos + 1;
+    return segments;
+}
+
+/* Decode a segment that starts with a dictionary reset, with the block's LZMA2 options */
+static GBytes *_gdk_pixbuf__decode_lzma2_segment(const uint8_t *input, const XZLzma2Segment *segment, const lzma_filter *filters){
+    lzma_stream lzstream = LZMA_STREAM_INIT;
+    lzma_ret lzret;
+
+    uint8_t *output = (uint8_t *) malloc(MAX(segment->out_size, 1));
+    if (!output || lzma_raw_decoder(&lzstream, filters) != LZMA_OK){
+        free(output);
+        return NULL;
+    }
+    lzstream.next_in = input + segment->in_offset;
+    lzstream.avail_in = segment->in_size;
+    lzstream.next_out = output;
+    lzstream.avail_out = segment->out_size;
+    /* There is no end marker, the decoder just runs out of input, though it may still read some once the output is full */
+    do {
+        size_t avail_in = lzstream.avail_in;
+        lzret = lzma_code(&lzstream, LZMA_RUN);
+        if (lzret == LZMA_OK && lzstream.avail_in == avail_in && lzstream.avail_out == 0)
+            break;
+    } while (lzret == LZMA_OK && lzstream.avail_in > 0);
+    gboolean complete = lzret == LZMA_OK && lzstream.avail_in == 0 && lzstream.avail_out == 0;
+    lzma_end(&lzstream);
+    if (!complete){
+        free(output);
+        return NULL;
+    }
+    return g_bytes_new_with_free_func(output, segment->out_size, free, output);
+}
+
+/* A block's share of a segment decode */
+typedef struct {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_check check;
+    const uint8_t *check_value;
+    guint first_segment;
+    guint segment_count;
+} XZSegmentedBlock;
+
+/*
+ * The segments of every block, decoded on up to the configured number of threads
+ * Stored segments need no decoding and are left for the assembly
+ */
+typedef struct {
+    GBytes *input;
+    XZSegmentedBlock *blocks;
+    GArray *segments;
+    GBytes **outputs;
+    atomic_size_t next_segment;
+    atomic_int failed;
+} XZSegmentDecode;
+
+/* Split one block into segments, returning FALSE if it can't be decoded this way */
+static gboolean _gdk_pixbuf__segment_block(XZSegmentDecode *job, size_t index, const XZBlockEntry *entry){
+    XZSegmentedBlock *segmented = &job->blocks[index];
+    lzma_block block = { 0 };
+    const uint8_t *input_data = g_bytes_get_data(job->input, NULL);
+    const uint8_t *data = input_data + entry->compressed_offset;
+    uint32_t check_size = lzma_check_size((lzma_check) entry->check);
+    uint64_t out_size = 0;
+    size_t data_size;
+
+    segmented->filters[0].id = LZMA_VLI_UNKNOWN;
+    block.version = 1;
+    block.check = (lzma_check) entry->check;
+    block.filters = segmented->filters;
+    block.header_size = lzma_block_header_size_decode(data[0]);
+    if (data[0] == 0x00 || block.header_size > entry->total_size || lzma_block_header_decode(&block, NULL, data) != LZMA_OK)
+        return FALSE;
+    if (segmented->filters[0].id != LZMA_FILTER_LZMA2 || segmented->filters[1].id != LZMA_VLI_UNKNOWN ||
+            (block.check != LZMA_CHECK_NONE && block.check != LZMA_CHECK_CRC32 && block.check != LZMA_CHECK_CRC64))
+        return FALSE;
+    _gdk_pixbuf__fit_dictionary(segmented->filters, entry->uncompressed_size);
+
+    GArray *segments = _gdk_pixbuf__scan_lzma2_segments(data + block.header_size, entry->total_size - block.header_size,
+        entry->compressed_offset + block.header_size, &data_size);
+    if (!segments)
+        return FALSE;
+    segmented->check = block.check;
+    segmented->check_value = data + entry->total_size - check_size;
+    segmented->first_segment = job->segments->len;
+    segmented->segment_count = segments->len;
+    for (guint i = 0; i < segments->len; i++){
+        XZLzma2Segment *segment = &g_array_index(segments, XZLzma2Segment, i);
+        segment->block = index;
+        out_size += segment->out_size;
+    }
+    g_array_append_vals(job->segments, segments->data, segments->len);
+    g_array_free(segments, TRUE);
+    return block.header_size + ((data_size + 3) & ~(size_t) 3) + check_size == entry->total_size &&
+        out_size == entry->uncompressed_size;
+}
+
+static gpointer _gdk_pixbuf__segment_decode_worker(gpointer data){
+    XZSegmentDecode *job = (XZSegmentDecode *) data;
+    const uint8_t *input_data = g_bytes_get_data(job->input, NULL);
+
+    while (!atomic_load_explicit(&job->failed, memory_order_relaxed)){
+        size_t i = atomic_fetch_add_explicit(&job->next_segment, 1, memory_order_relaxed);
+        if (i >= job->segments->len)
+            break;
+        const XZLzma2Segment *segment = &g_array_index(job->segments, XZLzma2Segment, i);
+        if (segment->stored)
+            continue;
+        job->outputs[i] = _gdk_pixbuf__decode_lzma2_segment(input_data, segment, job->blocks[segment->block].filters);
+        if (!job->outputs[i])
+            atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/* Check the pieces of one block against the block's own check */
+static gboolean _gdk_pixbuf__verify_pieces(const XZSegmentedBlock *segmented, GPtrArray *pieces, guint first_piece){
+    uint64_t crc = 0;
+
+    if (segmented->check == LZMA_CHECK_NONE)
+        return TRUE;
+    for (guint i = first_piece; i < pieces->len; i++){
+        size_t piece_size;
+        const uint8_t *piece_data = g_bytes_get_data((GBytes *) g_ptr_array_index(pieces, i), &piece_size);
+        crc = segmented->check == LZMA_CHECK_CRC32 ? lzma_crc32(piece_data, piece_size, (uint32_t) crc) : lzma_crc64(piece_data, piece_size, crc);
+    }
+    if (segmented->check == LZMA_CHECK_CRC32)
+        return _gdk_pixbuf__read_le32(segmented->check_value) == (uint32_t) crc;
+    return _gdk_pixbuf__read_le64(segmented->check_value) == crc;
+}
+
+/*
+ * Decode every block of plan into pieces, decoding the segments that need it on up to the configured number of threads
+ * Returns NULL if any block can't be decoded this way or doesn't verify
+ */
+static GPtrArray *_gdk_pixbuf__decode_segments(GBytes *input, const XZBlockPlan *plan, XZLoadStats *stats){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    XZSegmentDecode job = { .input = input };
+    GPtrArray *pieces = NULL;
+    size_t input_size;
+    size_t n_blocks = 0;
+    size_t n_decoded = 0;
+    uint64_t stored_bytes = 0;
+    gboolean segmented = TRUE;
+
+    g_bytes_get_data(input, &input_size);
+    if (!_gdk_pixbuf__block_plan_fits(plan, input_size))
+        return NULL;
+    job.blocks = g_new0(XZSegmentedBlock, plan->block_count);
+    job.segments = g_array_new(FALSE, TRUE, sizeof(XZLzma2Segment));
+    for (n_blocks = 0; n_blocks < plan->block_count && segmented; n_blocks++)
+        segmented = _gdk_pixbuf__segment_block(&job, n_blocks, &plan->blocks[n_blocks]);
+    if (!segmented)
+        goto done;
+
+    job.outputs = g_new0(GBytes *, job.segments->len);
+    atomic_init(&job.next_segment, 0);
+    atomic_init(&job.failed, 0);
+    for (guint i = 0; i < job.segments->len; i++)
+        n_decoded += !g_array_index(job.segments, XZLzma2Segment, i).stored;
+    /* Without resets to split at this would only be a slower serial decode */
+    if (n_decoded < 2 && !config->chunk_passthrough)
+        goto done;
+
+    size_t n_threads = MAX(MIN(config->decode_threads, n_decoded), 1);
+    GThread **threads = g_new0(GThread *, n_threads);
+    int64_t start_time = g_get_monotonic_time();
+    XZ_PIXBUF_PROBE2(segment_decode_start, n_decoded, n_threads);
+    /* This thread is one of the workers */
+    for (size_t i = 1; i < n_threads; i++)
+        threads[i] = g_thread_try_new("xz-pixbuf-decode", _gdk_pixbuf__segment_decode_worker, &job, NULL);
+    _gdk_pixbuf__segment_decode_worker(&job);
+    for (size_t i = 1; i < n_threads; i++){
+        if (threads[i])
+            g_thread_join(threads[i]);
+    }
+    g_free(threads);
+    if (atomic_load(&job.failed))
+        goto done;
+
+    /* Stored segments become slices of the input, chunk by chunk, and everything is checked block by block */
+    const uint8_t *input_data = g_bytes_get_data(input, NULL);
+    pieces = g_ptr_array_new_with_free_func((GDestroyNotify) g_bytes_unref);
+    for (size_t b = 0; b < plan->block_count && pieces; b++){
+        const XZSegmentedBlock *block = &job.blocks[b];
+        guint first_piece = pieces->len;
+        for (guint i = block->first_segment; i < block->first_segment + block->segment_count; i++){
+            const XZLzma2Segment *segment = &g_array_index(job.segments, XZLzma2Segment, i);
+            if (!segment->stored){
+                g_ptr_array_add(pieces, job.outputs[i]);
+                job.outputs[i] = NULL;
+                continue;
+            }
+            /* Uncompressed chunks are their own payload, three bytes after their control byte */
+            for (uint64_t pos = segment->in_offset; pos < segment->in_offset + segment->in_size; ){
+                size_t chunk_size = _gdk_pixbuf__read_be16(input_data + pos + 1) + 1;
+                g_ptr_array_add(pieces, g_bytes_new_from_bytes(input, pos + 3, chunk_size));
+                pos += 3 + chunk_size;
+            }
+            stored_bytes += segment->out_size;
+        }
+        if (!_gdk_pixbuf__verify_pieces(block, pieces, first_piece)){
+            g_ptr_array_free(pieces, TRUE);
+            pieces = NULL;
+        }
+    }
+    stats->lzma_code_usec = g_get_monotonic_time() - start_time;
+    XZ_PIXBUF_MARK(start_time, "lzma_code", "segment decode");
+    if (pieces){
+        stats->blocks = plan->block_count;
+        stats->check = (lzma_check) plan->blocks[0].check;
+        stats->passthrough_bytes = stored_bytes;
+        stats->segment_threads = n_threads;
+    }
+
+done:
+    for (size_t b = 0; b < n_blocks; b++){
+        for (int i = 0; job.blocks[b].filters[i].id != LZMA_VLI_UNKNOWN; i++)
+            free(job.blocks[b].filters[i].options);
+    }
+    for (guint i = 0; job.outputs && i < job.segments->len; i++){
+        if (job.outputs[i])
+            g_bytes_unref(job.outputs[i]);
+    }
+    g_free(job.outputs);
+    g_array_free(job.segments, TRUE);
+    g_free(job.blocks);
+    return pieces;
+}
+
+/*
+ * Decode a whole input that is in memory, in parallel over its blocks or over the segments of a single block
+ * when threads are configured, and passing LZMA2 uncompressed chunks straight through when that is enabled
+ * payload, when given, collects the decompressed inner file
+ */
+static GdkPixbuf *_gdk_pixbuf__decode_whole_input(const XZWholeInput *whole, GPtrArray *payload, GError **error){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    size_t input_size;
+    const uint8_t *input_data = g_bytes_get_data(whole->input, &input_size);
+
+    if (config->decode_threads > 1 || config->chunk_passthrough){
+        XZLoadStats stats = { .path = "parallel", .start_usec = g_get_monotonic_time(), .compressed_bytes = input_size };
+        XZBlockPlan *plan = whole->plan;
+        GPtrArray *pieces = NULL;
+        XZStat hit_stat = XZ_STAT_PARALLEL_DECODES;
+        if (!plan){
+            lzma_index *index = _gdk_pixbuf__decode_memory_index(input_data, input_size);
+            if (index){
+                plan = _gdk_pixbuf__block_plan_from_index(index);
+                if (plan)
+                    _gdk_pixbuf__trim_pyramid_plan(plan, index, input_data, input_size);
+                lzma_index_end(index, NULL);
+            }
+        }
+
+        /* A sidecar knows the dimensions before anything is decompressed */
+        if (plan && plan->header.format && !_gdk_pixbuf__inner_header_allowed(&plan->header)){
+            if (plan != whole->plan)
+                _gdk_pixbuf__free_block_plan(plan);
+            g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Image dimensions exceed the configured limits");
+            _gdk_pixbuf__fail_load_stats(&stats, XZ_PIXBUF_FAILURE_LIMIT);
+            _gdk_pixbuf__commit_load_stats(&stats);
+            return NULL;
+        }
+        /* A single block can only be split at its dictionary resets */
+        if (plan && (config->chunk_passthrough || plan->block_count == 1)){
+            pieces = _gdk_pixbuf__decode_segments(whole->input, plan, &stats);
+            stats.path = "segments";
+            hit_stat = stats.segment_threads > 1 ? XZ_STAT_SEGMENT_DECODES : XZ_STAT_COUNT;
+        }
+        if (plan && !pieces && config->decode_threads > 1 && plan->block_count > 1){
+            GBytes *decoded = _gdk_pixbuf__decode_blocks_parallel(whole->input, plan, &stats);
+            stats.path = "parallel";
+            hit_stat = XZ_STAT_PARALLEL_DECODES;
+            if (decoded){
+                pieces = g_ptr_array_new_with_free_func((GDestroyNotify) g_bytes_unref);
+                g_ptr_array_add(pieces, decoded);
+            }
+        }
+        if (plan != whole->plan)
+            _gdk_pixbuf__free_block_plan(plan);
+
+        if (pieces){
+            GError *decode_error = NULL;
+            GdkPixbuf *pixbuf = _gdk_pixbuf__decode_pieces(pieces, &stats, hit_stat, &decode_error);
+            for (guint i = 0; pixbuf && payload && i < pieces->len; i++)
+                g_ptr_array_add(payload, g_bytes_ref((GBytes *) g_ptr_array_index(pieces, i)));
+            g_ptr_array_free(pieces, TRUE);
+            if (decode_error)
+                g_propagate_error(error, decode_error);
+            if (pixbuf || decode_error)
+                return pixbuf;
+        }
+    }
+
+    return _gdk_pixbuf__decode_xz_input(NULL, input_data, input_size, payload, NULL, error);
+}
+
+/*
+ * .xzidx sidecars, written next to the .xz file by xz_pixbuf_loader_write_index
+ * All fields are little endian:
+ *   magic "XZPIDX01", file size (8), file mtime seconds (8) and nanoseconds (4), block count (4),
+ *   CRC64 of the whole file (8), uncompressed size (8), inner format name (16, NUL padded),
+ *   inner width (4), height (4), channels (4), reserved (4),
+ *   then per block: compressed offset, uncompressed offset, total size, uncompressed size (8 each), check (4),
+ *   and finally the CRC32 of everything before it (4)
+ * The size and mtime tell cheaply whether the sidecar may still describe the file,
+ * and the CRC64 is checked against the file itself before the sidecar is used
+ */
+#define XZ_SIDECAR_SUFFIX ".xzidx"
+#define XZ_SIDECAR_MAGIC "XZPIDX01"
+#define XZ_SIDECAR_HEADER_SIZE 80
+#define XZ_SIDECAR_BLOCK_SIZE 36
+
+static XZBlockPlan *_gdk_pixbuf__parse_sidecar(const uint8_t *data, size_t size, const struct stat *st, GBytes *input){
+    if (size < XZ_SIDECAR_HEADER_SIZE + 4 || memcmp(data, XZ_SIDECAR_MAGIC, 8) ||
+            _gdk_pixbuf__read_le32(data + size - 4) != lzma_crc32(data, size - 4, 0))
+        return NULL;
+
+    size_t block_count = _gdk_pixbuf__read_le32(data + 28);
+    if ((size - XZ_SIDECAR_HEADER_SIZE - 4) / XZ_SIDECAR_BLOCK_SIZE != block_count ||
+            (size - XZ_SIDECAR_HEADER_SIZE - 4) % XZ_SIDECAR_BLOCK_SIZE != 0)
+        return NULL;
+    if (_gdk_pixbuf__read_le64(data + 8) != (uint64_t) st->st_size ||
+            (int64_t) _gdk_pixbuf__read_le64(data + 16) != (int64_t) st->st_mtim.tv_sec ||
+            _gdk_pixbuf__read_le32(data + 24) != (uint32_t) st->st_mtim.tv_nsec)
+        return NULL;
+    size_t input_size;
+    const uint8_t *input_data = g_bytes_get_data(input, &input_size);
+    if (_gdk_pixbuf__read_le64(data + 32) != lzma_crc64(input_data, input_size, 0))
+        return NULL;
+
+    XZBlockPlan *plan = _gdk_pixbuf__new_block_plan(block_count);
+    if (!plan)
+        return NULL;
+    plan->uncompressed_size = _gdk_pixbuf__read_le64(data + 40);
+    for (size_t i = 0; i < XZ_HISTOGRAM_FORMATS - 1; i++){
+        if (!strncmp((const char *) data + 48, xz_histogram_formats[i], 16))
+            plan->header.format = xz_histogram_formats[i];
+    }
+    plan->header.width = _gdk_pixbuf__read_le32(data + 64);
+    plan->header.height = _gdk_pixbuf__read_le32(data + 68);
+    plan->header.channels = _gdk_pixbuf__read_le32(data + 72);
+
+    const uint8_t *entry = data + XZ_SIDECAR_HEADER_SIZE;
+    for (size_t i = 0; i < block_count; i++, entry += XZ_SIDECAR_BLOCK_SIZE){
+        plan->blocks[i].compressed_offset = _gdk_pixbuf__read_le64(entry);
+        plan->blocks[i].uncompressed_offset = _gdk_pixbuf__read_le64(entry + 8);
+        plan->blocks[i].total_size = _gdk_pixbuf__read_le64(entry + 16);
+        plan->blocks[i].uncompressed_size = _gdk_pixbuf__read_le64(entry + 24);
+        plan->blocks[i].check = _gdk_pixbuf__read_le32(entry + 32);
+    }
+    return plan;
+}
+
+/* The plan from the sidecar of the file being loaded, if it has one that matches input, the file's contents */
+static XZBlockPlan *_gdk_pixbuf__read_sidecar(FILE *file, GBytes *input){
+    struct stat st;
+    int fd = fileno(file);
+    char *contents = NULL;
+    gsize contents_size;
+    XZBlockPlan *plan = NULL;
+
+    /* The loader only gets a FILE, so the file name has to come from /proc */
+    if (ftell(file) != 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return NULL;
+    char *fd_path = g_strdup_printf("/proc/self/fd/%d", fd);
+    char *filename = g_file_read_link(fd_path, NULL);
+    g_free(fd_path);
+    if (!filename)
+        return NULL;
+
+    char *sidecar = g_strconcat(filename, XZ_SIDECAR_SUFFIX, NULL);
+    if (g_file_get_contents(sidecar, &contents, &contents_size, NULL))
+        plan = _gdk_pixbuf__parse_sidecar((const uint8_t *) contents, contents_size, &st, input);
+    g_free(contents);
+    g_free(sidecar);
+    g_free(filename);
+    return plan;
+}
+
+/*
+ * Ask the broker to decompress input, and map the sealed memfd it answers with
+ * Returns NULL whenever the broker can't be used, so the caller decodes in process
+ */
+static GBytes *_gdk_pixbuf__broker_decode(GBytes *input){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t input_size;
+    const uint8_t *input_data = g_bytes_get_data(input, &input_size);
+    GBytes *payload = NULL;
+    int input_fd = -1;
+    int payload_fd = -1;
+
+    if (strlen(config->broker_socket) >= sizeof(addr.sun_path))
+        return NULL;
+    strcpy(addr.sun_path, config->broker_socket);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return NULL;
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+        goto done;
+
+    /* The input goes over as a sealed memfd too, so the broker needs no access to our files */
+    input_fd = memfd_create("xz-pixbuf-input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (input_fd < 0)
+        goto done;
+    for (size_t written = 0; written < input_size;){
+        ssize_t ret = write(input_fd, input_data + written, input_size - written);
+        if (ret < 0)
+            goto done;
+        written += ret;
+    }
+    if (fcntl(input_fd, F_ADD_SEALS, XZ_BROKER_REQUIRED_SEALS | F_SEAL_SEAL) != 0)
+        goto done;
+
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    XZBrokerRequest request = { XZ_BROKER_VERSION, 0 };
+    struct iovec iov = { &request, sizeof(request) };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &input_fd, sizeof(int));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(request))
+        goto done;
+
+    XZBrokerReply reply;
+    iov = (struct iovec) { &reply, sizeof(reply) };
+    msg = (struct msghdr) { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        memcpy(&payload_fd, CMSG_DATA(cmsg), sizeof(int));
+    if (received != sizeof(reply) || reply.status != XZ_BROKER_OK || payload_fd < 0)
+        goto done;
+
+    /* Only map what the broker can no longer change or truncate under us */
+    struct stat st;
+    int seals = fcntl(payload_fd, F_GET_SEALS);
+    if (seals < 0 || (seals & XZ_BROKER_REQUIRED_SEALS) != XZ_BROKER_REQUIRED_SEALS ||
+            fstat(payload_fd, &st) != 0 || (uint64_t) st.st_size != reply.size || st.st_size == 0)
+        goto done;
+    GMappedFile *mapped = g_mapped_file_new_from_fd(payload_fd, FALSE, NULL);
+    if (mapped){
+        payload = g_mapped_file_get_bytes(mapped);
+        g_mapped_file_unref(mapped);
+    }
+
+done:
+    if (payload_fd >= 0)
+        close(payload_fd);
+    if (input_fd >= 0)
+        close(input_fd);
+    close(sock);
+    return payload;
+}
+
+/*
+ * The decompressed inner file, from the disk cache, else from the broker, else decoded here
+ * name is only needed with the disk cache
+ */
+static GdkPixbuf *_gdk_pixbuf__payload_cached_decode(const XZWholeInput *whole, const char *name, GError **error){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    size_t input_size;
+    g_bytes_get_data(whole->input, &input_size);
+    GdkPixbuf *pixbuf = NULL;
+    GError *cache_error = NULL;
+
+    if (config->disk_cache_bytes){
+        char *path = g_build_filename(config->disk_cache_dir, name, NULL);
+        GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+        if (mapped){
+            GBytes *payload = g_mapped_file_get_bytes(mapped);
+            g_mapped_file_unref(mapped);
+            utimensat(AT_FDCWD, path, NULL, 0);
+            XZLoadStats stats = { .path = "disk-cache", .start_usec = g_get_monotonic_time(), .compressed_bytes = input_size };
+            pixbuf = _gdk_pixbuf__decode_payload(payload, &stats, XZ_STAT_DISK_CACHE_HITS, &cache_error);
+            g_bytes_unref(payload);
+            /* Only good payloads are ever stored, so a failure means the entry was damaged */
+            if (!pixbuf && !cache_error)
+                unlink(path);
+        }
+        g_free(path);
+    }
+
+    if (!pixbuf && !cache_error && config->broker_socket){
+        GBytes *payload = _gdk_pixbuf__broker_decode(whole->input);
+        if (payload){
+            XZLoadStats stats = { .path = "broker", .start_usec = g_get_monotonic_time(), .compressed_bytes = input_size };
+            pixbuf = _gdk_pixbuf__decode_payload(payload, &stats, XZ_STAT_BROKER_HITS, &cache_error);
+            if (pixbuf && config->disk_cache_bytes){
+                GPtrArray *chunks = g_ptr_array_new_with_free_func((GDestroyNotify) g_bytes_unref);
+                g_ptr_array_add(chunks, g_bytes_ref(payload));
+                _gdk_pixbuf__disk_cache_store(config->disk_cache_dir, name, chunks, config->disk_cache_bytes);
+                g_ptr_array_unref(chunks);
+            }
+            g_bytes_unref(payload);
+        }
+    }
+
+    if (cache_error){
+        g_propagate_error(error, cache_error);
+        return NULL;
+    }
+
+    if (!pixbuf && config->disk_cache_bytes){
+        GPtrArray *payload = g_ptr_array_new_with_free_func((GDestroyNotify) g_bytes_unref);
+        pixbuf = _gdk_pixbuf__decode_whole_input(whole, payload, error);
+        if (pixbuf)
+            _gdk_pixbuf__disk_cache_store(config->disk_cache_dir, name, payload, config->disk_cache_bytes);
+        g_ptr_array_unref(payload);
+    } else if (!pixbuf){
+        pixbuf = _gdk_pixbuf__decode_whole_input(whole, NULL, error);
+    }
+    return pixbuf;
+}
+
+/*
+ * Raw pixel cache entries hold the finished pixbuf, so a hit maps the file and decodes nothing
+ * The pixels start at a page boundary, after this header and the pixbuf options as key/value strings
+ */
+#define XZ_PIXEL_CACHE_MAGIC "XZPIXEL1"
+#define XZ_PIXEL_CACHE_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t width;
+    uint32_t height;
+    uint32_t rowstride;
+    uint32_t has_alpha;
+    uint32_t options_size;
+    uint64_t pixels_offset;
+    uint64_t pixels_size;
+} XZPixelCacheHeader;
+
+static char *_gdk_pixbuf__pixel_cache_dir(void){
+    return g_build_filename(_gdk_pixbuf__xz_config()->disk_cache_dir, "pixels", NULL);
+}
+
+static GdkPixbuf *_gdk_pixbuf__pixel_cache_lookup(const char *name){
+    char *cache_dir = _gdk_pixbuf__pixel_cache_dir();
+    char *path = g_build_filename(cache_dir, name, NULL);
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+    GdkPixbuf *pixbuf = NULL;
+    XZPixelCacheHeader header;
+
+    g_free(cache_dir);
+    if (!mapped){
+        g_free(path);
+        return NULL;
+    }
+
+    GBytes *entry = g_mapped_file_get_bytes(mapped);
+    g_mapped_file_unref(mapped);
+    size_t entry_size;
+    const uint8_t *entry_data = g_bytes_get_data(entry, &entry_size);
+    if (entry_size < sizeof(header))
+        goto damaged;
+    memcpy(&header, entry_data, sizeof(header));
+
+    uint64_t channels = header.has_alpha ? 4 : 3;
+    if (memcmp(header.magic, XZ_PIXEL_CACHE_MAGIC, sizeof(header.magic)) || header.byte_order != XZ_PIXEL_CACHE_BYTE_ORDER ||
+            header.width == 0 || header.height == 0 || header.rowstride < header.width * channels ||
+            header.options_size > entry_size - sizeof(header) || header.pixels_offset < sizeof(header) + header.options_size ||
+            header.pixels_offset > entry_size || header.pixels_size > entry_size - header.pixels_offset ||
+            header.pixels_size < (uint64_t) header.rowstride * (header.height - 1) + header.width * channels)
+        goto damaged;
+
+    GBytes *pixels = g_bytes_new_from_bytes(entry, header.pixels_offset, header.pixels_size);
+    pixbuf = gdk_pixbuf_new_from_bytes(pixels, GDK_COLORSPACE_RGB, header.has_alpha, 8,
+        header.width, header.height, header.rowstride);
+    g_bytes_unref(pixels);
+
+    /* Options are stored as a run of NUL-terminated key and value strings */
+    const char *option = (const char *) entry_data + sizeof(header);
+    const char *options_end = option + header.options_size;
+    while (pixbuf && option < options_end){
+        const char *key = option;
+        const char *key_end = memchr(key, '\0', options_end - key);
+        if (!key_end)
+            break;
+        const char *value = key_end + 1;
+        const char *value_end = value < options_end ? memchr(value, '\0', options_end - value) : NULL;
+        if (!value_end)
+            break;
+        gdk_pixbuf_set_option(pixbuf, key, value);
+        option = value_end + 1;
+    }
+
+    if (pixbuf){
+        utimensat(AT_FDCWD, path, NULL, 0);
+        _gdk_pixbuf__count_stat(XZ_STAT_PIXEL_CACHE_HITS);
+    }
+    g_bytes_unref(entry);
+    g_free(path);
+    return pixbuf;
+
+damaged:
+    unlink(path);
+    g_bytes_unref(entry);
+    g_free(path);
+    return NULL;
+}
+
+static void _gdk_pixbuf__pixel_cache_store(const char *name, GdkPixbuf *pixbuf){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    XZPixelCacheHeader header = { .magic = XZ_PIXEL_CACHE_MAGIC, .byte_order = XZ_PIXEL_CACHE_BYTE_ORDER };
+
+    if (gdk_pixbuf_get_colorspace(pixbuf) != GDK_COLORSPACE_RGB || gdk_pixbuf_get_bits_per_sample(pixbuf) != 8 ||
+            gdk_pixbuf_get_byte_length(pixbuf) > config->pixel_cache_bytes)
+        return;
+
+    GString *options = g_string_new(NULL);
+    GHashTable *option_table = gdk_pixbuf_get_options(pixbuf);
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, option_table);
+    while (g_hash_table_iter_next(&iter, &key, &value)){
+        g_string_append_len(options, (const char *) key, strlen((const char *) key) + 1);
+        g_string_append_len(options, (const char *) value, strlen((const char *) value) + 1);
+    }
+    g_hash_table_destroy(option_table);
+
+    GBytes *pixels = gdk_pixbuf_read_pixel_bytes(pixbuf);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    header.width = gdk_pixbuf_get_width(pixbuf);
+    header.height = gdk_pixbuf_get_height(pixbuf);
+    header.rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    header.has_alpha = gdk_pixbuf_get_has_alpha(pixbuf);
+    header.options_size = options->len;
+    header.pixels_offset = (sizeof(header) + options->len + page_size - 1) / page_size * page_size;
+    header.pixels_size = g_bytes_get_size(pixels);
+
+    /* Padding the header out to a page keeps the pixels page aligned when the entry is mapped */
+    size_t header_size = header.pixels_offset;
+    uint8_t *header_data = (uint8_t *) calloc(1, header_size);
+    if (header_data){
+        GPtrArray *chunks = g_ptr_array_new_with_free_func((GDestroyNotify) g_bytes_unref);
+        memcpy(header_data, &header, sizeof(header));
+        memcpy(header_data + sizeof(header), options->str, options->len);
+        g_ptr_array_add(chunks, g_bytes_new_with_free_func(header_data, header_size, free, header_data));
+        g_ptr_array_add(chunks, g_bytes_ref(pixels));
+        char *cache_dir = _gdk_pixbuf__pixel_cache_dir();
+        _gdk_pixbuf__disk_cache_store(cache_dir, name, chunks, config->pixel_cache_bytes);
+        g_free(cache_dir);
+        g_ptr_array_unref(chunks);
+    }
+    g_bytes_unref(pixels);
+    g_string_free(options, TRUE);
+}
+
+/* The on-disk tiers: finished pixels first, then the decompressed inner file */
+static GdkPixbuf *_gdk_pixbuf__disk_cached_decode(const XZWholeInput *whole, GError **error){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+
+    if (!config->disk_cache_bytes && !config->pixel_cache_bytes)
+        return _gdk_pixbuf__payload_cached_decode(whole, NULL, error);
+
+    char *name = _gdk_pixbuf__disk_cache_name(whole->input, whole->disk_key);
+    GdkPixbuf *pixbuf = config->pixel_cache_bytes ? _gdk_pixbuf__pixel_cache_lookup(name) : NULL;
+    if (!pixbuf){
+        pixbuf = _gdk_pixbuf__payload_cached_decode(whole, name, error);
+        if (pixbuf && config->pixel_cache_bytes)
+            _gdk_pixbuf__pixel_cache_store(name, pixbuf);
+    }
+    g_free(name);
+    return pixbuf;
+}
+
+/*
+ * In-process cache of decoded pixbufs, keyed on the SHA-256 of the compressed input
+ * Loads of an input that is already being decoded wait for that decode instead of repeating it
+ * The cache keeps a private pixbuf, and every load gets its own copy, so callers are free to change theirs
+ */
+typedef struct {
+    char *digest;
+    GdkPixbuf *pixbuf;
+    GError *error;
+    gboolean done;
+    unsigned int waiters;
+    size_t cost;
+    GList *lru_link;
+} XZCacheEntry;
+
+static GMutex xz_cache_mutex;
+static GCond xz_cache_cond;
+static GHashTable *xz_cache_table;
+static GQueue xz_cache_lru = G_QUEUE_INIT;
+static size_t xz_cache_total;
+
+static void _gdk_pixbuf__cache_entry_free(XZCacheEntry *entry){
+    g_free(entry->digest);
+    if (entry->pixbuf)
+        g_object_unref(entry->pixbuf);
+    if (entry->error)
+        g_error_free(entry->error);
+    free(entry);
+}
+
+/* Drop least recently used pixbufs until the cache fits again, called with the lock held */
+static void _gdk_pixbuf__cache_evict(size_t limit){
+    while (xz_cache_total > limit){
+        XZCacheEntry *entry = (XZCacheEntry *) g_queue_pop_tail(&xz_cache_lru);
+        if (!entry)
+            break;
+        xz_cache_total -= entry->cost;
+        entry->lru_link = NULL;
+        g_hash_table_remove(xz_cache_table, entry->digest);
+        /* Loads still waiting on the entry free it once they are done with it */
+        if (entry->waiters == 0)
+            _gdk_pixbuf__cache_entry_free(entry);
+    }
+}
+
+static GdkPixbuf *_gdk_pixbuf__cached_decode(const XZWholeInput *whole, GError **error){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    size_t input_size;
+    const uint8_t *input_data = g_bytes_get_data(whole->input, &input_size);
+    GdkPixbuf *pixbuf = NULL;
+    GdkPixbuf *cached = NULL;
+    GError *decode_error = NULL;
+
+    char *digest = g_compute_checksum_for_data(G_CHECKSUM_SHA256, input_data, input_size);
+
+    g_mutex_lock(&xz_cache_mutex);
+    if (!xz_cache_table)
+        xz_cache_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+    XZCacheEntry *entry = (XZCacheEntry *) g_hash_table_lookup(xz_cache_table, digest);
+    if (entry){
+        g_free(digest);
+        entry->waiters++;
+        while (!entry->done)
+            g_cond_wait(&xz_cache_cond, &xz_cache_mutex);
+        entry->waiters--;
+
+        if (entry->pixbuf)
+            cached = g_object_ref(entry->pixbuf);
+        else
+            g_propagate_error(error, g_error_copy(entry->error));
+
+        /* Entries that are out of the table, failed, too big or evicted, are freed by the last waiter */
+        if (entry->lru_link){
+            g_queue_unlink(&xz_cache_lru, entry->lru_link);
+            g_queue_push_head_link(&xz_cache_lru, entry->lru_link);
+        } else if (entry->waiters == 0){
+            _gdk_pixbuf__cache_entry_free(entry);
+        }
+        g_mutex_unlock(&xz_cache_mutex);
+
+        /* The cached pixbuf is never changed, so it can be copied outside the lock */
+        if (cached){
+            pixbuf = gdk_pixbuf_copy(cached);
+            if (pixbuf)
+                gdk_pixbuf_copy_options(cached, pixbuf);
+            g_object_unref(cached);
+            if (!pixbuf)
+                g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Error allocating memory");
+        }
+        if (pixbuf)
+            _gdk_pixbuf__count_stat(XZ_STAT_MEMORY_CACHE_HITS);
+        return pixbuf;
+    }
+
+    entry = (XZCacheEntry *) calloc(1, sizeof(XZCacheEntry));
+    if (!entry){
+        g_mutex_unlock(&xz_cache_mutex);
+        g_free(digest);
+        return _gdk_pixbuf__disk_cached_decode(whole, error);
+    }
+    entry->digest = digest;
+    g_hash_table_insert(xz_cache_table, entry->digest, entry);
+    g_mutex_unlock(&xz_cache_mutex);
+
+    pixbuf = _gdk_pixbuf__disk_cached_decode(whole, &decode_error);
+    /* The caller keeps the decoded pixbuf, and the cache and any waiters get a copy of it */
+    if (pixbuf && (cached = gdk_pixbuf_copy(pixbuf)))
+        gdk_pixbuf_copy_options(pixbuf, cached);
+
+    g_mutex_lock(&xz_cache_mutex);
+    entry->done = TRUE;
+    g_hash_table_remove(xz_cache_table, entry->digest);
+    if (cached && gdk_pixbuf_get_byte_length(cached) <= config->cache_bytes){
+        entry->pixbuf = cached;
+        entry->cost = gdk_pixbuf_get_byte_length(cached);
+        g_hash_table_insert(xz_cache_table, entry->digest, entry);
+        g_queue_push_head(&xz_cache_lru, entry);
+        entry->lru_link = g_queue_peek_head_link(&xz_cache_lru);
+        xz_cache_total += entry->cost;
+        _gdk_pixbuf__cache_evict(config->cache_bytes);
+    } else if (cached){
+        /* Too big to ever be cached, but whoever waited on it still gets it */
+        entry->pixbuf = cached;
+    } else if (pixbuf){
+        entry->error = g_error_new_literal(GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Error allocating memory");
+    } else {
+        entry->error = g_error_copy(decode_error);
+    }
+    g_cond_broadcast(&xz_cache_cond);
+    if (!entry->lru_link && entry->waiters == 0)
+        _gdk_pixbuf__cache_entry_free(entry);
+    g_mutex_unlock(&xz_cache_mutex);
+
+    if (decode_error)
+        g_propagate_error(error, decode_error);
+    return pixbuf;
+}
+
+/*
+ * Hints about the inner image, kept in an extended attribute of the .xz file
+ * The value is "1 format width height uncompressed-size mtime size", where the
+ * last two are the file's own and tell whether the hint is still current
+ */
+#define XZ_XATTR_HINT_NAME "user.xzpixbuf.info"
+
+typedef struct {
+    const char *format;
+    uint32_t width;
+    uint32_t height;
+    uint64_t uncompressed_size;
+} XZFileHint;
+
+static gboolean _gdk_pixbuf__read_xattr_hint(int fd, const struct stat *st, XZFileHint *hint){
+    char value[128];
+    char format[16];
+    intmax_t mtime_sec;
+    long mtime_nsec;
+    intmax_t file_size;
+
+    ssize_t value_size = fgetxattr(fd, XZ_XATTR_HINT_NAME, value, sizeof(value) - 1);
+    if (value_size <= 0)
+        return FALSE;
+    value[value_size] = '\0';
+    if (sscanf(value, "1 %15s %" SCNu32 " %" SCNu32 " %" SCNu64 " %jd.%ld %jd", format, &hint->width, &hint->height,
+            &hint->uncompressed_size, &mtime_sec, &mtime_nsec, &file_size) != 7)
+        return FALSE;
+    if (mtime_sec != st->st_mtim.tv_sec || mtime_nsec != st->st_mtim.tv_nsec || file_size != st->st_size)
+        return FALSE;
+
+    /* Only hand out names we know, which also keeps them static */
+    hint->format = "unknown";
+    for (size_t i = 0; i < XZ_HISTOGRAM_FORMATS - 1; i++){
+        if (!strcmp(format, xz_histogram_formats[i]))
+            hint->format = xz_histogram_formats[i];
+    }
+    return TRUE;
+}
+
+/* Setting the attribute fails on read-only files and some filesystems, which is fine */
+static void _gdk_pixbuf__write_xattr_hint(int fd, const struct stat *st, const XZFileHint *hint){
+    char *value = g_strdup_printf("1 %s %" PRIu32 " %" PRIu32 " %" PRIu64 " %jd.%09ld %jd", hint->format,
+        hint->width, hint->height, hint->uncompressed_size, (intmax_t) st->st_mtim.tv_sec,
+        (long) st->st_mtim.tv_nsec, (intmax_t) st->st_size);
+    fsetxattr(fd, XZ_XATTR_HINT_NAME, value, strlen(value), 0);
+    g_free(value);
+}
+
+/* Remember what a full load found out, unless the file already carries a current hint */
+static void _gdk_pixbuf__store_xattr_hint(FILE *file, GdkPixbuf *pixbuf){
+    struct stat st;
+    XZFileHint hint;
+    int fd = fileno(file);
+    const char *format = gdk_pixbuf_get_option(pixbuf, "xz::inner-format");
+    const char *uncompressed_size = gdk_pixbuf_get_option(pixbuf, "xz::uncompressed-size");
+
+    if (!uncompressed_size || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || _gdk_pixbuf__read_xattr_hint(fd, &st, &hint))
+        return;
+    hint.format = format ? format : "unknown";
+    hint.width = gdk_pixbuf_get_width(pixbuf);
+    hint.height = gdk_pixbuf_get_height(pixbuf);
+    hint.uncompressed_size = g_ascii_strtoull(uncompressed_size, NULL, 10);
+    _gdk_pixbuf__write_xattr_hint(fd, &st, &hint);
+}
+
+/* Decompress only as far as the inner header, from an input that is all in memory */
+static gboolean _gdk_pixbuf__sniff_memory_input(const uint8_t *data, size_t size, XZInnerHeader *header){
+    lzma_stream lzstream = LZMA_STREAM_INIT;
+    XZHeaderSniffer sniffer = { XZ_HEADER_NEED_MORE };
+    uint8_t *out_buffer;
+    lzma_ret lzret = LZMA_OK;
+
+    if (_gdk_pixbuf__sniff_first_block(data, size, header))
+        return TRUE;
+    out_buffer = (uint8_t *) malloc(XZ_OUTPUT_BUFFER_SIZE);
+    if (!out_buffer || lzma_stream_decoder(&lzstream, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK){
+        free(out_buffer);
+        return FALSE;
+    }
+    lzstream.next_in = data;
+    lzstream.avail_in = size;
+    while (sniffer.state == XZ_HEADER_NEED_MORE && lzret == LZMA_OK){
+        lzstream.next_out = out_buffer;
+        lzstream.avail_out = XZ_OUTPUT_BUFFER_SIZE;
+        lzret = lzma_code(&lzstream, LZMA_FINISH);
+        _gdk_pixbuf__sniff_header(&sniffer, out_buffer, lzstream.next_out - out_buffer);
+    }
+
+    lzma_end(&lzstream);
+    free(out_buffer);
+    free(sniffer.data);
+    if (sniffer.state == XZ_HEADER_FOUND)
+        *header = sniffer.header;
+    return sniffer.state == XZ_HEADER_FOUND;
+}
+
+/* Decompress only as far as it takes to tell whether an input that is all in memory holds an animation */
+static gboolean _gdk_pixbuf__scan_memory_input(const uint8_t *data, size_t size, XZAnimationScan *scan){
+    lzma_stream lzstream = LZMA_STREAM_INIT;
+    uint8_t *out_buffer;
+    lzma_ret lzret = LZMA_OK;
+
+    out_buffer = (uint8_t *) malloc(XZ_OUTPUT_BUFFER_SIZE);
+    if (!out_buffer || lzma_stream_decoder(&lzstream, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK){
+        free(out_buffer);
+        return FALSE;
+    }
+    lzstream.next_in = data;
+    lzstream.avail_in = size;
+    while (scan->state == XZ_HEADER_NEED_MORE && lzret == LZMA_OK){
+        lzstream.next_out = out_buffer;
+        lzstream.avail_out = XZ_OUTPUT_BUFFER_SIZE;
+        lzret = lzma_code(&lzstream, LZMA_FINISH);
+        _gdk_pixbuf__scan_animation(scan, out_buffer, lzstream.next_out - out_buffer);
+    }
+
+    lzma_end(&lzstream);
+    free(out_buffer);
+    return scan->state == XZ_HEADER_FOUND;
+}
+
+/* Decompress only as far as the inner header, and size the inner file from the index */
+static gboolean _gdk_pixbuf__probe_file_hint(int fd, const struct stat *st, XZFileHint *hint){
+    lzma_stream lzstream = LZMA_STREAM_INIT;
+    XZHeaderSniffer sniffer = { XZ_HEADER_NEED_MORE };
+    uint8_t in_buffer[1 << 16];
+    uint8_t *out_buffer = NULL;
+    uint64_t position = 0;
+    lzma_ret lzret = LZMA_OK;
+
+    ssize_t head_size = pread(fd, in_buffer, sizeof(in_buffer), 0);
+    if (head_size > 0 && _gdk_pixbuf__sniff_first_block(in_buffer, head_size, &sniffer.header))
+        sniffer.state = XZ_HEADER_FOUND;
+    else if (lzma_stream_decoder(&lzstream, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK)
+        out_buffer = (uint8_t *) malloc(XZ_OUTPUT_BUFFER_SIZE);
+
+    while (out_buffer && sniffer.state == XZ_HEADER_NEED_MORE && lzret == LZMA_OK){
+        if (lzstream.avail_in == 0){
+            ssize_t bytes_read = pread(fd, in_buffer, sizeof(in_buffer), position);
+            if (bytes_read < 0)
+                break;
+            position += bytes_read;
+            lzstream.next_in = in_buffer;
+            lzstream.avail_in = bytes_read;
+        }
+        lzstream.next_out = out_buffer;
+        lzstream.avail_out = XZ_OUTPUT_BUFFER_SIZE;
+        lzret = lzma_code(&lzstream, position == (uint64_t) st->st_size ? LZMA_FINISH : LZMA_RUN);
+        _gdk_pixbuf__sniff_header(&sniffer, out_buffer, lzstream.next_out - out_buffer);
+    }
+
+    lzma_end(&lzstream);
+    free(out_buffer);
+    free(sniffer.data);
+    if (sniffer.state != XZ_HEADER_FOUND)
+        return FALSE;
+
+    lzma_index *index = _gdk_pixbuf__decode_file_index(fd, st->st_size);
+    if (!index)
+        return FALSE;
+    hint->format = sniffer.header.format;
+    hint->width = sniffer.header.width;
+    hint->height = sniffer.header.height;
+    hint->uncompressed_size = lzma_index_uncompressed_size(index);
+    lzma_index_end(index, NULL);
+    return TRUE;
+}
+
+/*
+ * Pyramids: files saved with xz-pyramid hold the image and then ever smaller renditions of it, each in a stream of its own
+ * Loads that ask for a smaller size keep the input compressed, and decode only the smallest rendition
+ * that still covers the requested size, which gdk-pixbuf then scales down the rest of the way
+ */
+typedef struct {
+    uint64_t compressed_offset;
+    uint64_t compressed_size;
+    XZInnerHeader header;
+} XZPyramidLevel;
+
+/*
+ * The image and levels of a pyramid, which must all be the same format and shrink as they go, NULL for any other input
+ * The second stream has to be the pyramid marker, and isn't a level itself
+ */
+static GArray *_gdk_pixbuf__pyramid_levels(const uint8_t *data, size_t size){
+    lzma_index_iter iter;
+    GArray *levels = NULL;
+
+    lzma_index *index = _gdk_pixbuf__decode_memory_index(data, size);
+    if (!index)
+        return NULL;
+    if (lzma_index_stream_count(index) > 2){
+        levels = g_array_new(FALSE, TRUE, sizeof(XZPyramidLevel));
+        lzma_index_iter_init(&iter, index);
+        while (levels && !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_STREAM)){
+            XZPyramidLevel level = {
+                .compressed_offset = iter.stream.compressed_offset,
+                .compressed_size = iter.stream.compressed_size,
+            };
+            if (iter.stream.number == 2){
+                if (!_gdk_pixbuf__is_pyramid_marker(data + level.compressed_offset, level.compressed_size)){
+                    g_array_free(levels, TRUE);
+                    levels = NULL;
+                }
+                continue;
+            }
+            const XZPyramidLevel *previous = levels->len ? &g_array_index(levels, XZPyramidLevel, levels->len - 1) : NULL;
+            if (!_gdk_pixbuf__sniff_first_block(data + level.compressed_offset, level.compressed_size, &level.header) ||
+                    (previous && !_gdk_pixbuf__is_pyramid_level(&level.header, &previous->header))){
+                g_array_free(levels, TRUE);
+                levels = NULL;
+            } else {
+                g_array_append_val(levels, level);
+            }
+        }
+    }
+    lzma_index_end(index, NULL);
+    return levels;
+}
+
+/* Decode the smallest level of a pyramid that is at least width by height, or the whole input if it isn't a pyramid */
+static GdkPixbuf *_gdk_pixbuf__decode_pyramid(GBytes *input, int width, int height, GError **error){
+    size_t input_size;
+    const uint8_t *input_data = g_bytes_get_data(input, &input_size);
+    XZWholeInput whole = { NULL };
+    guint chosen = 0;
+
+    GArray *levels = _gdk_pixbuf__pyramid_levels(input_data, input_size);
+    for (guint i = 1; levels && i < levels->len; i++){
+        const XZPyramidLevel *level = &g_array_index(levels, XZPyramidLevel, i);
+        if (level->header.width >= (uint32_t) width && level->header.height >= (uint32_t) height)
+            chosen = i;
+    }
+    if (chosen){
+        const XZPyramidLevel *level = &g_array_index(levels, XZPyramidLevel, chosen);
+        whole.input = g_bytes_new_from_bytes(input, level->compressed_offset, level->compressed_size);
+        XZ_PIXBUF_PROBE2(pyramid_level, chosen, levels->len);
+        _gdk_pixbuf__count_stat(XZ_STAT_PYRAMID_DECODES);
+    } else {
+        whole.input = g_bytes_ref(input);
+    }
+    if (levels)
+        g_array_free(levels, TRUE);
+
+    GdkPixbuf *pixbuf = _gdk_pixbuf__decode_whole_input(&whole, NULL, error);
+    g_bytes_unref(whole.input);
+    return pixbuf;
+}
+
+/*
+ * Animations: GIF and WebP files are fed to an inner GdkPixbufLoader a piece at a time, as their frames are asked for
+ * Neither the decompressed file nor frames that are never reached are held, only the compressed input,
+ * which is dropped as soon as the last of it has been decompressed
+ * How lazily the frames themselves are decoded is up to the inner loader
+ */
+#define XZ_ANIMATION_STEP (1 << 16)
+
+typedef struct {
+    GdkPixbufAnimation parent_instance;
+    GBytes *input;
+    lzma_stream lzstream;
+    uint8_t *out_buffer;
+    GdkPixbufLoader *loader;
+    GdkPixbufAnimation *inner;
+    /* Set once all of the input went to the inner loader, or it failed */
+    gboolean finished;
+} XZAnimation;
+
+typedef struct {
+    GdkPixbufAnimationClass parent_class;
+} XZAnimationClass;
+
+typedef struct {
+    GdkPixbufAnimationIter parent_instance;
+    XZAnimation *animation;
+    GdkPixbufAnimationIter *inner;
+} XZAnimationIter;
+
+typedef struct {
+    GdkPixbufAnimationIterClass parent_class;
+} XZAnimationIterClass;
+
+static GType _gdk_pixbuf__xz_animation_get_type(void);
+static GType _gdk_pixbuf__xz_animation_iter_get_type(void);
+G_DEFINE_TYPE(XZAnimation, _gdk_pixbuf__xz_animation, GDK_TYPE_PIXBUF_ANIMATION)
+G_DEFINE_TYPE(XZAnimationIter, _gdk_pixbuf__xz_animation_iter, GDK_TYPE_PIXBUF_ANIMATION_ITER)
+
+/* Inner formats whose loaders can give more than one frame */
+static gboolean _gdk_pixbuf__animated_format(const char *format){
+    return format && (!strcmp(format, "gif") || !strcmp(format, "webp"));
+}
+
+static void _gdk_pixbuf__animation_finish(XZAnimation *animation){
+    animation->finished = TRUE;
+    lzma_end(&animation->lzstream);
+    g_clear_pointer(&animation->out_buffer, free);
+    g_clear_pointer(&animation->input, g_bytes_unref);
+    if (animation->loader){
+        gdk_pixbuf_loader_close(animation->loader, NULL);
+        g_clear_object(&animation->loader);
+    }
+}
+
+/* Decompress the next piece of the inner file into the inner loader, FALSE once there is nothing left to feed */
+static gboolean _gdk_pixbuf__animation_pump(XZAnimation *animation){
+    if (animation->finished)
+        return FALSE;
+
+    animation->lzstream.next_out = animation->out_buffer;
+    animation->lzstream.avail_out = XZ_ANIMATION_STEP;
+    lzma_ret lzret = lzma_code(&animation->lzstream, LZMA_FINISH);
+    size_t produced = XZ_ANIMATION_STEP - animation->lzstream.avail_out;
+    gboolean written = produced == 0 || gdk_pixbuf_loader_write(animation->loader, animation->out_buffer, produced, NULL);
+    if (!animation->inner && gdk_pixbuf_loader_get_animation(animation->loader))
+        animation->inner = g_object_ref(gdk_pixbuf_loader_get_animation(animation->loader));
+
+    if (!written || lzret != LZMA_OK)
+        _gdk_pixbuf__animation_finish(animation);
+    return TRUE;
+}
+
+/* Feed the inner loader until the frame the inner iterator is on is complete, which is when the next one has begun */
+static void _gdk_pixbuf__animation_iter_settle(XZAnimationIter *iter){
+    while (gdk_pixbuf_animation_iter_on_currently_loading_frame(iter->inner) && _gdk_pixbuf__animation_pump(iter->animation));
+}
+
+static int _gdk_pixbuf__animation_iter_get_delay_time(GdkPixbufAnimationIter *animation_iter){
+    XZAnimationIter *iter = (XZAnimationIter *) animation_iter;
+    return gdk_pixbuf_animation_iter_get_delay_time(iter->inner);
+}
+
+static GdkPixbuf *_gdk_pixbuf__animation_iter_get_pixbuf(GdkPixbufAnimationIter *animation_iter){
+    XZAnimationIter *iter = (XZAnimationIter *) animation_iter;
+    return gdk_pixbuf_animation_iter_get_pixbuf(iter->inner);
+}
+
+static gboolean _gdk_pixbuf__animation_iter_on_currently_loading_frame(GdkPixbufAnimationIter *animation_iter){
+    XZAnimationIter *iter = (XZAnimationIter *) animation_iter;
+    return !iter->animation->finished && gdk_pixbuf_animation_iter_on_currently_loading_frame(iter->inner);
+}
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+static gboolean _gdk_pixbuf__animation_iter_advance(GdkPixbufAnimationIter *animation_iter, const GTimeVal *current_time){
+    XZAnimationIter *iter = (XZAnimationIter *) animation_iter;
+
+    /* The inner iterator only moves onto frames that have begun loading */
+    _gdk_pixbuf__animation_iter_settle(iter);
+    gboolean changed = gdk_pixbuf_animation_iter_advance(iter->inner, current_time);
+    _gdk_pixbuf__animation_iter_settle(iter);
+    return changed;
+}
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+static void _gdk_pixbuf__xz_animation_iter_finalize(GObject *object){
+    XZAnimationIter *iter = (XZAnimationIter *) object;
+    g_clear_object(&iter->inner);
+    g_clear_object(&iter->animation);
+    G_OBJECT_CLASS(_gdk_pixbuf__xz_animation_iter_parent_class)->finalize(object);
+}
+
+static void _gdk_pixbuf__xz_animation_iter_class_init(XZAnimationIterClass *klass){
+    GdkPixbufAnimationIterClass *iter_class = GDK_PIXBUF_ANIMATION_ITER_CLASS(klass);
+    G_OBJECT_CLASS(klass)->finalize = _gdk_pixbuf__xz_animation_iter_finalize;
+    iter_class->get_delay_time = _gdk_pixbuf__animation_iter_get_delay_time;
+    iter_class->get_pixbuf = _gdk_pixbuf__animation_iter_get_pixbuf;
+    iter_class->on_currently_loading_frame = _gdk_pixbuf__animation_iter_on_currently_loading_frame;
+    iter_class->advance = _gdk_pixbuf__animation_iter_advance;
+}
+
+static void _gdk_pixbuf__xz_animation_iter_init(XZAnimationIter *iter){
+}
+
+/* Whether there is only the one frame, which takes feeding the inner loader until a second one begins or the input ends */
+static gboolean _gdk_pixbuf__animation_is_static_image(GdkPixbufAnimation *base){
+    XZAnimation *animation = (XZAnimation *) base;
+    while (gdk_pixbuf_animation_is_static_image(animation->inner) && _gdk_pixbuf__animation_pump(animation));
+    return gdk_pixbuf_animation_is_static_image(animation->inner);
+}
+
+static GdkPixbuf *_gdk_pixbuf__animation_get_static_image(GdkPixbufAnimation *base){
+    XZAnimation *animation = (XZAnimation *) base;
+    _gdk_pixbuf__animation_is_static_image(base);
+    return gdk_pixbuf_animation_get_static_image(animation->inner);
+}
+
+static void _gdk_pixbuf__animation_get_size(GdkPixbufAnimation *base, int *width, int *height){
+    XZAnimation *animation = (XZAnimation *) base;
+    if (width)
+        *width = gdk_pixbuf_animation_get_width(animation->inner);
+    if (height)
+        *height = gdk_pixbuf_animation_get_height(animation->inner);
+}
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+static GdkPixbufAnimationIter *_gdk_pixbuf__animation_get_iter(GdkPixbufAnimation *base, const GTimeVal *start_time){
+    XZAnimationIter *iter = (XZAnimationIter *) g_object_new(_gdk_pixbuf__xz_animation_iter_get_type(), NULL);
+    iter->animation = g_object_ref((XZAnimation *) base);
+    iter->inner = gdk_pixbuf_animation_get_iter(iter->animation->inner, start_time);
+    _gdk_pixbuf__animation_iter_settle(iter);
+    return GDK_PIXBUF_ANIMATION_ITER(iter);
+}
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+static void _gdk_pixbuf__xz_animation_finalize(GObject *object){
+    XZAnimation *animation = (XZAnimation *) object;
+    _gdk_pixbuf__animation_finish(animation);
+    g_clear_object(&animation->inner);
+    G_OBJECT_CLASS(_gdk_pixbuf__xz_animation_parent_class)->finalize(object);
+}
+
+static void _gdk_pixbuf__xz_animation_class_init(XZAnimationClass *klass){
+    GdkPixbufAnimationClass *animation_class = GDK_PIXBUF_ANIMATION_CLASS(klass);
+    G_OBJECT_CLASS(klass)->finalize = _gdk_pixbuf__xz_animation_finalize;
+    animation_class->is_static_image = _gdk_pixbuf__animation_is_static_image;
+    animation_class->get_static_image = _gdk_pixbuf__animation_get_static_image;
+    animation_class->get_size = _gdk_pixbuf__animation_get_size;
+    animation_class->get_iter = _gdk_pixbuf__animation_get_iter;
+}
+
+static void _gdk_pixbuf__xz_animation_init(XZAnimation *animation){
+    animation->lzstream = (lzma_stream) LZMA_STREAM_INIT;
+}
+
+/* Start decoding an animation from its compressed input, feeding the inner loader only until it has frames to show */
+static GdkPixbufAnimation *_gdk_pixbuf__new_animation(GBytes *input, const char *format, GError **error){
+    size_t input_size;
+    const uint8_t *input_data = g_bytes_get_data(input, &input_size);
+    XZLoadStats stats = { .path = "animation", .start_usec = g_get_monotonic_time(), .compressed_bytes = input_size, .inner_format = format };
+
+    XZAnimation *animation = (XZAnimation *) g_object_new(_gdk_pixbuf__xz_animation_get_type(), NULL);
+    animation->input = g_bytes_ref(input);
+    animation->out_buffer = (uint8_t *) malloc(XZ_ANIMATION_STEP);
+    animation->loader = gdk_pixbuf_loader_new();
+    if (!animation->out_buffer || lzma_stream_decoder(&animation->lzstream, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK){
+        g_object_unref(animation);
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Could not start decoding the animation");
+        _gdk_pixbuf__fail_load_stats(&stats, XZ_PIXBUF_FAILURE_ALLOC);
+        _gdk_pixbuf__commit_load_stats(&stats);
+        return NULL;
+    }
+    animation->lzstream.next_in = input_data;
+    animation->lzstream.avail_in = input_size;
+
+    int64_t start_time = g_get_monotonic_time();
+    while (!animation->inner && _gdk_pixbuf__animation_pump(animation));
+    stats.lzma_code_usec = g_get_monotonic_time() - start_time;
+    if (!animation->inner){
+        g_object_unref(animation);
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Could not decode the animation inside the xz file");
+        _gdk_pixbuf__fail_load_stats(&stats, XZ_PIXBUF_FAILURE_INNER_DECODE);
+        _gdk_pixbuf__commit_load_stats(&stats);
+        return NULL;
+    }
+    _gdk_pixbuf__count_stat(XZ_STAT_ANIMATIONS);
+    _gdk_pixbuf__commit_load_stats(&stats);
+    return GDK_PIXBUF_ANIMATION(animation);
+}
+
+/* Whether anything is configured that needs the whole input in memory before decoding */
+static gboolean _gdk_pixbuf__wants_whole_input(const XZLoaderConfig *config){
+    return config->cache_bytes || config->disk_cache_bytes || config->pixel_cache_bytes || config->broker_socket ||
+        config->decode_threads > 1 || config->chunk_passthrough;
+}
+
+/* Read all of the input, along with what the caches and parallel decoding key it on */
+static gboolean _gdk_pixbuf__read_whole_file(FILE *file, XZWholeInput *whole, GError **error){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+
+    if (config->disk_cache_bytes || config->pixel_cache_bytes)
+        whole->disk_key = _gdk_pixbuf__disk_cache_file_key(file);
+    whole->input = _gdk_pixbuf__read_whole_input(file, error);
+    if (!whole->input)
+        return FALSE;
+    if ((config->decode_threads > 1 || config->chunk_passthrough) && config->use_sidecar)
+        whole->plan = _gdk_pixbuf__read_sidecar(file, whole->input);
+    return TRUE;
+}
+
+static void _gdk_pixbuf__clear_whole_file(XZWholeInput *whole){
+    if (whole->input)
+        g_bytes_unref(whole->input);
+    g_free(whole->disk_key);
+    _gdk_pixbuf__free_block_plan(whole->plan);
+}
+
+/* Decode a whole input through the caches that are configured */
+static GdkPixbuf *_gdk_pixbuf__decode_whole_file(const XZWholeInput *whole, GError **error){
+    if (_gdk_pixbuf__xz_config()->cache_bytes)
+        return _gdk_pixbuf__cached_decode(whole, error);
+    return _gdk_pixbuf__disk_cached_decode(whole, error);
+}
+
+/* Load xz-compressed image directly in one go */
+static GdkPixbuf *gdk_pixbuf__load_xz_image(FILE *file, GError **error) {
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    GdkPixbuf *pixbuf = NULL;
+
+    if (!_gdk_pixbuf__wants_whole_input(config)){
+        pixbuf = _gdk_pixbuf__decode_xz_input(file, NULL, 0, NULL, NULL, error);
+    } else {
+        XZWholeInput whole = { NULL };
+        if (_gdk_pixbuf__read_whole_file(file, &whole, error))
+            pixbuf = _gdk_pixbuf__decode_whole_file(&whole, error);
+        _gdk_pixbuf__clear_whole_file(&whole);
+    }
+
+    if (pixbuf && config->xattr_hints)
+        _gdk_pixbuf__store_xattr_hint(file, pixbuf);
+    return pixbuf;
+}
+
+/*
+ * Load an animation, which is decompressed as its frames are shown, or a still image wrapped as one
+ * The file is read once: still images, single frame GIF and WebP files included, are decoded from the same input
+ */
+static GdkPixbufAnimation *gdk_pixbuf__load_xz_animation(FILE *file, GError **error){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    XZAnimationScan scan = { XZ_HEADER_NEED_MORE };
+    XZWholeInput whole = { NULL };
+    GdkPixbufAnimation *animation = NULL;
+    GdkPixbuf *pixbuf = NULL;
+
+    if (!_gdk_pixbuf__read_whole_file(file, &whole, error)){
+        _gdk_pixbuf__clear_whole_file(&whole);
+        return NULL;
+    }
+    size_t input_size;
+    const uint8_t *input_data = g_bytes_get_data(whole.input, &input_size);
+    if (!_gdk_pixbuf__wants_whole_input(config)){
+        /* One decode, which stops early only for an animation */
+        pixbuf = _gdk_pixbuf__decode_xz_input(NULL, input_data, input_size, NULL, &scan, error);
+    } else if (!_gdk_pixbuf__scan_memory_input(input_data, input_size, &scan)){
+        /* The caches may have a still image without decoding it, so only decode as far as telling it apart */
+        pixbuf = _gdk_pixbuf__decode_whole_file(&whole, error);
+    }
+
+    if (scan.state == XZ_HEADER_FOUND){
+        animation = _gdk_pixbuf__new_animation(whole.input, scan.format, error);
+    } else if (pixbuf){
+        if (config->xattr_hints)
+            _gdk_pixbuf__store_xattr_hint(file, pixbuf);
+        animation = gdk_pixbuf_non_anim_new(pixbuf);
+        g_object_unref(pixbuf);
+    }
+    _gdk_pixbuf__clear_whole_file(&whole);
+    return animation;
+}
+
+/* Start the asynchronous loading process */
+static gpointer gdk_pixbuf__begin_load_xz_image(GdkPixbufModuleSizeFunc size_func, GdkPixbufModulePreparedFunc prepare_func,
+        GdkPixbufModuleUpdatedFunc updated_func, gpointer extra_context, GError **error) {
+
+    char *error_message = NULL;
+
+    XZImageDecodeContext *context = (XZImageDecodeContext *) calloc(1, sizeof(XZImageDecodeContext));
+    if (!context){
+        error_message = "Error allocating decode context";
+        goto failure;
+    }
+    context->stats.path = "incremental";
+    context->stats.start_usec = g_get_monotonic_time();
+
+    context->lzstream = (lzma_stream *) malloc(sizeof(lzma_stream));
+    if (!context->lzstream){
+        error_message = "Error allocating lzma stream in context";
+        goto failure;
+    }
+    *(context->lzstream) = (lzma_stream) LZMA_STREAM_INIT;
+
+    lzma_ret lzret = lzma_stream_decoder(context->lzstream, UINT64_MAX, LZMA_CONCATENATED | LZMA_TELL_ANY_CHECK);
+    if (lzret != LZMA_OK) {
+        error_message = "Could not create lzma_stream_decoder";
+        goto failure;
+    }
+    XZ_PIXBUF_PROBE1(decoder_init, XZ_PIXBUF_PATH_INCREMENTAL);
+
+    context->xz_buffer_size = XZ_OUTPUT_BUFFER_SIZE;
+    context->unxz_buffer = (uint8_t *) malloc(context->xz_buffer_size);
+    context->staging_capacity = XZ_STAGING_BUFFER_SIZE;
+    context->staging_buffer = (uint8_t *) malloc(context->staging_capacity);
+    if (!context->unxz_buffer || !context->staging_buffer) {
+        error_message = "Could not create xz buffers";
+        goto failure;
+    }
+
+    context->lzstream->next_in = NULL;
+    context->lzstream->avail_in = 0;
+    context->lzstream->next_out = context->unxz_buffer;
+    context->lzstream->avail_out = context->xz_buffer_size;
+    
+    context->memory_istream = g_memory_input_stream_new();
+    context->size_func = size_func;
+    context->prepare_func = prepare_func;
+    context->updated_func  = updated_func;
+    context->extra_context = extra_context;
+    context->error = error;
+
+    return context;
+
+failure:
+    g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, error_message);
+    if (context){
+        _gdk_pixbuf__fail_load_stats(&context->stats, XZ_PIXBUF_FAILURE_ALLOC);
+        _gdk_pixbuf__commit_load_stats(&context->stats);
+        if (context->lzstream)
+            free(context->lzstream);
+        if (context->unxz_buffer)
+            free(context->unxz_buffer);
+        if (context->staging_buffer)
+            free(context->staging_buffer);
+        if (context->memory_istream)
+            g_input_stream_close(context->memory_istream, NULL, error);
+        free(context);
+    }
+    return NULL;
+}
+
+/*
+ * Hand the decoded bytes in unxz_buffer over to the memory stream
+ * A full buffer is given away as-is and replaced, a partial one is copied
+ */
+static gboolean _gdk_pixbuf__flush_unxz_buffer(XZImageDecodeContext *context){
+    size_t mem_buffer_size = context->xz_buffer_size - context->lzstream->avail_out;
+
+    if (mem_buffer_size == context->xz_buffer_size){
+        uint8_t *next_buffer = (uint8_t *) malloc(context->xz_buffer_size);
+        if (!next_buffer)
+            return FALSE;
+        g_memory_input_stream_add_data(G_MEMORY_INPUT_STREAM(context->memory_istream), context->unxz_buffer, mem_buffer_size, free);
+        context->unxz_buffer = next_buffer;
+    } else if (mem_buffer_size > 0){
+        void *mem_buffer = malloc(mem_buffer_size);
+        if (!mem_buffer)
+            return FALSE;
+        memcpy(mem_buffer, context->unxz_buffer, mem_buffer_size);
+        g_memory_input_stream_add_data(G_MEMORY_INPUT_STREAM(context->memory_istream), mem_buffer, mem_buffer_size, free);
+    }
+    if (mem_buffer_size > 0){
+        XZ_PIXBUF_PROBE1(chunk_append, mem_buffer_size);
+        context->stats.buffer_growths++;
+    }
+
+    context->lzstream->avail_out = context->xz_buffer_size;
+    context->lzstream->next_out = context->unxz_buffer;
+    return TRUE;
+}
+
+/*
+ * Tell the caller how big the image is going to be
+ * A size callback that asks for zero width or height cancels the load
+ */
+static gboolean _gdk_pixbuf__announce_size(XZImageDecodeContext *context, int width, int height){
+    context->size_announced = TRUE;
+    if (!context->size_func)
+        return TRUE;
+    (* context->size_func)(&width, &height, context->extra_context);
+    context->requested_width = width;
+    context->requested_height = height;
+    return width != 0 && height != 0;
+}
+
+/*
+ * Whether the compressed input seen so far must be kept, because the load could still be deferred:
+ * while it isn't known whether it's an animation, or whether a smaller size was asked for
+ */
+static gboolean _gdk_pixbuf__keep_input(const XZImageDecodeContext *context){
+    return context->animation_scan.state == XZ_HEADER_NEED_MORE ||
+        (context->size_func && context->sniffer.state == XZ_HEADER_NEED_MORE);
+}
+
+/* Stop decoding, and collect the input from the start instead, buf being the piece being decoded */
+static void _gdk_pixbuf__defer_input(XZImageDecodeContext *context, const guchar *buf, guint size){
+    context->deferred = context->undecided ? context->undecided : g_byte_array_sized_new(size);
+    context->undecided = NULL;
+    g_byte_array_append(context->deferred, buf, size);
+}
+
+/* Here we do the actual LZMA decoding */
+static gboolean _gdk_pixbuf__lzma_code(gpointer user_context, const guchar *buf, guint size, GError **error, lzma_action lzaction){
+    char *error_message = NULL;
+    XZPixbufFailureReason failure_reason;
+
+    XZImageDecodeContext *context = (XZImageDecodeContext *) user_context;
+    if (context->image_ended)
+        return TRUE;
+    context->lzstream->next_in = (const uint8_t *) buf;
+    context->lzstream->avail_in = size;
+
+    while (TRUE) {
+        uint8_t *out_start = context->lzstream->next_out;
+        size_t in_before = context->lzstream->avail_in;
+        int64_t start_time = g_get_monotonic_time();
+        lzma_ret lzret = lzma_code(context->lzstream, lzaction);
+        context->stats.lzma_code_usec += g_get_monotonic_time() - start_time;
+        XZ_PIXBUF_PROBE2(lzma_code, in_before - context->lzstream->avail_in, context->lzstream->next_out - out_start);
+        XZ_PIXBUF_MARK(start_time, "lzma_code", "incremental load");
+        /* The levels of a pyramid follow its image, and the rest of the input can be ignored */
+        if ((lzret == LZMA_OK || lzret == LZMA_GET_CHECK) && _gdk_pixbuf__pyramid_level_starts(&context->level_watch, out_start, context->lzstream)){
+            context->image_ended = TRUE;
+            lzret = LZMA_STREAM_END;
+        } else if (lzret == LZMA_GET_CHECK){
+            _gdk_pixbuf__watch_level(&context->level_watch, context->lzstream);
+            lzret = LZMA_OK;
+        }
+        if (lzret != LZMA_OK && lzret != LZMA_STREAM_END){
+            error_message = "Error with lzma decode";
+            failure_reason = XZ_PIXBUF_FAILURE_LZMA;
+            goto failure;
+        }
+
+        /* As soon as the inner header is known we can refuse the image, before decoding the rest */
+        if (context->sniffer.state == XZ_HEADER_NEED_MORE){
+            if (!_gdk_pixbuf__sniff_and_check(&context->sniffer, out_start, context->lzstream->next_out - out_start)){
+                error_message = "Image dimensions exceed the configured limits";
+                failure_reason = XZ_PIXBUF_FAILURE_LIMIT;
+                goto failure;
+            }
+            if (context->sniffer.state == XZ_HEADER_FOUND &&
+                    !_gdk_pixbuf__announce_size(context, context->sniffer.header.width, context->sniffer.header.height)){
+                error_message = "Transformed xz image has zero width or height";
+                failure_reason = XZ_PIXBUF_FAILURE_CANCELLED;
+                goto failure;
+            }
+            /* A pyramid level could serve a size of half or less, and the input kept so far holds all of it */
+            if (context->sniffer.state == XZ_HEADER_FOUND &&
+                    !_gdk_pixbuf__animated_format(context->sniffer.header.format) && context->size_func &&
+                    context->requested_width <= (int) context->sniffer.header.width / 2 &&
+                    context->requested_height <= (int) context->sniffer.header.height / 2){
+                _gdk_pixbuf__defer_input(context, buf, size);
+                return TRUE;
+            }
+        }
+
+        /*
+         * Animations are decoded from the compressed input as they play, once the output shows a second frame
+         * Still images, single frame GIF and WebP files included, carry on decoding here
+         */
+        if (context->animation_scan.state == XZ_HEADER_NEED_MORE){
+            _gdk_pixbuf__scan_animation(&context->animation_scan, out_start, context->lzstream->next_out - out_start);
+            if (context->animation_scan.state == XZ_HEADER_FOUND){
+                _gdk_pixbuf__defer_input(context, buf, size);
+                context->animated = TRUE;
+                return TRUE;
+            }
+        }
+        if (!_gdk_pixbuf__keep_input(context))
+            g_clear_pointer(&context->undecided, g_byte_array_unref);
+
+        /* Output is only appended once unxz_buffer fills up, or at the very end */
+        gboolean drained = context->lzstream->avail_out != 0;
+        if (!drained || lzret == LZMA_STREAM_END){
+            if (!_gdk_pixbuf__flush_unxz_buffer(context)){
+                error_message = "Error allocating buffer";
+                failure_reason = XZ_PIXBUF_FAILURE_ALLOC;
+                goto failure;
+            }
+            context->level_watch.boundary = NULL;
+        }
+
+        if (lzret == LZMA_STREAM_END)
+            break;
+        /* When finishing we keep going until liblzma reports the end of the stream */
+        if (lzaction == LZMA_RUN && drained && context->lzstream->avail_in == 0)
+            break;
+    }
+
+    if (_gdk_pixbuf__keep_input(context)){
+        if (!context->undecided)
+            context->undecided = g_byte_array_new();
+        g_byte_array_append(context->undecided, buf, size);
+    }
+    return TRUE;
+
+failure:
+    context->failed = TRUE;
+    _gdk_pixbuf__fail_load_stats(&context->stats, failure_reason);
+    g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, error_message);
+    return FALSE;    
+}
+
+/* Finish decoding the image, and render it */
+static gboolean gdk_pixbuf__stop_load_xz_image(gpointer user_context, GError **error) {
+
+    XZImageDecodeContext *context = (XZImageDecodeContext *) user_context;
+    gboolean ret = FALSE;
+
+    /* A load that already failed or was cancelled has nothing left to render */
+    if (context->failed){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Image loading was aborted");
+        _gdk_pixbuf__record_lzma_stats(&context->stats, context->lzstream);
+        lzma_end(context->lzstream);
+        g_input_stream_close(context->memory_istream, NULL, NULL);
+        goto cleanup;
+    }
+
+    /* We do a final run of lzma_code over whatever is still staged, telling liblzma to finish and flush */
+    if (!context->deferred){
+        ret = _gdk_pixbuf__lzma_code(user_context, context->staging_buffer, context->staging_size, error, LZMA_FINISH);
+        context->staging_size = 0;
+    }
+
+    /* A deferred animation plays from the collected input, whose first frame is the still image */
+    if (context->deferred && context->animated){
+        lzma_end(context->lzstream);
+        g_input_stream_close(context->memory_istream, NULL, NULL);
+        GBytes *input = g_byte_array_free_to_bytes(context->deferred);
+        context->deferred = NULL;
+        context->animation = _gdk_pixbuf__new_animation(input, context->animation_scan.format, error);
+        g_bytes_unref(input);
+        GdkPixbuf *still = context->animation ? gdk_pixbuf_animation_get_static_image(context->animation) : NULL;
+        context->pixbuf = still ? g_object_ref(still) : NULL;
+        ret = context->pixbuf != NULL;
+        goto render;
+    }
+
+    /* A deferred load decodes as a whole, committing its own statistics */
+    if (context->deferred){
+        lzma_end(context->lzstream);
+        g_input_stream_close(context->memory_istream, NULL, NULL);
+        GBytes *input = g_bytes_new_static(context->deferred->data, context->deferred->len);
+        context->pixbuf = _gdk_pixbuf__decode_pyramid(input, context->requested_width, context->requested_height, error);
+        g_bytes_unref(input);
+        ret = context->pixbuf != NULL;
+        goto render;
+    }
+
+    _gdk_pixbuf__record_lzma_stats(&context->stats, context->lzstream);
+    lzma_end(context->lzstream);
+    if (!ret){
+        g_input_stream_close(context->memory_istream, NULL, NULL);
+        goto cleanup;
+    }
+
+    XZ_PIXBUF_PROBE1(inner_decode_start, context->stats.uncompressed_bytes);
+    int64_t start_time = g_get_monotonic_time();
+    context->pixbuf = gdk_pixbuf_new_from_stream(context->memory_istream, NULL, error);
+    context->stats.inner_decode_usec = g_get_monotonic_time() - start_time;
+    XZ_PIXBUF_PROBE1(inner_decode_end, context->pixbuf != NULL);
+    XZ_PIXBUF_MARK(start_time, "inner decode", "incremental load");
+    if (!context->pixbuf){
+        _gdk_pixbuf__fail_load_stats(&context->stats, XZ_PIXBUF_FAILURE_INNER_DECODE);
+        ret = FALSE;
+    }
+    g_input_stream_close(context->memory_istream, NULL, context->error);
+
+    /* Inner formats we could not sniff still get their size announced before being prepared */
+    if (context->pixbuf && !context->size_announced &&
+            !_gdk_pixbuf__announce_size(context, gdk_pixbuf_get_width(context->pixbuf), gdk_pixbuf_get_height(context->pixbuf))){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Transformed xz image has zero width or height");
+        _gdk_pixbuf__fail_load_stats(&context->stats, XZ_PIXBUF_FAILURE_CANCELLED);
+        ret = FALSE;
+        goto cleanup;
+    }
+
+    if (context->pixbuf){
+        XZ_PIXBUF_PROBE2(pixbuf_created, gdk_pixbuf_get_width(context->pixbuf), gdk_pixbuf_get_height(context->pixbuf));
+        _gdk_pixbuf__record_stream_stats(&context->stats, &context->input_windows, &context->sniffer);
+        _gdk_pixbuf__attach_load_options(context->pixbuf, &context->stats);
+    }
+
+render:
+    if (context->pixbuf && context->prepare_func){
+        (* context->prepare_func)(context->pixbuf, context->animation, context->extra_context);
+    }
+    if (context->pixbuf && context->updated_func) {
+        (* context->updated_func)(context->pixbuf, 0, 0, gdk_pixbuf_get_width(context->pixbuf), gdk_pixbuf_get_height(context->pixbuf), context->extra_context);
+    }
+
+cleanup:
+    if (!context->deferred && !context->animated)
+        _gdk_pixbuf__commit_load_stats(&context->stats);
+    if (context->pixbuf)
+        g_object_unref(context->pixbuf);
+    if (context->animation)
+        g_object_unref(context->animation);
+    if (context->deferred)
+        g_byte_array_free(context->deferred, TRUE);
+    if (context->undecided)
+        g_byte_array_free(context->undecided, TRUE);
+    free(context->lzstream);
+    free(context->unxz_buffer);
+    free(context->staging_buffer);
+    free(context->sniffer.data);
+    free(context->input_windows.tail);
+    free(context);
+    return ret;
+}
+
+/*
+ * Incrementally decode lzma
+ * Writes smaller than the staging buffer are coalesced there first,
+ * so lzma_code runs over reasonably sized pieces of input
  */
 static gboolean gdk_pixbuf__load_xz_image_increment(gpointer user_context, const guchar *buf, guint size, GError **error) {
-    return _gdk_pixbuf__lzma_code(user_context, buf, size, error, LZMA_RUN);
+
+    XZImageDecodeContext *context = (XZImageDecodeContext *) user_context;
+
+    if (context->failed){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Image loading was aborted");
+        return FALSE;
+    }
+
+    if (context->deferred){
+        g_byte_array_append(context->deferred, buf, size);
+        return TRUE;
+    }
+    if (context->image_ended)
+        return TRUE;
+
+    if (!_gdk_pixbuf__record_input(&context->input_windows, buf, size)){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Error allocating input window");
+        context->failed = TRUE;
+        _gdk_pixbuf__fail_load_stats(&context->stats, XZ_PIXBUF_FAILURE_ALLOC);
+        return FALSE;
+    }
+
+    while (size > 0) {
+        /*
+         * Large writes with nothing staged skip the copy entirely
+         * Until the inner header is known we decode straight away, so oversized
+         * images are caught early and size callbacks fire promptly
+         */
+        if (context->staging_size == 0 && (size >= context->staging_capacity || context->sniffer.state == XZ_HEADER_NEED_MORE))
+            return _gdk_pixbuf__lzma_code(user_context, buf, size, error, LZMA_RUN);
+
+        size_t staged = MIN(size, context->staging_capacity - context->staging_size);
+        memcpy(context->staging_buffer + context->staging_size, buf, staged);
+        context->staging_size += staged;
+        buf += staged;
+        size -= staged;
+
+        if (context->staging_size == context->staging_capacity){
+            if (!_gdk_pixbuf__lzma_code(user_context, context->staging_buffer, context->staging_size, error, LZMA_RUN))
+                return FALSE;
+            context->staging_size = 0;
+            /* Once it turned out to be an animation, the rest of the input is only collected */
+            if (context->deferred){
+                g_byte_array_append(context->deferred, buf, size);
+                return TRUE;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/* Monitoring code looks this up with dlsym */
+size_t xz_pixbuf_loader_get_stats(XZPixbufLoaderStats *stats, size_t stats_size){
+    uint64_t totals[XZ_STAT_COUNT] = { 0 };
+
+    for (int shard = 0; shard < XZ_STATS_SHARDS; shard++){
+        for (int stat = 0; stat < XZ_STAT_COUNT; stat++){
+            uint64_t value = atomic_load_explicit(&xz_stats_shards[shard].counters[stat], memory_order_relaxed);
+            if (stat == XZ_STAT_PEAK_MEMUSAGE)
+                totals[stat] = MAX(totals[stat], value);
+            else
+                totals[stat] += value;
+        }
+    }
+
+    XZPixbufLoaderStats snapshot = { 0 };
+    snapshot.loads = totals[XZ_STAT_LOADS];
+    for (int reason = 0; reason < XZ_PIXBUF_FAILURE_REASONS; reason++)
+        snapshot.failures[reason] = totals[XZ_STAT_FAILURES + reason];
+    snapshot.compressed_bytes = totals[XZ_STAT_COMPRESSED_BYTES];
+    snapshot.uncompressed_bytes = totals[XZ_STAT_UNCOMPRESSED_BYTES];
+    snapshot.lzma_code_usec = totals[XZ_STAT_LZMA_CODE_USEC];
+    snapshot.inner_decode_usec = totals[XZ_STAT_INNER_DECODE_USEC];
+    snapshot.buffer_growths = totals[XZ_STAT_BUFFER_GROWTHS];
+    snapshot.peak_memusage = totals[XZ_STAT_PEAK_MEMUSAGE];
+    snapshot.memory_cache_hits = totals[XZ_STAT_MEMORY_CACHE_HITS];
+    snapshot.disk_cache_hits = totals[XZ_STAT_DISK_CACHE_HITS];
+    snapshot.pixel_cache_hits = totals[XZ_STAT_PIXEL_CACHE_HITS];
+    snapshot.broker_hits = totals[XZ_STAT_BROKER_HITS];
+    snapshot.parallel_decodes = totals[XZ_STAT_PARALLEL_DECODES];
+    snapshot.region_decodes = totals[XZ_STAT_REGION_DECODES];
+    snapshot.passthrough_bytes = totals[XZ_STAT_PASSTHROUGH_BYTES];
+    snapshot.segment_decodes = totals[XZ_STAT_SEGMENT_DECODES];
+    snapshot.pyramid_decodes = totals[XZ_STAT_PYRAMID_DECODES];
+    snapshot.animations = totals[XZ_STAT_ANIMATIONS];
+
+    if (stats)
+        memcpy(stats, &snapshot, MIN(stats_size, sizeof(snapshot)));
+    return sizeof(snapshot);
+}
+
+int xz_pixbuf_loader_get_file_info(const char *filename, XZPixbufFileInfo *info, size_t info_size){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    XZPixbufFileInfo result = { 0 };
+    XZFileHint hint;
+    struct stat st;
+    gboolean found;
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)){
+        close(fd);
+        return 0;
+    }
+
+    result.from_xattr = found = _gdk_pixbuf__read_xattr_hint(fd, &st, &hint);
+    if (!found){
+        found = _gdk_pixbuf__probe_file_hint(fd, &st, &hint);
+        if (found && config->xattr_hints)
+            _gdk_pixbuf__write_xattr_hint(fd, &st, &hint);
+    }
+    close(fd);
+    if (!found)
+        return 0;
+
+    g_strlcpy(result.format, hint.format, sizeof(result.format));
+    result.width = hint.width;
+    result.height = hint.height;
+    result.uncompressed_size = hint.uncompressed_size;
+    if (info)
+        memcpy(info, &result, MIN(info_size, sizeof(result)));
+    return 1;
+}
+
+int xz_pixbuf_loader_write_index(const char *filename){
+    struct stat st;
+    XZInnerHeader header = { NULL };
+    int ret = 0;
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    GMappedFile *mapped = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 ?
+        g_mapped_file_new_from_fd(fd, FALSE, NULL) : NULL;
+    close(fd);
+    if (!mapped)
+        return 0;
+
+    const uint8_t *data = (const uint8_t *) g_mapped_file_get_contents(mapped);
+    size_t size = g_mapped_file_get_length(mapped);
+    lzma_index *index = _gdk_pixbuf__decode_memory_index(data, size);
+    XZBlockPlan *plan = index ? _gdk_pixbuf__block_plan_from_index(index) : NULL;
+    if (index)
+        lzma_index_end(index, NULL);
+    if (!plan || plan->block_count > UINT32_MAX)
+        goto done;
+    _gdk_pixbuf__sniff_memory_input(data, size, &header);
+
+    size_t sidecar_size = XZ_SIDECAR_HEADER_SIZE + plan->block_count * XZ_SIDECAR_BLOCK_SIZE + 4;
+    uint8_t *sidecar = (uint8_t *) calloc(1, sidecar_size);
+    if (!sidecar)
+        goto done;
+    memcpy(sidecar, XZ_SIDECAR_MAGIC, 8);
+    _gdk_pixbuf__write_le64(sidecar + 8, st.st_size);
+    _gdk_pixbuf__write_le64(sidecar + 16, st.st_mtim.tv_sec);
+    _gdk_pixbuf__write_le32(sidecar + 24, st.st_mtim.tv_nsec);
+    _gdk_pixbuf__write_le32(sidecar + 28, plan->block_count);
+    _gdk_pixbuf__write_le64(sidecar + 32, lzma_crc64(data, size, 0));
+    _gdk_pixbuf__write_le64(sidecar + 40, plan->uncompressed_size);
+    if (header.format)
+        strncpy((char *) sidecar + 48, header.format, 16);
+    _gdk_pixbuf__write_le32(sidecar + 64, header.width);
+    _gdk_pixbuf__write_le32(sidecar + 68, header.height);
+    _gdk_pixbuf__write_le32(sidecar + 72, header.channels);
+
+    uint8_t *entry = sidecar + XZ_SIDECAR_HEADER_SIZE;
+    for (size_t i = 0; i < plan->block_count; i++, entry += XZ_SIDECAR_BLOCK_SIZE){
+        _gdk_pixbuf__write_le64(entry, plan->blocks[i].compressed_offset);
+        _gdk_pixbuf__write_le64(entry + 8, plan->blocks[i].uncompressed_offset);
+        _gdk_pixbuf__write_le64(entry + 16, plan->blocks[i].total_size);
+        _gdk_pixbuf__write_le64(entry + 24, plan->blocks[i].uncompressed_size);
+        _gdk_pixbuf__write_le32(entry + 32, plan->blocks[i].check);
+    }
+    _gdk_pixbuf__write_le32(sidecar + sidecar_size - 4, lzma_crc32(sidecar, sidecar_size - 4, 0));
+
+    char *sidecar_path = g_strconcat(filename, XZ_SIDECAR_SUFFIX, NULL);
+    ret = g_file_set_contents(sidecar_path, (const char *) sidecar, sidecar_size, NULL);
+    g_free(sidecar_path);
+    free(sidecar);
+
+done:
+    _gdk_pixbuf__free_block_plan(plan);
+    g_mapped_file_unref(mapped);
+    return ret;
+}
+
+/*
+ * Decode just the blocks of plan that hold the decoded bytes from start to end
+ * Returns those blocks' output, which begins at *range_start, or NULL if the plan doesn't fit the input
+ */
+static GBytes *_gdk_pixbuf__decode_block_range(GBytes *input, const XZBlockPlan *plan, uint64_t start, uint64_t end, uint64_t *range_start){
+    XZLoadStats stats = { 0 };
+    size_t first = 0, last;
+
+    while (first < plan->block_count && plan->blocks[first].uncompressed_offset + plan->blocks[first].uncompressed_size <= start)
+        first++;
+    for (last = first; last + 1 < plan->block_count && plan->blocks[last + 1].uncompressed_offset < end; last++)
+        ;
+    if (first == plan->block_count)
+        return NULL;
+
+    XZBlockPlan *range = _gdk_pixbuf__new_block_plan(last - first + 1);
+    if (!range)
+        return NULL;
+    *range_start = plan->blocks[first].uncompressed_offset;
+    for (size_t i = 0; i < range->block_count; i++){
+        range->blocks[i] = plan->blocks[first + i];
+        range->blocks[i].uncompressed_offset -= *range_start;
+        range->uncompressed_size += range->blocks[i].uncompressed_size;
+    }
+    GBytes *decoded = _gdk_pixbuf__decode_blocks_parallel(input, range, &stats);
+    _gdk_pixbuf__free_block_plan(range);
+    return decoded;
+}
+
+/* Read one sample of a raw row, scaled to 8 bits */
+static uint8_t _gdk_pixbuf__raw_sample(const uint8_t *p, uint32_t maxval){
+    if (maxval > 255)
+        return (uint8_t) ((((uint32_t) p[0] << 8 | p[1]) * 255 + maxval / 2) / maxval);
+    return maxval == 255 ? p[0] : (uint8_t) (((uint32_t) MIN(p[0], maxval) * 255 + maxval / 2) / maxval);
+}
+
+/* Convert width pixels of a raw row to RGB or RGBA */
+static void _gdk_pixbuf__convert_raw_row(const XZRawLayout *layout, const uint8_t *src, uint32_t width, uint8_t *dest){
+    size_t sample_bytes = layout->maxval > 255 ? 2 : 1;
+    size_t pixel_bytes = layout->samples * sample_bytes;
+    gboolean bgr = !strcmp(layout->format, "bmp");
+
+    for (uint32_t i = 0; i < width; i++, src += pixel_bytes){
+        uint8_t samples[4];
+        for (uint32_t c = 0; c < layout->samples; c++)
+            samples[c] = _gdk_pixbuf__raw_sample(src + c * sample_bytes, layout->maxval);
+        if (layout->samples <= 2){
+            *dest++ = samples[0];
+            *dest++ = samples[0];
+            *dest++ = samples[0];
+        } else {
+            *dest++ = samples[bgr ? 2 : 0];
+            *dest++ = samples[1];
+            *dest++ = samples[bgr ? 0 : 2];
+        }
+        if (layout->samples == 2 || layout->samples == 4)
+            *dest++ = samples[layout->samples - 1];
+    }
+}
+
+GdkPixbuf *xz_pixbuf_loader_load_region(const char *filename, int x, int y, int width, int height,
+        double scale, GError **error){
+
+    struct stat st;
+    GMappedFile *mapped = NULL;
+    GBytes *input = NULL;
+    GBytes *head = NULL;
+    GBytes *rows = NULL;
+    XZBlockPlan *plan = NULL;
+    XZRawLayout layout = { NULL };
+    GdkPixbuf *pixbuf = NULL;
+    const char *error_message = NULL;
+    GdkPixbufError error_code = GDK_PIXBUF_ERROR_FAILED;
+    uint64_t head_start, rows_start;
+
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 || !(scale > 0)){
+        error_message = "Invalid region";
+        error_code = GDK_PIXBUF_ERROR_BAD_OPTION;
+        goto failure;
+    }
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        error_message = "Could not open file";
+        goto failure;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        mapped = g_mapped_file_new_from_fd(fd, FALSE, NULL);
+    close(fd);
+    if (!mapped){
+        error_message = "Error reading file";
+        goto failure;
+    }
+    input = g_mapped_file_get_bytes(mapped);
+
+    size_t input_size;
+    const uint8_t *input_data = g_bytes_get_data(input, &input_size);
+    lzma_index *index = _gdk_pixbuf__decode_memory_index(input_data, input_size);
+    if (index){
+        plan = _gdk_pixbuf__block_plan_from_index(index);
+        lzma_index_end(index, NULL);
+    }
+    if (!plan){
+        error_message = "Could not read the xz index";
+        goto failure;
+    }
+
+    /*
+     * The header is read from the start of the first block, decompressing only as much of it as the header takes
+     * With xz-block-rows the first block holds the header and nothing else, otherwise the header may span a few
+     */
+    size_t head_size;
+    const uint8_t *head_data;
+    uint64_t head_limit = MIN(plan->uncompressed_size, XZ_MAX_RAW_HEADER);
+    XZHeaderState state = XZ_HEADER_UNKNOWN;
+    head_start = 0;
+    head = _gdk_pixbuf__decode_first_block_head(input_data, input_size, head_limit, &layout, &state);
+    if (head){
+        head_data = g_bytes_get_data(head, &head_size);
+        if (state == XZ_HEADER_NEED_MORE && head_size < head_limit){
+            g_bytes_unref(head);
+            head = _gdk_pixbuf__decode_block_range(input, plan, 0, head_limit, &head_start);
+            if (head){
+                head_data = g_bytes_get_data(head, &head_size);
+                state = _gdk_pixbuf__parse_raw_layout(head_data, head_size, &layout);
+            }
+        }
+    }
+    if (!head){
+        error_message = "Some LZMA error occurred";
+        goto failure;
+    }
+    if (state != XZ_HEADER_FOUND || !layout.samples){
+        error_message = "Regions can only be decoded from uncompressed inner formats, such as pnm or bmp";
+        goto failure;
+    }
+    if ((uint64_t) x + width > layout.width || (uint64_t) y + height > layout.rows){
+        error_message = "Region is outside the image";
+        error_code = GDK_PIXBUF_ERROR_BAD_OPTION;
+        goto failure;
+    }
+    XZInnerHeader region = { layout.format, width, height, (layout.samples == 2 || layout.samples == 4) ? 4 : 3 };
+    if (!_gdk_pixbuf__inner_header_allowed(&region)){
+        error_message = "Image dimensions exceed the configured limits";
+        goto failure;
+    }
+
+    /* Rows are stored bottom to top in most BMPs */
+    uint32_t first_row = layout.bottom_up ? layout.rows - (uint32_t) (y + height) : (uint32_t) y;
+    uint64_t start = layout.pixel_offset + first_row * layout.row_bytes;
+    uint64_t end = start + (uint64_t) height * layout.row_bytes;
+    if (end > plan->uncompressed_size){
+        error_message = "Image data is truncated";
+        goto failure;
+    }
+    if (end <= head_start + head_size){
+        rows = g_bytes_ref(head);
+        rows_start = head_start;
+    } else if (plan->block_count == 1){
+        /* A file in one block has no later start to decode from, but needs no more of it than the last row */
+        rows = _gdk_pixbuf__decode_first_block_head(input_data, input_size, end, NULL, NULL);
+        rows_start = 0;
+        if (rows && g_bytes_get_size(rows) < end)
+            g_clear_pointer(&rows, g_bytes_unref);
+    } else {
+        rows = _gdk_pixbuf__decode_block_range(input, plan, start, end, &rows_start);
+    }
+    if (!rows){
+        error_message = "Some LZMA error occurred";
+        goto failure;
+    }
+
+    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, region.channels == 4, 8, width, height);
+    if (!pixbuf){
+        error_message = "Error allocating memory";
+        error_code = GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY;
+        goto failure;
+    }
+    const uint8_t *rows_data = g_bytes_get_data(rows, NULL);
+    uint8_t *pixels = gdk_pixbuf_get_pixels(pixbuf);
+    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    uint64_t x_offset = (uint64_t) x * layout.samples * (layout.maxval > 255 ? 2 : 1);
+    for (int row = 0; row < height; row++){
+        int file_row = layout.bottom_up ? height - 1 - row : row;
+        _gdk_pixbuf__convert_raw_row(&layout, rows_data + (start - rows_start) + file_row * layout.row_bytes + x_offset,
+            width, pixels + (size_t) row * rowstride);
+    }
+
+    if (scale != 1.0){
+        GdkPixbuf *scaled = gdk_pixbuf_scale_simple(pixbuf, MAX((int) (width * scale + 0.5), 1),
+            MAX((int) (height * scale + 0.5), 1), GDK_INTERP_BILINEAR);
+        g_object_unref(pixbuf);
+        pixbuf = scaled;
+        if (!pixbuf){
+            error_message = "Error allocating memory";
+            error_code = GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY;
+            goto failure;
+        }
+    }
+    _gdk_pixbuf__count_stat(XZ_STAT_REGION_DECODES);
+
+    g_bytes_unref(rows);
+    g_bytes_unref(head);
+    _gdk_pixbuf__free_block_plan(plan);
+    g_bytes_unref(input);
+    g_mapped_file_unref(mapped);
+    return pixbuf;
+
+failure:
+    g_set_error(error, GDK_PIXBUF_ERROR, error_code, "%s", error_message);
+    if (rows)
+        g_bytes_unref(rows);
+    if (head)
+        g_bytes_unref(head);
+    _gdk_pixbuf__free_block_plan(plan);
+    if (input)
+        g_bytes_unref(input);
+    if (mapped)
+        g_mapped_file_unref(mapped);
+    return NULL;
+}
+
+/* Sum one histogram across all shards */
+static void _gdk_pixbuf__sum_histogram(size_t format, size_t size, uint64_t *values, size_t n_values){
+    memset(values, 0, n_values * sizeof(uint64_t));
+    for (size_t shard = 0; shard < XZ_STATS_SHARDS; shard++){
+        _Atomic uint64_t *counters = (_Atomic uint64_t *) &xz_histogram_shards[shard].histograms[format][size];
+        for (size_t i = 0; i < n_values; i++)
+            values[i] += atomic_load_explicit(&counters[i], memory_order_relaxed);
+    }
+}
+
+static void _gdk_pixbuf__append_histogram(GString *text, const char *name, const char *labels,
+        const uint64_t *buckets, size_t n_buckets, const char *const *bounds, uint64_t count, double sum){
+    uint64_t cumulative = 0;
+
+    for (size_t i = 0; i < n_buckets; i++){
+        cumulative += buckets[i];
+        g_string_append_printf(text, "%s_bucket{%s,le=\"%s\"} %" G_GUINT64_FORMAT "\n", name, labels, bounds[i], cumulative);
+    }
+    g_string_append_printf(text, "%s_sum{%s} %.6f\n", name, labels, sum);
+    g_string_append_printf(text, "%s_count{%s} %" G_GUINT64_FORMAT "\n", name, labels, count);
+}
+
+/* Render all counters and histograms in the Prometheus text exposition format */
+static char *_gdk_pixbuf__format_metrics(void){
+    static const char *failure_reasons[] = {
+        [XZ_PIXBUF_FAILURE_ALLOC] = "alloc",
+        [XZ_PIXBUF_FAILURE_IO] = "io",
+        [XZ_PIXBUF_FAILURE_LZMA] = "lzma",
+        [XZ_PIXBUF_FAILURE_INNER_DECODE] = "inner_decode",
+        [XZ_PIXBUF_FAILURE_LIMIT] = "limit",
+        [XZ_PIXBUF_FAILURE_CANCELLED] = "cancelled",
+    };
+    XZPixbufLoaderStats stats;
+    GString *text = g_string_new(NULL);
+
+    xz_pixbuf_loader_get_stats(&stats, sizeof(stats));
+    g_string_append_printf(text, "# TYPE xz_pixbuf_loads_total counter\nxz_pixbuf_loads_total %" G_GUINT64_FORMAT "\n", stats.loads);
+    g_string_append(text, "# TYPE xz_pixbuf_failures_total counter\n");
+    for (int reason = 0; reason < XZ_PIXBUF_FAILURE_REASONS; reason++)
+        g_string_append_printf(text, "xz_pixbuf_failures_total{reason=\"%s\"} %" G_GUINT64_FORMAT "\n", failure_reasons[reason], stats.failures[reason]);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_compressed_bytes_total counter\nxz_pixbuf_compressed_bytes_total %" G_GUINT64_FORMAT "\n", stats.compressed_bytes);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_uncompressed_bytes_total counter\nxz_pixbuf_uncompressed_bytes_total %" G_GUINT64_FORMAT "\n", stats.uncompressed_bytes);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_lzma_code_seconds_total counter\nxz_pixbuf_lzma_code_seconds_total %.6f\n", stats.lzma_code_usec / 1e6);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_inner_decode_seconds_total counter\nxz_pixbuf_inner_decode_seconds_total %.6f\n", stats.inner_decode_usec / 1e6);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_buffer_growths_total counter\nxz_pixbuf_buffer_growths_total %" G_GUINT64_FORMAT "\n", stats.buffer_growths);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_peak_memusage_bytes gauge\nxz_pixbuf_peak_memusage_bytes %" G_GUINT64_FORMAT "\n", stats.peak_memusage);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_memory_cache_hits_total counter\nxz_pixbuf_memory_cache_hits_total %" G_GUINT64_FORMAT "\n", stats.memory_cache_hits);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_disk_cache_hits_total counter\nxz_pixbuf_disk_cache_hits_total %" G_GUINT64_FORMAT "\n", stats.disk_cache_hits);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_pixel_cache_hits_total counter\nxz_pixbuf_pixel_cache_hits_total %" G_GUINT64_FORMAT "\n", stats.pixel_cache_hits);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_broker_hits_total counter\nxz_pixbuf_broker_hits_total %" G_GUINT64_FORMAT "\n", stats.broker_hits);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_parallel_decodes_total counter\nxz_pixbuf_parallel_decodes_total %" G_GUINT64_FORMAT "\n", stats.parallel_decodes);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_region_decodes_total counter\nxz_pixbuf_region_decodes_total %" G_GUINT64_FORMAT "\n", stats.region_decodes);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_passthrough_bytes_total counter\nxz_pixbuf_passthrough_bytes_total %" G_GUINT64_FORMAT "\n", stats.passthrough_bytes);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_segment_decodes_total counter\nxz_pixbuf_segment_decodes_total %" G_GUINT64_FORMAT "\n", stats.segment_decodes);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_pyramid_decodes_total counter\nxz_pixbuf_pyramid_decodes_total %" G_GUINT64_FORMAT "\n", stats.pyramid_decodes);
+    g_string_append_printf(text, "# TYPE xz_pixbuf_animations_total counter\nxz_pixbuf_animations_total %" G_GUINT64_FORMAT "\n", stats.animations);
+
+    const char *usec_bounds[XZ_HISTOGRAM_USEC_BUCKETS];
+    char usec_bound_text[XZ_HISTOGRAM_USEC_BUCKETS][16];
+    for (size_t i = 0; i < XZ_HISTOGRAM_USEC_BUCKETS - 1; i++){
+        g_snprintf(usec_bound_text[i], sizeof(usec_bound_text[i]), "%g", xz_histogram_usec_bounds[i] / 1e6);
+        usec_bounds[i] = usec_bound_text[i];
+    }
+    usec_bounds[XZ_HISTOGRAM_USEC_BUCKETS - 1] = "+Inf";
+    static const char *ratio_bounds[XZ_HISTOGRAM_RATIO_BUCKETS] = {
+        "0.1", "0.2", "0.3", "0.4", "0.5", "0.6", "0.7", "0.8", "0.9", "+Inf"
+    };
+
+    GString *decompress = g_string_new("# TYPE xz_pixbuf_decompress_seconds histogram\n");
+    GString *inner_decode = g_string_new("# TYPE xz_pixbuf_inner_decode_seconds histogram\n");
+    GString *ratio = g_string_new("# TYPE xz_pixbuf_decompress_ratio histogram\n");
+    for (size_t format = 0; format < XZ_HISTOGRAM_FORMATS; format++){
+        for (size_t size = 0; size < XZ_HISTOGRAM_SIZES; size++){
+            uint64_t values[sizeof(XZHistogram) / sizeof(uint64_t)];
+            XZHistogram *sum = (XZHistogram *) values;
+            _gdk_pixbuf__sum_histogram(format, size, values, G_N_ELEMENTS(values));
+            if (!sum->count)
+                continue;
+
+            char labels[64];
+            g_snprintf(labels, sizeof(labels), "format=\"%s\",size=\"%s\"", xz_histogram_formats[format], xz_histogram_sizes[size]);
+            _gdk_pixbuf__append_histogram(decompress, "xz_pixbuf_decompress_seconds", labels, (uint64_t *) sum->decompress,
+                XZ_HISTOGRAM_USEC_BUCKETS, usec_bounds, sum->count, sum->decompress_usec_sum / 1e6);
+            _gdk_pixbuf__append_histogram(inner_decode, "xz_pixbuf_inner_decode_seconds", labels, (uint64_t *) sum->inner_decode,
+                XZ_HISTOGRAM_USEC_BUCKETS, usec_bounds, sum->count, sum->inner_decode_usec_sum / 1e6);
+            _gdk_pixbuf__append_histogram(ratio, "xz_pixbuf_decompress_ratio", labels, (uint64_t *) sum->decompress_ratio,
+                XZ_HISTOGRAM_RATIO_BUCKETS, ratio_bounds, sum->count, sum->decompress_ratio_sum_permille / 1e3);
+        }
+    }
+    g_string_append_len(text, decompress->str, decompress->len);
+    g_string_append_len(text, inner_decode->str, inner_decode->len);
+    g_string_append_len(text, ratio->str, ratio->len);
+    g_string_free(decompress, TRUE);
+    g_string_free(inner_decode, TRUE);
+    g_string_free(ratio, TRUE);
+
+    return g_string_free(text, FALSE);
+}
+
+/* g_file_set_contents writes a temporary file and renames it over, so scrapers never see half a file */
+static void _gdk_pixbuf__write_metrics(const char *path){
+    char *text = _gdk_pixbuf__format_metrics();
+    g_file_set_contents(path, text, -1, NULL);
+    g_free(text);
+}
+
+static gpointer _gdk_pixbuf__metrics_thread(gpointer data){
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+
+    while (TRUE){
+        g_usleep(config->metrics_interval * G_USEC_PER_SEC);
+        _gdk_pixbuf__write_metrics(config->metrics_path);
+    }
+    return NULL;
+}
+
+/* The flusher thread is started by the first finished load, if a metrics file is configured */
+static void _gdk_pixbuf__start_metrics_export(void){
+    static gsize started = 0;
+
+    if (g_once_init_enter(&started)){
+        const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+        if (config->metrics_path){
+            GThread *thread = g_thread_try_new("xz-pixbuf-metrics", _gdk_pixbuf__metrics_thread, NULL, NULL);
+            if (thread)
+                g_thread_unref(thread);
+        }
+        g_once_init_leave(&started, 1);
+    }
+}
+
+/*
+ * Write the metrics a last time and print a one line summary when the process exits
+ * This also runs on every dlclose, so processes that never loaded an image, like gdk-pixbuf-query-loaders, stay quiet
+ */
+__attribute__((destructor))
+static void _gdk_pixbuf__metrics_at_exit(void){
+    XZPixbufLoaderStats stats;
+    uint64_t failures = 0;
+
+    xz_pixbuf_loader_get_stats(&stats, sizeof(stats));
+    if (!stats.loads)
+        return;
+
+    const XZLoaderConfig *config = _gdk_pixbuf__xz_config();
+    if (!config->metrics_path && !config->metrics_summary)
+        return;
+
+    if (config->metrics_path)
+        _gdk_pixbuf__write_metrics(config->metrics_path);
+    for (int reason = 0; reason < XZ_PIXBUF_FAILURE_REASONS; reason++)
+        failures += stats.failures[reason];
+
+    fprintf(stderr, "xz-pixbuf-loader: %" G_GUINT64_FORMAT " loads (%" G_GUINT64_FORMAT " failed), "
+        "%" G_GUINT64_FORMAT " bytes in, %" G_GUINT64_FORMAT " bytes out, "
+        "%.3f s in lzma_code, %.3f s in inner decode, peak memusage %" G_GUINT64_FORMAT " bytes\n",
+        stats.loads, failures, stats.compressed_bytes, stats.uncompressed_bytes,
+        stats.lzma_code_usec / 1e6, stats.inner_decode_usec / 1e6, stats.peak_memusage);
+}
+
+/*
+ * Saving: the pixbuf is encoded by an inner format's saver, whose output is streamed through an xz encoder
+ * Options starting with "xz-" are ours, all others are handed on to the inner saver
+ */
+#define XZ_SAVE_BUFFER_SIZE (1 << 16)
+
+/*
+ * Store mode writes the inner data as LZMA2 uncompressed chunks, which load at memcpy speed
+ * Auto store mode trial-compresses a sample first, and stores when that saves less than a few percent
+ */
+typedef enum {
+    XZ_STORE_NO,
+    XZ_STORE_YES,
+    XZ_STORE_AUTO
+} XZStoreMode;
+
+#define XZ_STORE_SAMPLE_SIZE (1 << 18)
+#define XZ_STORE_MIN_SAVING_PERCENT 3
+/* The most an LZMA2 uncompressed chunk holds, behind its 3 byte header */
+#define XZ_STORE_CHUNK_SIZE (1 << 16)
+#define XZ_STORE_CHUNK_HEADER 3
+
+/* Halving 16 times takes even the largest images gdk-pixbuf handles down to a few pixels */
+#define XZ_MAX_PYRAMID_LEVELS 16
+
+typedef struct {
+    const char *inner_format;
+    uint64_t threads;
+    uint32_t preset;
+    uint64_t dict_size;      /* 0 keeps the preset's */
+    uint64_t block_size;     /* 0 leaves it to the encoder */
+    uint32_t delta_distance; /* 0 for no delta filter */
+    uint32_t block_rows;     /* 0 for blocks that ignore rows */
+    uint64_t reset_interval; /* 0 for no dictionary resets inside blocks */
+    gboolean header_block;
+    uint32_t pyramid_levels; /* smaller renditions after the image */
+    XZStoreMode store;
+} XZSaveOptions;
+
+typedef struct {
+    lzma_stream lzstream;
+    uint8_t *out_buffer;
+    GdkPixbufSaveFunc save_func;
+    gpointer user_data;
+    const XZSaveOptions *options;
+
+    /* Until auto store mode has decided, the inner data is held back as the sample */
+    XZStoreMode store;
+    uint8_t *sample;
+    size_t sample_size;
+
+    /* With header_block set, the data is held back until the inner header can be given a block of its own */
+    gboolean header_block;
+
+    /* With block_rows set, blocks are split at the end of the header and then every block_rows rows */
+    uint32_t block_rows;
+    uint8_t *header;
+    size_t header_size;
+    gboolean layout_found;
+    XZRawLayout layout;
+    uint64_t input_offset;
+    uint64_t next_barrier;
+
+    /* Store mode writes the container itself, keeping the index and the block and chunk being written */
+    lzma_index *index;
+    gboolean in_block;
+    uint32_t block_header_size;
+    uint64_t block_compressed;
+    uint64_t block_uncompressed;
+    uint64_t block_crc;
+    uint8_t *chunk;
+    size_t chunk_size;
+
+    /* With reset_interval set, blocks are written the same way, their LZMA2 data restarting every reset_interval bytes */
+    lzma_options_lzma lzma_options;
+    gboolean in_segment;
+    uint64_t segment_uncompressed;
+} XZSaveContext;
+
+static gboolean _gdk_pixbuf__save_write(XZSaveContext *context, const uint8_t *data, size_t size, GError **error){
+    return size == 0 || context->save_func((const gchar *) data, size, error, context->user_data);
+}
+
+static void _gdk_pixbuf__save_lzma_error(GError **error){
+    g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Some LZMA error occurred");
+}
+
+/* Write the xz stream header and get ready to store blocks */
+static gboolean _gdk_pixbuf__store_start(XZSaveContext *context, GError **error){
+    lzma_stream_flags flags = { .version = 0, .check = LZMA_CHECK_CRC64 };
+    uint8_t stream_header[LZMA_STREAM_HEADER_SIZE];
+
+    context->index = lzma_index_init(NULL);
+    if (context->store == XZ_STORE_YES)
+        context->chunk = (uint8_t *) malloc(XZ_STORE_CHUNK_HEADER + XZ_STORE_CHUNK_SIZE);
+    if (!context->index || (context->store == XZ_STORE_YES && !context->chunk)){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Error allocating memory");
+        return FALSE;
+    }
+    if (lzma_stream_header_encode(&flags, stream_header) != LZMA_OK){
+        _gdk_pixbuf__save_lzma_error(error);
+        return FALSE;
+    }
+    return _gdk_pixbuf__save_write(context, stream_header, sizeof(stream_header), error);
+}
+
+/* Block headers name LZMA2 with the smallest dictionary when storing, as uncompressed chunks never look back */
+static gboolean _gdk_pixbuf__store_start_block(XZSaveContext *context, GError **error){
+    lzma_options_lzma lzma_options = { .dict_size = context->store == XZ_STORE_YES ? LZMA_DICT_SIZE_MIN : context->lzma_options.dict_size };
+    lzma_filter filters[2] = { { LZMA_FILTER_LZMA2, &lzma_options }, { LZMA_VLI_UNKNOWN, NULL } };
+    lzma_block block = {
+        .version = 0,
+        .check = LZMA_CHECK_CRC64,
+        .compressed_size = LZMA_VLI_UNKNOWN,
+        .uncompressed_size = LZMA_VLI_UNKNOWN,
+        .filters = filters,
+    };
+    uint8_t block_header[LZMA_BLOCK_HEADER_SIZE_MAX];
+
+    if (lzma_block_header_size(&block) != LZMA_OK || lzma_block_header_encode(&block, block_header) != LZMA_OK){
+        _gdk_pixbuf__save_lzma_error(error);
+        return FALSE;
+    }
+    context->in_block = TRUE;
+    context->block_header_size = block.header_size;
+    context->block_compressed = 0;
+    context->block_uncompressed = 0;
+    context->block_crc = 0;
+    return _gdk_pixbuf__save_write(context, block_header, block.header_size, error);
+}
+
+/* The first chunk of a block resets the dictionary, the rest don't need to */
+static gboolean _gdk_pixbuf__store_flush_chunk(XZSaveContext *context, GError **error){
+    if (context->chunk_size == 0)
+        return TRUE;
+    context->chunk[0] = context->block_compressed == 0 ? 0x01 : 0x02;
+    context->chunk[1] = (uint8_t) ((context->chunk_size - 1) >> 8);
+    context->chunk[2] = (uint8_t) (context->chunk_size - 1);
+    context->block_compressed += XZ_STORE_CHUNK_HEADER + context->chunk_size;
+    size_t size = XZ_STORE_CHUNK_HEADER + context->chunk_size;
+    context->chunk_size = 0;
+    return _gdk_pixbuf__save_write(context, context->chunk, size, error);
+}
+
+/* End the LZMA2 data, pad the block to four bytes, write its check and add it to the index */
+static gboolean _gdk_pixbuf__store_end_block(XZSaveContext *context, GError **error){
+    uint8_t trailer[1 + 3 + 8] = { 0x00 };
+
+    if (!context->in_block)
+        return TRUE;
+    if (!_gdk_pixbuf__store_flush_chunk(context, error))
+        return FALSE;
+    context->block_compressed += 1;
+    size_t padding = (4 - (context->block_compressed & 3)) & 3;
+    _gdk_pixbuf__write_le64(trailer + 1 + padding, context->block_crc);
+    context->in_block = FALSE;
+    if (lzma_index_append(context->index, NULL, context->block_header_size + context->block_compressed + 8,
+            context->block_uncompressed) != LZMA_OK){
+        _gdk_pixbuf__save_lzma_error(error);
+        return FALSE;
+    }
+    return _gdk_pixbuf__save_write(context, trailer, 1 + padding + 8, error);
+}
+
+/* Write the index and the stream footer */
+static gboolean _gdk_pixbuf__store_finish(XZSaveContext *context, GError **error){
+    lzma_stream_flags flags = { .version = 0, .check = LZMA_CHECK_CRC64 };
+    uint8_t stream_footer[LZMA_STREAM_HEADER_SIZE];
+    size_t index_pos = 0;
+    gboolean written;
+
+    if (!_gdk_pixbuf__store_end_block(context, error))
+        return FALSE;
+    size_t index_size = lzma_index_size(context->index);
+    uint8_t *index = (uint8_t *) malloc(index_size);
+    if (!index){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Error allocating memory");
+        return FALSE;
+    }
+    flags.backward_size = index_size;
+    if (lzma_index_buffer_encode(context->index, index, &index_pos, index_size) != LZMA_OK ||
+            lzma_stream_footer_encode(&flags, stream_footer) != LZMA_OK){
+        free(index);
+        _gdk_pixbuf__save_lzma_error(error);
+        return FALSE;
+    }
+    written = _gdk_pixbuf__save_write(context, index, index_size, error) &&
+        _gdk_pixbuf__save_write(context, stream_footer, sizeof(stream_footer), error);
+    free(index);
+    return written;
+}
+
+/* Store mode's counterpart of lzma_code, with blocks ended by barriers and by xz-block-size */
+static gboolean _gdk_pixbuf__store_encode(XZSaveContext *context, const uint8_t *buf, size_t size, lzma_action action, GError **error){
+    uint64_t block_size = context->options->block_size;
+
+    while (size > 0){
+        if (!context->in_block && !_gdk_pixbuf__store_start_block(context, error))
+            return FALSE;
+        size_t length = MIN(size, XZ_STORE_CHUNK_SIZE - context->chunk_size);
+        if (block_size)
+            length = (size_t) MIN((uint64_t) length, block_size - context->block_uncompressed);
+        memcpy(context->chunk + XZ_STORE_CHUNK_HEADER + context->chunk_size, buf, length);
+        context->block_crc = lzma_crc64(buf, length, context->block_crc);
+        context->chunk_size += length;
+        context->block_uncompressed += length;
+        buf += length;
+        size -= length;
+
+        if (context->chunk_size == XZ_STORE_CHUNK_SIZE && !_gdk_pixbuf__store_flush_chunk(context, error))
+            return FALSE;
+        if (block_size && context->block_uncompressed == block_size && !_gdk_pixbuf__store_end_block(context, error))
+            return FALSE;
+    }
+
+    if (action == LZMA_FINISH)
+        return _gdk_pixbuf__store_finish(context, error);
+    if (action != LZMA_RUN)
+        return _gdk_pixbuf__store_end_block(context, error);
+    return TRUE;
+}
+
+/* Pass on the raw encoder's output, keeping count of it as block data */
+static gboolean _gdk_pixbuf__reset_code(XZSaveContext *context, const uint8_t *buf, size_t size, lzma_action action, GError **error){
+    lzma_stream *lzstream = &context->lzstream;
+
+    lzstream->next_in = buf;
+    lzstream->avail_in = size;
+    while (TRUE){
+        lzma_ret lzret = lzma_code(lzstream, action);
+        if (lzret != LZMA_OK && lzret != LZMA_STREAM_END){
+            _gdk_pixbuf__save_lzma_error(error);
+            return FALSE;
+        }
+        if (lzstream->avail_out == 0 || lzret == LZMA_STREAM_END){
+            size_t out_size = XZ_SAVE_BUFFER_SIZE - lzstream->avail_out;
+            context->block_compressed += out_size;
+            if (!_gdk_pixbuf__save_write(context, context->out_buffer, out_size, error))
+                return FALSE;
+            lzstream->next_out = context->out_buffer;
+            lzstream->avail_out = XZ_SAVE_BUFFER_SIZE;
+        }
+        if (lzret == LZMA_STREAM_END || (action == LZMA_RUN && lzstream->avail_in == 0))
+            return TRUE;
+    }
+}
+
+/*
+ * Flush the segment's last chunk without an end marker, so the block's LZMA2 data can go on
+ * The next segment gets an encoder of its own, as only a new one starts with a dictionary reset
+ */
+static gboolean _gdk_pixbuf__reset_end_segment(XZSaveContext *context, GError **error){
+    if (!context->in_segment)
+        return TRUE;
+    context->in_segment = FALSE;
+    return _gdk_pixbuf__reset_code(context, NULL, 0, LZMA_SYNC_FLUSH, error);
+}
+
+/* Reset mode's counterpart of lzma_code, with segments ended every reset_interval bytes and blocks as in store mode */
+static gboolean _gdk_pixbuf__reset_encode(XZSaveContext *context, const uint8_t *buf, size_t size, lzma_action action, GError **error){
+    lzma_filter filters[2] = { { LZMA_FILTER_LZMA2, &context->lzma_options }, { LZMA_VLI_UNKNOWN, NULL } };
+    uint64_t block_size = context->options->block_size;
+    uint64_t reset_interval = context->options->reset_interval;
+
+    if (!context->index && !_gdk_pixbuf__store_start(context, error))
+        return FALSE;
+    while (size > 0){
+        if (!context->in_block && !_gdk_pixbuf__store_start_block(context, error))
+            return FALSE;
+        if (!context->in_segment){
+            if (lzma_raw_encoder(&context->lzstream, filters) != LZMA_OK){
+                _gdk_pixbuf__save_lzma_error(error);
+                return FALSE;
+            }
+            context->in_segment = TRUE;
+            context->segment_uncompressed = 0;
+        }
+        size_t length = (size_t) MIN((uint64_t) size, reset_interval - context->segment_uncompressed);
+        if (block_size)
+            length = (size_t) MIN((uint64_t) length, block_size - context->block_uncompressed);
+        if (!_gdk_pixbuf__reset_code(context, buf, length, LZMA_RUN, error))
+            return FALSE;
+        context->block_crc = lzma_crc64(buf, length, context->block_crc);
+        context->segment_uncompressed += length;
+        context->block_uncompressed += length;
+        buf += length;
+        size -= length;
+
+        if (context->segment_uncompressed == reset_interval && !_gdk_pixbuf__reset_end_segment(context, error))
+            return FALSE;
+        if (block_size && context->block_uncompressed == block_size &&
+                !(_gdk_pixbuf__reset_end_segment(context, error) && _gdk_pixbuf__store_end_block(context, error)))
+            return FALSE;
+    }
+
+    if (action != LZMA_RUN && !_gdk_pixbuf__reset_end_segment(context, error))
+        return FALSE;
+    if (action == LZMA_FINISH)
+        return _gdk_pixbuf__store_finish(context, error);
+    if (action != LZMA_RUN)
+        return _gdk_pixbuf__store_end_block(context, error);
+    return TRUE;
+}
+
+/* Set up the lzma encoder the options ask for, returning why it couldn't be if it couldn't */
+static const char *_gdk_pixbuf__save_start_encoder(XZSaveContext *context){
+    const XZSaveOptions *options = context->options;
+    lzma_options_lzma lzma_options;
+    lzma_options_delta delta_options = { .type = LZMA_DELTA_TYPE_BYTE };
+    lzma_filter filters[3];
+    unsigned n_filters = 0;
+    lzma_ret lzret;
+
+    if (lzma_lzma_preset(&lzma_options, options->preset))
+        return "Unsupported xz-preset";
+    if (options->dict_size)
+        lzma_options.dict_size = options->dict_size;
+    if (options->delta_distance){
+        delta_options.dist = options->delta_distance;
+        filters[n_filters++] = (lzma_filter) { LZMA_FILTER_DELTA, &delta_options };
+    }
+    filters[n_filters++] = (lzma_filter) { LZMA_FILTER_LZMA2, &lzma_options };
+    filters[n_filters] = (lzma_filter) { LZMA_VLI_UNKNOWN, NULL };
+
+    /* Reset mode starts a raw encoder for each segment, whose dictionary never needs to outgrow a segment */
+    if (options->reset_interval){
+        context->lzma_options = lzma_options;
+        context->lzma_options.dict_size = (uint32_t) MIN((uint64_t) lzma_options.dict_size, MAX(options->reset_interval, LZMA_DICT_SIZE_MIN));
+        lzret = LZMA_OK;
+    } else if (options->threads > 1 || options->block_size){
+        /* Only the threaded encoder splits the stream into blocks, which is what lets loads decode it in parallel */
+        lzma_mt mt = { .threads = options->threads, .block_size = options->block_size, .filters = filters, .check = LZMA_CHECK_CRC64 };
+        lzret = lzma_stream_encoder_mt(&context->lzstream, &mt);
+    } else {
+        lzret = lzma_stream_encoder(&context->lzstream, filters, LZMA_CHECK_CRC64);
+    }
+    if (lzret != LZMA_OK)
+        return lzret == LZMA_MEM_ERROR ? "Error allocating memory" : "Could not create lzma encoder with these options";
+
+    context->out_buffer = (uint8_t *) malloc(XZ_SAVE_BUFFER_SIZE);
+    if (!context->out_buffer)
+        return "Error allocating memory";
+    context->lzstream.next_out = context->out_buffer;
+    context->lzstream.avail_out = XZ_SAVE_BUFFER_SIZE;
+    return NULL;
+}
+
+/* Feed the encoder, passing its output on whenever the output buffer fills up, and at the end */
+static gboolean _gdk_pixbuf__save_encode(XZSaveContext *context, const uint8_t *buf, size_t size, lzma_action action, GError **error){
+    lzma_stream *lzstream = &context->lzstream;
+
+    if (context->store == XZ_STORE_YES)
+        return _gdk_pixbuf__store_encode(context, buf, size, action, error);
+    if (context->options->reset_interval)
+        return _gdk_pixbuf__reset_encode(context, buf, size, action, error);
+
+    lzstream->next_in = buf;
+    lzstream->avail_in = size;
+    while (TRUE){
+        lzma_ret lzret = lzma_code(lzstream, action);
+        if (lzret != LZMA_OK && lzret != LZMA_STREAM_END){
+            _gdk_pixbuf__save_lzma_error(error);
+            return FALSE;
+        }
+        if (lzstream->avail_out == 0 || (lzret == LZMA_STREAM_END && action == LZMA_FINISH)){
+            size_t out_size = XZ_SAVE_BUFFER_SIZE - lzstream->avail_out;
+            if (!_gdk_pixbuf__save_write(context, context->out_buffer, out_size, error))
+                return FALSE;
+            lzstream->next_out = context->out_buffer;
+            lzstream->avail_out = XZ_SAVE_BUFFER_SIZE;
+        }
+        if (lzret == LZMA_STREAM_END || (action == LZMA_RUN && lzstream->avail_in == 0))
+            return TRUE;
+    }
+}
+
+/* Feed the encoder, ending the block at each row boundary that is due */
+static gboolean _gdk_pixbuf__save_encode_rows(XZSaveContext *context, const uint8_t *buf, size_t size, GError **error){
+    uint64_t pixel_end = context->layout.pixel_offset + context->layout.row_bytes * context->layout.rows;
+
+    while (size > 0){
+        size_t length = (size_t) MIN((uint64_t) size, context->next_barrier - context->input_offset);
+        if (!_gdk_pixbuf__save_encode(context, buf, length, LZMA_RUN, error))
+            return FALSE;
+        context->input_offset += length;
+        buf += length;
+        size -= length;
+
+        if (context->input_offset == context->next_barrier){
+            if (!_gdk_pixbuf__save_encode(context, NULL, 0, LZMA_FULL_BARRIER, error))
+                return FALSE;
+            context->next_barrier += context->layout.row_bytes * context->block_rows;
+            if (context->next_barrier >= pixel_end)
+                context->next_barrier = UINT64_MAX;
+        }
+    }
+    return TRUE;
+}
+
+/* The fewest leading bytes the inner header can be read from */
+static size_t _gdk_pixbuf__inner_header_size(const uint8_t *buf, size_t size){
+    XZInnerHeader header;
+    size_t low = 0, high = size;
+
+    while (low < high){
+        size_t middle = low + (high - low) / 2;
+        if (_gdk_pixbuf__parse_inner_header(buf, middle, &header) == XZ_HEADER_FOUND)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    return high;
+}
+
+/* End the first block right after the inner header, and pass on whatever was held back */
+static gboolean _gdk_pixbuf__save_header_block(XZSaveContext *context, GError **error){
+    XZInnerHeader header;
+    size_t split = 0;
+
+    context->header_block = FALSE;
+    if (_gdk_pixbuf__parse_inner_header(context->header, context->header_size, &header) == XZ_HEADER_FOUND){
+        split = _gdk_pixbuf__inner_header_size(context->header, context->header_size);
+        /* The block must hold a header that parses on its own, or there is no point ending it early */
+        if (_gdk_pixbuf__parse_inner_header(context->header, split, &header) != XZ_HEADER_FOUND)
+            split = 0;
+    }
+    if (split){
+        if (!_gdk_pixbuf__save_encode(context, context->header, split, LZMA_RUN, error) ||
+                !_gdk_pixbuf__save_encode(context, NULL, 0, LZMA_FULL_BARRIER, error))
+            return FALSE;
+    }
+    return _gdk_pixbuf__save_encode(context, context->header + split, context->header_size - split, LZMA_RUN, error);
+}
+
+/* Inner data once store mode is settled */
+static gboolean _gdk_pixbuf__save_inner_data(XZSaveContext *context, const uint8_t *buf, size_t count, GError **error){
+    if (context->header_block){
+        XZInnerHeader header;
+        uint8_t *held = (uint8_t *) realloc(context->header, context->header_size + count);
+        if (!held){
+            g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Error allocating memory");
+            return FALSE;
+        }
+        memcpy(held + context->header_size, buf, count);
+        context->header = held;
+        context->header_size += count;
+        if (_gdk_pixbuf__parse_inner_header(context->header, context->header_size, &header) == XZ_HEADER_NEED_MORE &&
+                context->header_size < XZ_HEADER_SNIFF_LIMIT)
+            return TRUE;
+        return _gdk_pixbuf__save_header_block(context, error);
+    }
+    if (!context->block_rows)
+        return _gdk_pixbuf__save_encode(context, buf, count, LZMA_RUN, error);
+    if (context->layout_found)
+        return _gdk_pixbuf__save_encode_rows(context, buf, count, error);
+
+    /* Hold the data back until we know where its rows start */
+    uint8_t *header = (uint8_t *) realloc(context->header, context->header_size + count);
+    if (!header){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Error allocating memory");
+        return FALSE;
+    }
+    memcpy(header + context->header_size, buf, count);
+    context->header = header;
+    context->header_size += count;
+
+    XZHeaderState state = _gdk_pixbuf__parse_raw_layout(context->header, context->header_size, &context->layout);
+    if (state == XZ_HEADER_NEED_MORE && context->header_size < XZ_MAX_RAW_HEADER)
+        return TRUE;
+    if (state != XZ_HEADER_FOUND){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION,
+            "xz-block-rows needs an inner format that stores rows uncompressed, such as bmp or pnm");
+        return FALSE;
+    }
+    context->layout_found = TRUE;
+    context->next_barrier = context->layout.pixel_offset;
+    return _gdk_pixbuf__save_encode_rows(context, context->header, context->header_size, error);
+}
+
+/* Trial-compress the sample to settle auto store mode, then pass the sample on */
+static gboolean _gdk_pixbuf__save_decide_store(XZSaveContext *context, GError **error){
+    const char *error_message;
+    gboolean passed;
+
+    context->store = XZ_STORE_NO;
+    if (context->sample_size > 0){
+        size_t out_size = lzma_stream_buffer_bound(context->sample_size);
+        size_t out_pos = 0;
+        uint8_t *out = (uint8_t *) malloc(out_size);
+        if (!out){
+            g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Error allocating memory");
+            return FALSE;
+        }
+        if (lzma_easy_buffer_encode(context->options->preset, LZMA_CHECK_NONE, NULL, context->sample, context->sample_size,
+                out, &out_pos, out_size) == LZMA_OK &&
+                out_pos * 100 >= (uint64_t) context->sample_size * (100 - XZ_STORE_MIN_SAVING_PERCENT))
+            context->store = XZ_STORE_YES;
+        free(out);
+    }
+
+    if (context->store == XZ_STORE_YES){
+        if (!_gdk_pixbuf__store_start(context, error))
+            return FALSE;
+    } else if ((error_message = _gdk_pixbuf__save_start_encoder(context))){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "%s", error_message);
+        return FALSE;
+    }
+    passed = _gdk_pixbuf__save_inner_data(context, context->sample, context->sample_size, error);
+    free(context->sample);
+    context->sample = NULL;
+    return passed;
+}
+
+static gboolean _gdk_pixbuf__save_inner_chunk(const gchar *buf, gsize count, GError **error, gpointer data){
+    XZSaveContext *context = (XZSaveContext *) data;
+
+    if (context->store != XZ_STORE_AUTO)
+        return _gdk_pixbuf__save_inner_data(context, (const uint8_t *) buf, count, error);
+
+    uint8_t *sample = (uint8_t *) realloc(context->sample, context->sample_size + count);
+    if (!sample){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Error allocating memory");
+        return FALSE;
+    }
+    memcpy(sample + context->sample_size, buf, count);
+    context->sample = sample;
+    context->sample_size += count;
+    return context->sample_size < XZ_STORE_SAMPLE_SIZE || _gdk_pixbuf__save_decide_store(context, error);
+}
+
+static gboolean _gdk_pixbuf__save_file_chunk(const gchar *buf, gsize count, GError **error, gpointer data){
+    if (fwrite(buf, 1, count, (FILE *) data) != count){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "Error writing file with fwrite");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static const char *const xz_save_options[] = {
+    "xz-inner-format", "xz-threads", "xz-preset", "xz-dict-size", "xz-block-size", "xz-filter", "xz-block-rows",
+    "xz-store", "xz-reset-interval", "xz-header-block", "xz-pyramid", NULL
+};
+
+static gboolean gdk_pixbuf__xz_is_save_option_supported(const gchar *option_key){
+    return g_strv_contains(xz_save_options, option_key);
+}
+
+/* A byte count, optionally in KiB, MiB or GiB */
+static gboolean _gdk_pixbuf__parse_save_size(const char *value, uint64_t *size){
+    char *end;
+    uint64_t number = g_ascii_strtoull(value, &end, 10);
+    unsigned shift = 0;
+
+    if (end == value)
+        return FALSE;
+    if (!strcmp(end, "KiB"))
+        shift = 10;
+    else if (!strcmp(end, "MiB"))
+        shift = 20;
+    else if (!strcmp(end, "GiB"))
+        shift = 30;
+    else if (*end)
+        return FALSE;
+    if (number > (UINT64_MAX >> shift))
+        return FALSE;
+    *size = number << shift;
+    return TRUE;
+}
+
+/* Sort the options into ours and the inner saver's, returning why they can't be used if they can't */
+static const char *_gdk_pixbuf__parse_save_options(gchar **option_keys, gchar **option_values, XZSaveOptions *options,
+        gchar **inner_keys, gchar **inner_values){
+
+    guint n_inner = 0;
+
+    *options = (XZSaveOptions) {
+        .inner_format = "png",
+        .threads = _gdk_pixbuf__xz_config()->encode_threads,
+        .preset = LZMA_PRESET_DEFAULT,
+    };
+    for (guint i = 0; option_keys && option_keys[i]; i++){
+        const char *key = option_keys[i], *value = option_values[i];
+        char *end;
+
+        if (!strcmp(key, "xz-inner-format")){
+            if (!g_ascii_strcasecmp(value, "xz"))
+                return "xz-inner-format can't be xz itself";
+            options->inner_format = value;
+        } else if (!strcmp(key, "xz-threads")){
+            options->threads = g_ascii_strtoull(value, &end, 10);
+            if (end == value || *end)
+                return "xz-threads must be a number of threads, or 0 for one per processor";
+            options->threads = _gdk_pixbuf__encode_threads(options->threads);
+        } else if (!strcmp(key, "xz-preset")){
+            options->preset = g_ascii_strtoull(value, &end, 10);
+            if (end == value || options->preset > 9 || (*end && strcmp(end, "e")))
+                return "xz-preset must be a level from 0 to 9, optionally followed by e";
+            if (*end)
+                options->preset |= LZMA_PRESET_EXTREME;
+        } else if (!strcmp(key, "xz-dict-size")){
+            if (!_gdk_pixbuf__parse_save_size(value, &options->dict_size) ||
+                    options->dict_size < LZMA_DICT_SIZE_MIN || options->dict_size > (UINT32_C(1) << 30) + (UINT32_C(1) << 29))
+                return "xz-dict-size must be a size between 4KiB and 1536MiB";
+        } else if (!strcmp(key, "xz-block-size")){
+            if (!_gdk_pixbuf__parse_save_size(value, &options->block_size) || options->block_size == 0)
+                return "xz-block-size must be a size in bytes, KiB, MiB or GiB";
+        } else if (!strcmp(key, "xz-block-rows")){
+            uint64_t rows = g_ascii_strtoull(value, &end, 10);
+            if (end == value || *end || rows == 0 || rows > UINT32_MAX)
+                return "xz-block-rows must be a positive number of rows";
+            options->block_rows = (uint32_t) rows;
+        } else if (!strcmp(key, "xz-reset-interval")){
+            if (!_gdk_pixbuf__parse_save_size(value, &options->reset_interval) || options->reset_interval == 0)
+                return "xz-reset-interval must be a size in bytes, KiB, MiB or GiB";
+        } else if (!strcmp(key, "xz-header-block")){
+            if (!strcmp(value, "no"))
+                options->header_block = FALSE;
+            else if (!strcmp(value, "yes"))
+                options->header_block = TRUE;
+            else
+                return "xz-header-block must be yes or no";
+        } else if (!strcmp(key, "xz-pyramid")){
+            uint64_t levels = g_ascii_strtoull(value, &end, 10);
+            if (end == value || *end || levels > XZ_MAX_PYRAMID_LEVELS)
+                return "xz-pyramid must be a number of levels from 0 to 16";
+            options->pyramid_levels = (uint32_t) levels;
+        } else if (!strcmp(key, "xz-store")){
+            if (!strcmp(value, "no"))
+                options->store = XZ_STORE_NO;
+            else if (!strcmp(value, "yes"))
+                options->store = XZ_STORE_YES;
+            else if (!strcmp(value, "auto"))
+                options->store = XZ_STORE_AUTO;
+            else
+                return "xz-store must be no, yes or auto";
+        } else if (!strcmp(key, "xz-filter")){
+            if (!strcmp(value, "lzma2")){
+                options->delta_distance = 0;
+            } else if (!strcmp(value, "delta")){
+                options->delta_distance = 1;
+            } else if (g_str_has_prefix(value, "delta:dist=")){
+                const char *distance = value + strlen("delta:dist=");
+                options->delta_distance = g_ascii_strtoull(distance, &end, 10);
+                if (end == distance || *end || options->delta_distance < LZMA_DELTA_DIST_MIN || options->delta_distance > LZMA_DELTA_DIST_MAX)
+                    return "xz-filter delta distance must be from 1 to 256";
+            } else {
+                return "xz-filter must be lzma2, delta or delta:dist=N";
+            }
+        } else {
+            inner_keys[n_inner] = option_keys[i];
+            inner_values[n_inner] = option_values[i];
+            n_inner++;
+        }
+    }
+    if (options->block_rows && options->block_size)
+        return "xz-block-rows and xz-block-size can't be used together";
+    /* Segments only decode on their own when nothing but LZMA2 looks back */
+    if (options->reset_interval && options->delta_distance)
+        return "xz-reset-interval can't be used with the delta filter";
+    /* Levels are told apart by their inner headers, so the loader has to be able to read them */
+    if (options->pyramid_levels){
+        gboolean readable = FALSE;
+        for (size_t i = 0; i < XZ_HISTOGRAM_FORMATS - 1; i++)
+            readable |= !strcmp(options->inner_format, xz_histogram_formats[i]);
+        if (!readable)
+            return "xz-pyramid needs an inner format whose header the loader can read, such as png, jpeg, bmp or webp";
+    }
+    return NULL;
+}
+
+/* Write one xz stream holding pixbuf in the inner format */
+static gboolean _gdk_pixbuf__save_stream(GdkPixbufSaveFunc save_func, gpointer user_data, GdkPixbuf *pixbuf,
+        const XZSaveOptions *options, gchar **inner_keys, gchar **inner_values, GError **error){
+
+    XZSaveContext context = { .lzstream = LZMA_STREAM_INIT, .save_func = save_func, .user_data = user_data };
+    const char *error_message;
+    gboolean saved = FALSE;
+
+    context.options = options;
+    context.store = options->store;
+    context.block_rows = options->block_rows;
+    /* Row blocks already give the header a block of its own */
+    context.header_block = options->header_block && !options->block_rows;
+
+    /* Auto store mode only picks an encoder once it has seen a sample */
+    if (context.store == XZ_STORE_YES){
+        if (!_gdk_pixbuf__store_start(&context, error))
+            goto cleanup;
+    } else if (context.store == XZ_STORE_NO && (error_message = _gdk_pixbuf__save_start_encoder(&context))){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED, "%s", error_message);
+        goto cleanup;
+    }
+
+    /* All of these set error themselves */
+    saved = gdk_pixbuf_save_to_callbackv(pixbuf, _gdk_pixbuf__save_inner_chunk, &context, options->inner_format, inner_keys, inner_values, error) &&
+        (context.store != XZ_STORE_AUTO || _gdk_pixbuf__save_decide_store(&context, error)) &&
+        (!context.header_block || _gdk_pixbuf__save_header_block(&context, error)) &&
+        _gdk_pixbuf__save_encode(&context, NULL, 0, LZMA_FINISH, error);
+
+cleanup:
+    lzma_end(&context.lzstream);
+    if (context.index)
+        lzma_index_end(context.index, NULL);
+    free(context.out_buffer);
+    free(context.header);
+    free(context.sample);
+    free(context.chunk);
+    return saved;
+}
+
+/* Write the stream that marks the end of a pyramid's image, with the levels after it */
+static gboolean _gdk_pixbuf__save_pyramid_marker(GdkPixbufSaveFunc save_func, gpointer user_data, GError **error){
+    uint8_t out[256];
+    size_t out_size = 0;
+
+    if (lzma_easy_buffer_encode(0, LZMA_CHECK_NONE, NULL, (const uint8_t *) XZ_PYRAMID_MARKER, XZ_PYRAMID_MARKER_SIZE,
+            out, &out_size, sizeof(out)) != LZMA_OK){
+        _gdk_pixbuf__save_lzma_error(error);
+        return FALSE;
+    }
+    return save_func((const gchar *) out, out_size, error, user_data);
+}
+
+/*
+ * With xz-pyramid, each level after the image itself is half the size of the one before, in a stream of its own
+ * A marker stream between the image and the levels tells loads where the image ends
+ * Every stream gets a header block, so loads can size them all up cheaply
+ */
+static gboolean gdk_pixbuf__save_xz_image_to_callback(GdkPixbufSaveFunc save_func, gpointer user_data, GdkPixbuf *pixbuf,
+        gchar **option_keys, gchar **option_values, GError **error){
+
+    XZSaveOptions options;
+    guint n_options = option_keys ? g_strv_length(option_keys) : 0;
+    gchar **inner_keys = g_new0(gchar *, n_options + 1);
+    gchar **inner_values = g_new0(gchar *, n_options + 1);
+    const char *error_message;
+    gboolean saved = FALSE;
+
+    error_message = _gdk_pixbuf__parse_save_options(option_keys, option_values, &options, inner_keys, inner_values);
+    if (error_message){
+        g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_BAD_OPTION, "%s", error_message);
+        goto cleanup;
+    }
+    if (options.pyramid_levels)
+        options.header_block = TRUE;
+    saved = _gdk_pixbuf__save_stream(save_func, user_data, pixbuf, &options, inner_keys, inner_values, error);
+    if (saved && options.pyramid_levels)
+        saved = _gdk_pixbuf__save_pyramid_marker(save_func, user_data, error);
+
+    GdkPixbuf *level = g_object_ref(pixbuf);
+    for (uint32_t i = 0; saved && i < options.pyramid_levels; i++){
+        int width = gdk_pixbuf_get_width(level) / 2, height = gdk_pixbuf_get_height(level) / 2;
+        if (width < 1 || height < 1)
+            break;
+        GdkPixbuf *smaller = gdk_pixbuf_scale_simple(level, width, height, GDK_INTERP_BILINEAR);
+        g_object_unref(level);
+        level = smaller;
+        if (!level){
+            g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_INSUFFICIENT_MEMORY, "Error allocating memory");
+            saved = FALSE;
+            break;
+        }
+        saved = _gdk_pixbuf__save_stream(save_func, user_data, level, &options, inner_keys, inner_values, error);
+    }
+    if (level)
+        g_object_unref(level);
+
+cleanup:
+    g_free(inner_keys);
+    g_free(inner_values);
+    return saved;
+}
+
+static gboolean gdk_pixbuf__save_xz_image(FILE *file, GdkPixbuf *pixbuf, gchar **option_keys, gchar **option_values, GError **error){
+    return gdk_pixbuf__save_xz_image_to_callback(_gdk_pixbuf__save_file_chunk, file, pixbuf, option_keys, option_values, error);
 }
 
 /* Gdk Pixbuf clients call this */
 void fill_vtable(GdkPixbufModule *module) {
     module->load = gdk_pixbuf__load_xz_image;
+    module->load_animation = gdk_pixbuf__load_xz_animation;
     module->begin_load = gdk_pixbuf__begin_load_xz_image;
     module->stop_load = gdk_pixbuf__stop_load_xz_image;
     module->load_increment = gdk_pixbuf__load_xz_image_increment;
+    module->save = gdk_pixbuf__save_xz_image;
+    module->save_to_callback = gdk_pixbuf__save_xz_image_to_callback;
+    module->is_save_option_supported = gdk_pixbuf__xz_is_save_option_supported;
 }
 
 /* Gdk Pixbuf clients call this */
@@ -346,6 +5225,6 @@ void fill_info(GdkPixbufFormat *info) {
     info->description = "xz-compressed Image";
     info->mime_types  = mime_types;
     info->extensions  = extensions;
-    info->flags       = GDK_PIXBUF_FORMAT_THREADSAFE;
+    info->flags       = GDK_PIXBUF_FORMAT_WRITABLE | GDK_PIXBUF_FORMAT_THREADSAFE;
     info->license     = "MIT";
 }
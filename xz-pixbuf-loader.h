@@ -0,0 +1,123 @@
+/* GdkPixbuf library - .image.xz Image Loader
+ *
+ * Author(s): Leo Izen (thebombzen) <leo.izen@gmail.com>
+ *
+ * Copyright (C) 2020 Leo Izen (thebombzen)
+ *
+ * Permission is hereby granted, free of charge, to any person 
+ * obtaining a copy of this software and associated documentation 
+ * files (the "Software"), to deal in the Software without 
+ * restriction, including without limitation the rights to use, 
+ * copy, modify, merge, publish, distribute, sublicense, and/or 
+ * sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following 
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be 
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, 
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES 
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT 
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, 
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR 
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Functions the loader module exports besides fill_vtable and fill_info
+ * They are meant to be looked up with dlsym on the already loaded module
+ */
+
+#ifndef XZ_PIXBUF_LOADER_H
+#define XZ_PIXBUF_LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Why a load failed */
+typedef enum {
+    XZ_PIXBUF_FAILURE_ALLOC,
+    XZ_PIXBUF_FAILURE_IO,
+    XZ_PIXBUF_FAILURE_LZMA,
+    XZ_PIXBUF_FAILURE_INNER_DECODE,
+    XZ_PIXBUF_FAILURE_LIMIT,
+    XZ_PIXBUF_FAILURE_CANCELLED,
+    XZ_PIXBUF_FAILURE_REASONS
+} XZPixbufFailureReason;
+
+/*
+ * Per-process loader counters, summed over all threads
+ * Times are in microseconds, sizes in bytes
+ */
+typedef struct {
+    uint64_t loads;
+    uint64_t failures[XZ_PIXBUF_FAILURE_REASONS];
+    uint64_t compressed_bytes;
+    uint64_t uncompressed_bytes;
+    uint64_t lzma_code_usec;
+    uint64_t inner_decode_usec;
+    uint64_t buffer_growths;
+    uint64_t peak_memusage;
+    uint64_t memory_cache_hits;
+    uint64_t disk_cache_hits;
+    uint64_t pixel_cache_hits;
+    uint64_t broker_hits;
+    uint64_t parallel_decodes;
+    uint64_t region_decodes;
+    uint64_t passthrough_bytes;
+    uint64_t segment_decodes;
+    uint64_t pyramid_decodes;
+    uint64_t animations;
+} XZPixbufLoaderStats;
+
+/*
+ * Fill in a snapshot of the counters
+ * Pass sizeof(XZPixbufLoaderStats), only that many bytes are written
+ * Returns the size of the loader's own XZPixbufLoaderStats
+ */
+size_t xz_pixbuf_loader_get_stats(XZPixbufLoaderStats *stats, size_t stats_size);
+
+/* What is known about the image inside an .xz file without decoding it */
+typedef struct {
+    char format[16];
+    uint32_t width;
+    uint32_t height;
+    uint64_t uncompressed_size;
+    /* Nonzero when the answer came from the user.xzpixbuf.info attribute */
+    int from_xattr;
+} XZPixbufFileInfo;
+
+/*
+ * Describe the inner image of filename, from its user.xzpixbuf.info attribute when that is
+ * current, or else by decompressing just its header and reading the xz index
+ * Pass sizeof(XZPixbufFileInfo), only that many bytes are written
+ * Returns nonzero on success, zero if the file can't be read or its inner format is unknown
+ */
+int xz_pixbuf_loader_get_file_info(const char *filename, XZPixbufFileInfo *info, size_t info_size);
+
+/*
+ * Write filename.xzidx, a sidecar index of the blocks in filename and of its inner header
+ * It lets the loader plan a parallel decode without reading the index at the end of the file
+ * Returns nonzero on success
+ */
+int xz_pixbuf_loader_write_index(const char *filename);
+
+struct _GdkPixbuf;
+struct _GError;
+
+/*
+ * Decode the width by height rectangle at x, y of filename's inner image, scaled by scale (1 for full size)
+ * Only the blocks holding those rows are decompressed, which pays off for files saved with xz-block-rows
+ * The header is read from the start of the first block, but a file in a single block is decompressed
+ * from its start as far as the region's last row
+ * The inner format must store its rows uncompressed: binary PNM or PAM, 24 or 32 bit uncompressed BMP, or farbfeld
+ * Returns a new GdkPixbuf, or NULL with error set
+ */
+struct _GdkPixbuf *xz_pixbuf_loader_load_region(const char *filename, int x, int y, int width, int height,
+    double scale, struct _GError **error);
+
+#endif /* XZ_PIXBUF_LOADER_H */